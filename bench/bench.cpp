@@ -0,0 +1,519 @@
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+#include "glm/ext.hpp"
+
+#include "graphics_api.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Renders a set of scripted scenes in headless mode and prints the results as JSON, so runs
+// can be diffed between commits. Scene animation is driven by the frame number instead of the
+// clock, so every run renders exactly the same frames.
+
+namespace {
+
+    using Clock = std::chrono::high_resolution_clock;
+
+    const float FRAME_TIME = 1.0f / 60.0f; // simulated time step
+
+    struct Scene {
+        const char* name;
+        std::function<bool()> setup;
+        std::function<void(uint32_t frame)> submit; // submit the draws for a frame
+        std::function<void()> teardown;
+    };
+
+    struct SceneResult {
+        std::string name;
+        std::vector<double> frameMilliseconds;
+        double seconds = 0;
+        graphics::FrameStats frameStats;       // delta over the timed frames
+        graphics::UploadStats uploadStats;     // delta over the timed frames
+        graphics::AllocatorStats allocatorStats;
+        uint64_t allocations = 0;              // allocateMemory calls during the scene
+        uint64_t deviceMemoryAllocations = 0;  // vkAllocateMemory calls during the scene
+        std::vector<graphics::GpuScopeStats> gpuStats;
+    };
+
+    glm::mat4 spin(uint32_t frame) {
+        return glm::rotate(glm::mat4(1.0f), frame * FRAME_TIME * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+    }
+
+    // scene data
+    const uint32_t GRID_SIZE = 128;
+    const uint32_t INSTANCE_GRID_SIZE = 316; // ~100k instances
+    const uint32_t OCCLUSION_GRID_SIZE = 32;
+    const uint32_t OCCLUSION_LAYERS = 16;
+    const uint32_t LOD_GRID_SIZE = 32;
+    const uint32_t LOD_SPHERE_RINGS = 100;    // ~40k triangles
+    std::vector<glm::mat4> instanceModels;
+    graphics::Scene* scene = nullptr;
+    graphics::GpuScene* gpuScene = nullptr;
+    graphics::Mesh lodMesh;
+    const VkDeviceSize STREAM_SIZE = 4 * 1024 * 1024;
+    VkBuffer streamBuffer;
+    graphics::Allocation streamAllocation;
+    std::vector<uint8_t> streamData;
+
+    /** A bumpy sphere of radius about 1, with a seam, fine enough to be worth simplifying. */
+    graphics::MeshData makeSphere(uint32_t rings) {
+        graphics::MeshData mesh;
+        uint32_t segments = 2 * rings;
+        for (uint32_t ring = 0; ring <= rings; ++ring) {
+            for (uint32_t segment = 0; segment <= segments; ++segment) {
+                float theta = glm::pi<float>() * ring / rings;
+                float phi = 2.0f * glm::pi<float>() * segment / segments;
+                glm::vec3 normal(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
+                float radius = 1.0f + 0.05f * std::sin(7.0f * theta) * std::cos(5.0f * phi);
+                mesh.vertices.push_back({ radius * normal, normal, 0.5f * normal + 0.5f });
+            }
+        }
+        for (uint32_t ring = 0; ring < rings; ++ring) {
+            for (uint32_t segment = 0; segment < segments; ++segment) {
+                uint32_t a = ring * (segments + 1) + segment, b = a + 1, c = a + segments + 1, d = c + 1;
+                mesh.indices.insert(mesh.indices.end(), { a, c, b, b, c, d });
+            }
+        }
+        mesh.boundsMin = glm::vec3(-1.05f);
+        mesh.boundsMax = glm::vec3(1.05f);
+        return mesh;
+    }
+
+    std::vector<Scene> makeScenes() {
+        std::vector<Scene> scenes;
+
+        scenes.push_back({ "single_quad",
+            [] { return true; },
+            [](uint32_t frame) { graphics::submitDraw(graphics::quadMesh, spin(frame)); },
+            [] {}
+        });
+
+        // lots of small draws, to stress recording
+        scenes.push_back({ "many_draws",
+            [] { return true; },
+            [](uint32_t frame) {
+                glm::mat4 rotation = spin(frame);
+                float scale = 2.0f / GRID_SIZE;
+                for (uint32_t y = 0; y < GRID_SIZE; ++y) {
+                    for (uint32_t x = 0; x < GRID_SIZE; ++x) {
+                        glm::vec3 position((x + 0.5f) * scale - 1.0f, (y + 0.5f) * scale - 1.0f, 0.0f);
+                        glm::mat4 model = glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(scale * 0.4f));
+                        graphics::submitDraw(graphics::quadMesh, rotation * model);
+                    }
+                }
+            },
+            [] {}
+        });
+
+        // the many_draws grid spread over an area much larger than the view, so most of it
+        // gets frustum culled before recording
+        scenes.push_back({ "culling",
+            [] { return true; },
+            [](uint32_t frame) {
+                glm::mat4 rotation = spin(frame);
+                float scale = 16.0f / GRID_SIZE;
+                for (uint32_t y = 0; y < GRID_SIZE; ++y) {
+                    for (uint32_t x = 0; x < GRID_SIZE; ++x) {
+                        glm::vec3 position((x + 0.5f) * scale - 8.0f, (y + 0.5f) * scale - 8.0f, 0.0f);
+                        glm::mat4 model = glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(scale * 0.4f));
+                        graphics::submitDraw(graphics::quadMesh, rotation * model);
+                    }
+                }
+            },
+            [] {}
+        });
+
+        // the same spread out grid as persistent scene objects, culled through the BVH, with a
+        // sixteenth of them moving every frame so the tree gets refitted
+        scenes.push_back({ "scene_bvh",
+            [] {
+                scene = new graphics::Scene();
+                float scale = 16.0f / GRID_SIZE;
+                for (uint32_t y = 0; y < GRID_SIZE; ++y) {
+                    for (uint32_t x = 0; x < GRID_SIZE; ++x) {
+                        glm::vec3 position((x + 0.5f) * scale - 8.0f, (y + 0.5f) * scale - 8.0f, 0.0f);
+                        scene->add(graphics::quadMesh, glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(scale * 0.4f)));
+                    }
+                }
+                return true;
+            },
+            [](uint32_t frame) {
+                uint32_t count = GRID_SIZE * GRID_SIZE;
+                for (uint32_t object = frame % 16; object < count; object += 16) {
+                    glm::mat4 model = scene->transform(object);
+                    model[3].z = 0.1f * std::sin(frame * FRAME_TIME + object);
+                    scene->setTransform(object, model);
+                }
+                glm::mat4 view, proj;
+                graphics::getCameraMatrices(view, proj);
+                scene->submitVisible(view, proj);
+            },
+            [] {
+                delete scene;
+                scene = nullptr;
+            }
+        });
+
+        // the scene_bvh grid again, culled by a compute shader and drawn with indirect draws,
+        // so recording costs the same whatever the object count
+        scenes.push_back({ "gpu_driven",
+            [] {
+                gpuScene = new graphics::GpuScene();
+                float scale = 16.0f / GRID_SIZE;
+                for (uint32_t y = 0; y < GRID_SIZE; ++y) {
+                    for (uint32_t x = 0; x < GRID_SIZE; ++x) {
+                        glm::vec3 position((x + 0.5f) * scale - 8.0f, (y + 0.5f) * scale - 8.0f, 0.0f);
+                        gpuScene->add(graphics::quadMesh, glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(scale * 0.4f)));
+                    }
+                }
+                return true;
+            },
+            [](uint32_t frame) {
+                uint32_t count = GRID_SIZE * GRID_SIZE;
+                for (uint32_t object = frame % 16; object < count; object += 16) {
+                    glm::mat4 model = gpuScene->transform(object);
+                    model[3].z = 0.1f * std::sin(frame * FRAME_TIME + object);
+                    gpuScene->setTransform(object, model);
+                }
+                graphics::submitGpuScene(*gpuScene);
+            },
+            [] {
+                if (gpuScene->stats().framesValidated) {
+                    std::cerr << "gpu_driven: " << gpuScene->stats().mismatches << " culling mismatches in "
+                              << gpuScene->stats().framesValidated << " validated frames" << std::endl;
+                }
+                vkDeviceWaitIdle(graphics::logicalDevice);
+                delete gpuScene;
+                gpuScene = nullptr;
+            }
+        });
+
+        // layers of solid quad grids stacked under each other, so the top one hides most of
+        // the rest. Occlusion culling only draws the top layer and the edges of the others
+        scenes.push_back({ "occlusion",
+            [] {
+                gpuScene = new graphics::GpuScene();
+                float scale = 4.0f / OCCLUSION_GRID_SIZE;
+                for (uint32_t layer = 0; layer < OCCLUSION_LAYERS; ++layer) {
+                    for (uint32_t y = 0; y < OCCLUSION_GRID_SIZE; ++y) {
+                        for (uint32_t x = 0; x < OCCLUSION_GRID_SIZE; ++x) {
+                            glm::vec3 position((x + 0.5f) * scale - 2.0f, (y + 0.5f) * scale - 2.0f, -0.05f * layer);
+                            gpuScene->add(graphics::quadMesh, glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(scale * 0.5f)));
+                        }
+                    }
+                }
+                return true;
+            },
+            [](uint32_t) {
+                graphics::submitGpuScene(*gpuScene);
+            },
+            [] {
+                if (gpuScene->stats().framesValidated) {
+                    std::cerr << "occlusion: " << gpuScene->stats().mismatches << " culling mismatches and "
+                              << gpuScene->stats().occluded << " occluded objects in "
+                              << gpuScene->stats().framesValidated << " validated frames" << std::endl;
+                }
+                vkDeviceWaitIdle(graphics::logicalDevice);
+                delete gpuScene;
+                gpuScene = nullptr;
+            }
+        });
+
+        // a grid of detailed spheres from right under the camera out to the far plane, as scene
+        // objects, so the far ones are drawn at a coarse level of detail
+        scenes.push_back({ "lod",
+            [] {
+                graphics::MeshData sphere = makeSphere(LOD_SPHERE_RINGS);
+                graphics::optimizeMesh(sphere);
+                graphics::generateLods(sphere);
+                if (!graphics::createMesh(sphere, lodMesh))
+                    return false;
+                scene = new graphics::Scene();
+                float scale = 16.0f / LOD_GRID_SIZE;
+                for (uint32_t y = 0; y < LOD_GRID_SIZE; ++y) {
+                    for (uint32_t x = 0; x < LOD_GRID_SIZE; ++x) {
+                        glm::vec3 position(2.0f - (x + 0.5f) * scale, 2.0f - (y + 0.5f) * scale, 0.0f);
+                        scene->add(lodMesh, glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(scale * 0.4f)));
+                    }
+                }
+                return true;
+            },
+            [](uint32_t) {
+                glm::mat4 view, proj;
+                graphics::getCameraMatrices(view, proj);
+                scene->submitVisible(view, proj);
+            },
+            [] {
+                vkDeviceWaitIdle(graphics::logicalDevice);
+                delete scene;
+                scene = nullptr;
+                graphics::destroyMesh(lodMesh);
+            }
+        });
+
+        // ~100k copies of a mesh in one instanced draw, against many_draws' draw per object
+        scenes.push_back({ "instancing",
+            [] {
+                instanceModels.resize(INSTANCE_GRID_SIZE * INSTANCE_GRID_SIZE);
+                return true;
+            },
+            [](uint32_t frame) {
+                glm::mat4 rotation = spin(frame);
+                float scale = 2.0f / INSTANCE_GRID_SIZE;
+                for (uint32_t y = 0; y < INSTANCE_GRID_SIZE; ++y) {
+                    for (uint32_t x = 0; x < INSTANCE_GRID_SIZE; ++x) {
+                        glm::vec3 position((x + 0.5f) * scale - 1.0f, (y + 0.5f) * scale - 1.0f, 0.0f);
+                        glm::mat4 model = glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(scale * 0.4f));
+                        instanceModels[y * INSTANCE_GRID_SIZE + x] = rotation * model;
+                    }
+                }
+                graphics::submitInstances(graphics::quadMesh, instanceModels.data(), (uint32_t) instanceModels.size());
+            },
+            [] { instanceModels.clear(); }
+        });
+
+        // a buffer's worth of new data every frame, to stress the staging ring
+        scenes.push_back({ "streaming_uploads",
+            [] {
+                streamData.resize(STREAM_SIZE);
+                for (size_t i = 0; i < streamData.size(); ++i)
+                    streamData[i] = uint8_t(i * 31);
+                return graphics::createBuffer(STREAM_SIZE, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, streamBuffer, streamAllocation);
+            },
+            [](uint32_t frame) {
+                graphics::uploadToBuffer(streamBuffer, 0, streamData.data(), STREAM_SIZE);
+                graphics::submitDraw(graphics::quadMesh, spin(frame));
+            },
+            [] {
+                graphics::waitForUploads();
+                vkDeviceWaitIdle(graphics::logicalDevice);
+                graphics::destroyBuffer(streamBuffer, streamAllocation);
+            }
+        });
+
+        return scenes;
+    }
+
+    double percentile(std::vector<double> values, double p) {
+        if (values.empty())
+            return 0;
+        std::sort(values.begin(), values.end());
+        size_t index = std::min(values.size() - 1, size_t(p / 100.0 * values.size()));
+        return values[index];
+    }
+
+    bool runScene(const Scene& scene, uint32_t warmupFrames, uint32_t frames, SceneResult& result) {
+        result.name = scene.name;
+        if (!scene.setup())
+            return false;
+
+        uint32_t frame = 0;
+        for (; frame < warmupFrames; ++frame) {
+            scene.submit(frame);
+            if (!graphics::drawFrame()) {
+                scene.teardown();
+                return false;
+            }
+        }
+
+        auto frameStart = graphics::getFrameStats();
+        auto uploadStart = graphics::getUploadStats();
+        auto allocatorStart = graphics::getAllocatorStats();
+        auto sceneStart = Clock::now();
+        auto last = sceneStart;
+        for (uint32_t i = 0; i < frames; ++i, ++frame) {
+            scene.submit(frame);
+            if (!graphics::drawFrame()) {
+                scene.teardown();
+                return false;
+            }
+            auto now = Clock::now();
+            result.frameMilliseconds.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+            last = now;
+        }
+        // the last frames are still on the GPU, count them too
+        vkDeviceWaitIdle(graphics::logicalDevice);
+        result.seconds = std::chrono::duration<double>(Clock::now() - sceneStart).count();
+
+        auto frameEnd = graphics::getFrameStats();
+        result.frameStats.frames = frameEnd.frames - frameStart.frames;
+        result.frameStats.draws = frameEnd.draws - frameStart.draws;
+        result.frameStats.instances = frameEnd.instances - frameStart.instances;
+        result.frameStats.culled = frameEnd.culled - frameStart.culled;
+        result.frameStats.gpuObjects = frameEnd.gpuObjects - frameStart.gpuObjects;
+        result.frameStats.triangles = frameEnd.triangles - frameStart.triangles;
+        result.frameStats.coarseDraws = frameEnd.coarseDraws - frameStart.coarseDraws;
+        result.frameStats.recordMilliseconds = frameEnd.recordMilliseconds - frameStart.recordMilliseconds;
+        auto uploadEnd = graphics::getUploadStats();
+        result.uploadStats.bytesUploaded = uploadEnd.bytesUploaded - uploadStart.bytesUploaded;
+        result.uploadStats.batchesSubmitted = uploadEnd.batchesSubmitted - uploadStart.batchesSubmitted;
+        result.uploadStats.stalls = uploadEnd.stalls - uploadStart.stalls;
+        result.uploadStats.stallMilliseconds = uploadEnd.stallMilliseconds - uploadStart.stallMilliseconds;
+        result.allocatorStats = graphics::getAllocatorStats();
+        result.allocations = result.allocatorStats.totalAllocations - allocatorStart.totalAllocations;
+        result.deviceMemoryAllocations = result.allocatorStats.totalDeviceMemoryAllocations - allocatorStart.totalDeviceMemoryAllocations;
+        result.gpuStats = graphics::getGpuProfilerStats();
+
+        scene.teardown();
+        return true;
+    }
+
+    void writeScene(std::ostream& out, const SceneResult& result) {
+        const auto& ms = result.frameMilliseconds;
+        double total = 0;
+        for (double m : ms)
+            total += m;
+        uint64_t frames = std::max<uint64_t>(1, result.frameStats.frames);
+
+        out << "    {\n";
+        out << "      \"name\": \"" << result.name << "\",\n";
+        out << "      \"frames\": " << ms.size() << ",\n";
+        out << "      \"fps\": " << ms.size() / std::max(result.seconds, 1e-9) << ",\n";
+        out << "      \"frame_ms\": { \"avg\": " << total / std::max<size_t>(1, ms.size())
+            << ", \"p50\": " << percentile(ms, 50) << ", \"p90\": " << percentile(ms, 90)
+            << ", \"p99\": " << percentile(ms, 99) << ", \"max\": " << percentile(ms, 100) << " },\n";
+        out << "      \"record_ms_avg\": " << result.frameStats.recordMilliseconds / frames << ",\n";
+        out << "      \"draws_per_frame\": " << result.frameStats.draws / frames << ",\n";
+        out << "      \"instances_per_frame\": " << result.frameStats.instances / frames << ",\n";
+        out << "      \"culled_per_frame\": " << result.frameStats.culled / frames << ",\n";
+        out << "      \"gpu_culled_objects_per_frame\": " << result.frameStats.gpuObjects / frames << ",\n";
+        out << "      \"triangles_per_frame\": " << result.frameStats.triangles / frames << ",\n";
+        out << "      \"coarse_lod_draws_per_frame\": " << result.frameStats.coarseDraws / frames << ",\n";
+        out << "      \"uploads\": { \"bytes\": " << result.uploadStats.bytesUploaded
+            << ", \"mb_per_second\": " << result.uploadStats.bytesUploaded / (1024.0 * 1024.0) / std::max(result.seconds, 1e-9)
+            << ", \"batches\": " << result.uploadStats.batchesSubmitted << ", \"stalls\": " << result.uploadStats.stalls
+            << ", \"stall_ms\": " << result.uploadStats.stallMilliseconds << " },\n";
+        out << "      \"memory\": { \"allocations\": " << result.allocations
+            << ", \"device_memory_allocations\": " << result.deviceMemoryAllocations
+            << ", \"live_device_memory_objects\": " << result.allocatorStats.deviceMemoryCount
+            << ", \"bytes_reserved\": " << result.allocatorStats.bytesReserved
+            << ", \"bytes_in_use\": " << result.allocatorStats.bytesInUse << " },\n";
+        out << "      \"gpu_ms\": {";
+        for (size_t i = 0; i < result.gpuStats.size(); ++i) {
+            const auto& scope = result.gpuStats[i];
+            out << (i ? ", " : " ") << "\"" << scope.name << "\": { \"min\": " << scope.minMilliseconds
+                << ", \"avg\": " << scope.avgMilliseconds << ", \"p99\": " << scope.p99Milliseconds << " }";
+        }
+        out << " }\n";
+        out << "    }";
+    }
+
+} // namespace anonymous
+
+int main(int argc, char** argv) {
+    uint32_t frames = 600;
+    uint32_t warmupFrames = 60;
+    uint32_t width = 1280, height = 720;
+    std::string sceneFilter;
+    std::string outputPath;
+
+    // no window, and no validation unless asked for since it dominates the frame times
+    graphics::headless = true;
+    enableValidationLayers = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+            frames = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--warmup") && i + 1 < argc)
+            warmupFrames = std::max(0, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--scene") && i + 1 < argc)
+            sceneFilter = argv[++i];
+        else if (!strcmp(argv[i], "--size") && i + 2 < argc) {
+            width = std::max(1, atoi(argv[++i]));
+            height = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--frames-in-flight") && i + 1 < argc)
+            graphics::framesInFlight = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--recording-threads") && i + 1 < argc)
+            graphics::recordingThreads = std::max(0, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--validation"))
+            enableValidationLayers = true;
+        else if (!strcmp(argv[i], "--no-culling"))
+            graphics::frustumCulling = false;
+        else if (!strcmp(argv[i], "--no-lod"))
+            graphics::levelOfDetail = false;
+        else if (!strcmp(argv[i], "--no-gpu-driven"))
+            graphics::gpuDrivenRendering = false;
+        else if (!strcmp(argv[i], "--no-occlusion-culling"))
+            graphics::occlusionCulling = false;
+        else if (!strcmp(argv[i], "--validate-gpu-culling"))
+            graphics::gpuCullingValidation = true;
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+            outputPath = argv[++i];
+        else {
+            std::cerr << "usage: bench [--frames N] [--warmup N] [--scene name] [--size w h] [--frames-in-flight N]"
+                         " [--recording-threads N] [--validation] [--no-culling] [--no-lod] [--no-gpu-driven] [--no-occlusion-culling]"
+                         " [--validate-gpu-culling] [--output file.json]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto initStart = Clock::now();
+    if (!graphics::initVulkan(width, height)) {
+        std::cerr << "Failed to initialize Vulkan" << std::endl;
+        return EXIT_FAILURE;
+    }
+    double initMilliseconds = std::chrono::duration<double, std::milli>(Clock::now() - initStart).count();
+    auto pipelineStats = graphics::getPipelineCacheStats();
+    auto shaderStats = graphics::getShaderRegistryStats();
+
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(graphics::physicalDeviceInfo.device, &deviceProperties);
+
+    std::vector<SceneResult> results;
+    for (const auto& scene : makeScenes()) {
+        if (!sceneFilter.empty() && sceneFilter != scene.name)
+            continue;
+        SceneResult result;
+        if (!runScene(scene, warmupFrames, frames, result)) {
+            std::cerr << "Scene " << scene.name << " failed" << std::endl;
+            graphics::cleanup();
+            return EXIT_FAILURE;
+        }
+        results.push_back(result);
+    }
+
+    std::ostringstream out;
+    out << "{\n";
+    out << "  \"device\": \"" << deviceProperties.deviceName << "\",\n";
+    out << "  \"resolution\": [" << width << ", " << height << "],\n";
+    out << "  \"frames_in_flight\": " << graphics::framesInFlight << ",\n";
+    out << "  \"recording_threads\": " << graphics::workerThreadCount() << ",\n";
+    out << "  \"init_ms\": " << initMilliseconds << ",\n";
+    out << "  \"pipelines\": { \"created\": " << pipelineStats.pipelinesCreated
+        << ", \"creation_ms\": " << pipelineStats.creationMilliseconds
+        << ", \"cache_loaded_bytes\": " << pipelineStats.loadedBytes << " },\n";
+    out << "  \"shaders\": { \"modules_created\": " << shaderStats.modulesCreated << " },\n";
+    out << "  \"scenes\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        writeScene(out, results[i]);
+        out << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n";
+    out << "}\n";
+
+    graphics::cleanup();
+
+    if (outputPath.empty()) {
+        std::cout << out.str();
+    } else {
+        std::ofstream file(outputPath);
+        file << out.str();
+        if (!file) {
+            std::cerr << "Failed to write " << outputPath << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
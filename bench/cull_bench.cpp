@@ -0,0 +1,252 @@
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+#include "glm/ext.hpp"
+
+#include "bvh.hpp"
+#include "frustum_culling.hpp"
+#include "gpu_culling.hpp"
+#include "worker_threads.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Frustum culling microbenchmark. Culls a large set of random objects against the renderer's
+// camera with the scalar and the SIMD paths and through a BVH, checks that they all agree, and
+// prints the throughput of each as JSON. Also checks that the CPU version of the GPU culling
+// shader keeps exactly the spheres cullSpheresScalar does, and that the CPU version of the Hi-Z
+// occlusion test never hides a sphere that would have shown. Needs no GPU.
+
+namespace {
+
+    using Clock = std::chrono::high_resolution_clock;
+
+    typedef uint32_t (*CullFunction)(const graphics::Frustum&, const graphics::CullingBounds&, uint32_t*);
+
+    struct CullResult {
+        const char* name;
+        uint32_t visible = 0;
+        double bestMilliseconds = 0;
+    };
+
+    /** Best of repeats runs, so the numbers aren't skewed by whatever else the machine does. */
+    CullResult run(const char* name, CullFunction cull, const graphics::Frustum& frustum,
+                   const graphics::CullingBounds& bounds, uint32_t repeats, std::vector<uint32_t>& visible) {
+        CullResult result;
+        result.name = name;
+        result.bestMilliseconds = 1e30;
+        for (uint32_t i = 0; i < repeats; ++i) {
+            auto start = Clock::now();
+            result.visible = cull(frustum, bounds, visible.data());
+            double milliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            result.bestMilliseconds = std::min(result.bestMilliseconds, milliseconds);
+        }
+        return result;
+    }
+
+    /** Depth of the ground plane z = 0 under each pixel, 1 where the pixel sees the sky. */
+    std::vector<float> groundDepth(const glm::mat4& viewProj, uint32_t width, uint32_t height) {
+        glm::mat4 inverse = glm::inverse(viewProj);
+        std::vector<float> depth(width * height, 1.0f);
+        for (uint32_t y = 0; y < height; ++y) {
+            for (uint32_t x = 0; x < width; ++x) {
+                glm::vec2 ndc = (glm::vec2(x, y) + 0.5f) / glm::vec2(width, height) * 2.0f - 1.0f;
+                glm::vec4 nearPoint = inverse * glm::vec4(ndc, -1.0f, 1.0f), farPoint = inverse * glm::vec4(ndc, 1.0f, 1.0f);
+                glm::vec3 from = glm::vec3(nearPoint) / nearPoint.w, to = glm::vec3(farPoint) / farPoint.w;
+                float t = from.z / (from.z - to.z);
+                if (t < 0.0f || t > 1.0f)
+                    continue;
+                glm::vec4 clip = viewProj * glm::vec4(glm::mix(from, to, t), 1.0f);
+                depth[y * width + x] = clip.z / clip.w;
+            }
+        }
+        return depth;
+    }
+
+    /** \brief Whether any of a few hundred points on the sphere would pass the depth test.
+     *
+     * Brute force check on what sphereOccludedReference claims, independent of the pyramid.
+     */
+    bool sphereShows(const glm::mat4& viewProj, const std::vector<float>& depth, uint32_t width, uint32_t height,
+                     const glm::vec4& sphere) {
+        const uint32_t samples = 256;
+        for (uint32_t i = 0; i < samples; ++i) {
+            // fibonacci sphere, evenly spread points
+            float z = 1.0f - 2.0f * (i + 0.5f) / samples;
+            float angle = 2.39996323f * i;
+            float ring = std::sqrt(1.0f - z * z);
+            glm::vec3 point = glm::vec3(sphere) + sphere.w * glm::vec3(ring * std::cos(angle), ring * std::sin(angle), z);
+            glm::vec4 clip = viewProj * glm::vec4(point, 1.0f);
+            if (clip.w <= 0.0f)
+                return true;
+            glm::vec3 ndc = glm::vec3(clip) / clip.w;
+            glm::vec2 pixel = glm::floor((glm::vec2(ndc) * 0.5f + 0.5f) * glm::vec2(width, height));
+            if (pixel.x < 0 || pixel.y < 0 || pixel.x >= width || pixel.y >= height)
+                continue;
+            if (ndc.z <= depth[uint32_t(pixel.y) * width + uint32_t(pixel.x)])
+                return true;
+        }
+        return false;
+    }
+
+} // namespace anonymous
+
+int main(int argc, char** argv) {
+    uint32_t objects = 1 << 20;
+    uint32_t repeats = 50;
+    float spread = 8.0f; // objects are spread over a cube this big around the origin
+    uint32_t threads = 0; // for the BVH build, 0 = one per core
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--objects") && i + 1 < argc)
+            objects = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--repeats") && i + 1 < argc)
+            repeats = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--spread") && i + 1 < argc)
+            spread = std::max(0.01f, (float) atof(argv[++i]));
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            threads = std::max(0, atoi(argv[++i]));
+        else {
+            std::cerr << "usage: cull_bench [--objects N] [--repeats N] [--spread size] [--threads N]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the same camera recordCommandBuffer uses
+    glm::mat4 view = glm::lookAt(glm::vec3(2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+    glm::mat4 proj = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 10.0f);
+    proj[1][1] *= -1;
+    graphics::Frustum frustum = graphics::extractFrustum(proj * view);
+
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> position(-0.5f * spread, 0.5f * spread);
+    std::uniform_real_distribution<float> size(0.01f, 0.1f);
+    graphics::CullingBounds bounds;
+    bounds.resize(objects);
+    for (uint32_t i = 0; i < objects; ++i) {
+        glm::vec3 center(position(random), position(random), position(random));
+        glm::vec3 halfExtent(size(random), size(random), size(random));
+        bounds.setSphere(i, center, glm::length(halfExtent));
+        bounds.setBox(i, center, halfExtent);
+    }
+
+    std::vector<uint32_t> visible(objects), reference(objects);
+    std::vector<CullResult> results;
+    results.push_back(run("spheres_scalar", graphics::cullSpheresScalar, frustum, bounds, repeats, reference));
+    results.push_back(run("spheres_simd", graphics::cullSpheres, frustum, bounds, repeats, visible));
+    bool match = results[0].visible == results[1].visible &&
+                 std::equal(reference.begin(), reference.begin() + results[0].visible, visible.begin());
+    results.push_back(run("boxes_scalar", graphics::cullBoxesScalar, frustum, bounds, repeats, reference));
+    results.push_back(run("boxes_simd", graphics::cullBoxes, frustum, bounds, repeats, visible));
+    match = match && results[2].visible == results[3].visible &&
+            std::equal(reference.begin(), reference.begin() + results[2].visible, visible.begin());
+
+    // the reference for cull.comp tests the same spheres, with the draw parameters riding along
+    std::vector<graphics::GpuCullObject> gpuObjects(objects);
+    for (uint32_t i = 0; i < objects; ++i) {
+        gpuObjects[i].sphere = glm::vec4(bounds.sphereX[i], bounds.sphereY[i], bounds.sphereZ[i], bounds.sphereRadius[i]);
+        gpuObjects[i].indexCount = 3 * (i % 7 + 1);
+        gpuObjects[i].firstIndex = i;
+        gpuObjects[i].vertexOffset = -int32_t(i % 3);
+        gpuObjects[i].firstInstance = i;
+    }
+    std::vector<graphics::IndirectDrawCommand> commands(objects);
+    auto gpuReferenceStart = Clock::now();
+    graphics::cullObjectsReference(frustum, gpuObjects.data(), objects, commands.data());
+    double gpuReferenceMilliseconds = std::chrono::duration<double, std::milli>(Clock::now() - gpuReferenceStart).count();
+    uint32_t gpuReferenceVisible = 0;
+    graphics::cullSpheresScalar(frustum, bounds, reference.data());
+    for (uint32_t i = 0; i < objects; ++i) {
+        if (!commands[i].instanceCount)
+            continue;
+        match = match && gpuReferenceVisible < results[0].visible && reference[gpuReferenceVisible] == i;
+        ++gpuReferenceVisible;
+    }
+    match = match && gpuReferenceVisible == results[0].visible &&
+            graphics::countCullingMismatches(frustum, gpuObjects.data(), objects, commands.data()) == 0;
+
+    // the Hi-Z reference against the ground plane seen by the camera, with odd sizes so the
+    // pyramid has texels on the edges that only cover a single row or column
+    const uint32_t depthWidth = 333, depthHeight = 187, occlusionSpheres = 4096;
+    graphics::GpuOcclusionConstants occlusion = {};
+    occlusion.viewProj = proj * view;
+    occlusion.depthSize = glm::vec2(depthWidth, depthHeight);
+    std::vector<float> depth = groundDepth(occlusion.viewProj, depthWidth, depthHeight);
+    std::vector<std::vector<float>> hiz;
+    auto hizStart = Clock::now();
+    graphics::buildHiZReference(depth.data(), depthWidth, depthHeight, hiz);
+    double hizBuildMilliseconds = std::chrono::duration<double, std::milli>(Clock::now() - hizStart).count();
+    occlusion.hizLevels = (uint32_t) hiz.size();
+    std::uniform_real_distribution<float> ground(-2.0f, 2.0f), height(-1.5f, 0.5f), radius(0.01f, 0.2f);
+    uint32_t occluded = 0, wronglyOccluded = 0;
+    for (uint32_t i = 0; i < occlusionSpheres; ++i) {
+        glm::vec4 sphere(ground(random), ground(random), height(random), radius(random));
+        if (!graphics::sphereOccludedReference(occlusion, hiz, sphere))
+            continue;
+        ++occluded;
+        if (sphereShows(occlusion.viewProj, depth, depthWidth, depthHeight, sphere))
+            ++wronglyOccluded;
+    }
+    match = match && hiz.size() == graphics::hizLevelCount(depthWidth, depthHeight) && hiz.back().size() == 1 &&
+            hiz.back()[0] == *std::max_element(depth.begin(), depth.end()) && wronglyOccluded == 0;
+
+    // the BVH culls the boxes, so it has to find exactly what cullBoxes does
+    if (threads != 1)
+        graphics::createWorkerThreads(threads ? threads - 1 : 0);
+    std::vector<glm::vec3> boundsMin(objects), boundsMax(objects);
+    for (uint32_t i = 0; i < objects; ++i) {
+        glm::vec3 center(bounds.boxCenterX[i], bounds.boxCenterY[i], bounds.boxCenterZ[i]);
+        glm::vec3 halfExtent(bounds.boxExtentX[i], bounds.boxExtentY[i], bounds.boxExtentZ[i]);
+        boundsMin[i] = center - halfExtent;
+        boundsMax[i] = center + halfExtent;
+    }
+    graphics::Bvh bvh;
+    bvh.build(boundsMin.data(), boundsMax.data(), objects);
+    graphics::BvhStats bvhStats = bvh.stats();
+    std::vector<uint32_t> bvhVisible;
+    double bvhMilliseconds = 1e30;
+    for (uint32_t i = 0; i < repeats; ++i) {
+        bvhVisible.clear();
+        auto start = Clock::now();
+        bvh.cullFrustum(frustum, bvhVisible);
+        bvhMilliseconds = std::min(bvhMilliseconds, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    }
+    auto refitStart = Clock::now();
+    bvh.refit(boundsMin.data(), boundsMax.data());
+    double refitMilliseconds = std::chrono::duration<double, std::milli>(Clock::now() - refitStart).count();
+    std::sort(bvhVisible.begin(), bvhVisible.end());
+    match = match && bvhVisible.size() == results[3].visible &&
+            std::equal(bvhVisible.begin(), bvhVisible.end(), visible.begin());
+    uint32_t buildThreads = graphics::workerThreadCount();
+    graphics::destroyWorkerThreads();
+
+    std::cout << "{\n";
+    std::cout << "  \"instruction_set\": \"" << graphics::cullingInstructionSet() << "\",\n";
+    std::cout << "  \"objects\": " << objects << ",\n";
+    std::cout << "  \"all_paths_match\": " << (match ? "true" : "false") << ",\n";
+    std::cout << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const CullResult& result = results[i];
+        std::cout << "    { \"name\": \"" << result.name << "\", \"visible\": " << result.visible
+                  << ", \"ms\": " << result.bestMilliseconds
+                  << ", \"million_objects_per_second\": " << objects / (result.bestMilliseconds * 1000.0) << " }"
+                  << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    std::cout << "  ],\n";
+    std::cout << "  \"gpu_reference\": { \"visible\": " << gpuReferenceVisible << ", \"ms\": " << gpuReferenceMilliseconds
+              << ", \"million_objects_per_second\": " << objects / (gpuReferenceMilliseconds * 1000.0) << " },\n";
+    std::cout << "  \"hiz_reference\": { \"levels\": " << hiz.size() << ", \"build_ms\": " << hizBuildMilliseconds
+              << ", \"spheres\": " << occlusionSpheres << ", \"occluded\": " << occluded
+              << ", \"wrongly_occluded\": " << wronglyOccluded << " },\n";
+    std::cout << "  \"bvh\": { \"build_ms\": " << bvhStats.buildMilliseconds << ", \"build_threads\": " << buildThreads
+              << ", \"refit_ms\": " << refitMilliseconds << ", \"nodes\": " << bvhStats.nodes
+              << ", \"depth\": " << bvhStats.depth << ", \"sah_cost\": " << bvhStats.cost
+              << ", \"visible\": " << bvhVisible.size() << ", \"cull_ms\": " << bvhMilliseconds
+              << ", \"million_objects_per_second\": " << objects / (bvhMilliseconds * 1000.0) << " }\n";
+    std::cout << "}\n";
+    return match ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,36 @@
+# Turns a SPIR-V binary into a header with the words in a constexpr uint32_t array.
+#
+# cmake -DINPUT=<file.spv> -DOUTPUT=<header.hpp> -DNAME=<array name> -P EmbedSpirv.cmake
+
+file(READ "${INPUT}" hex HEX)
+string(LENGTH "${hex}" hexLength)
+math(EXPR remainder "${hexLength} % 8")
+if (hexLength EQUAL 0 OR NOT remainder EQUAL 0)
+    message(FATAL_ERROR "${INPUT} is not a SPIR-V binary (size must be a non-zero multiple of 4 bytes)")
+endif()
+
+# SPIR-V words are little endian, so the bytes of each word get reversed
+string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1u," words "${hex}")
+# break the array up into lines of 8 words (CMake regexes have no {n} repetition)
+set(line "")
+foreach(i RANGE 1 8)
+    set(line "${line}0x........u,")
+endforeach()
+string(REGEX REPLACE "(${line})" "\\1\n        " words "${words}")
+string(STRIP "${words}" words)
+
+get_filename_component(source "${INPUT}" NAME)
+file(WRITE "${OUTPUT}"
+"// Generated from ${source} by cmake/EmbedSpirv.cmake, do not edit
+#pragma once
+
+#include <cstdint>
+
+namespace shaders {
+
+    constexpr uint32_t ${NAME}[] = {
+        ${words}
+    };
+
+} // namespace shaders
+")
@@ -1,2 +1,14 @@
-/home/liam/vulkan/1.1.101.0/x86_64/bin/glslangValidator -V $1
-/home/liam/vulkan/1.1.101.0/x86_64/bin/glslangValidator -V $2
+#!/bin/sh
+# Rebuilds the prebuilt SPIR-V in shaders/ (shaders/foo.vert -> shaders/foo.vert.spv), which is
+# only used when CMake can't find glslangValidator. Uses glslangValidator from the PATH, or from
+# the Vulkan SDK if VULKAN_SDK is set.
+cd "$(dirname "$0")"
+GLSLANG=glslangValidator
+if [ -n "$VULKAN_SDK" ]; then
+    GLSLANG="$VULKAN_SDK/bin/glslangValidator"
+fi
+
+for shader in shaders/*.vert shaders/*.frag shaders/*.comp; do
+    [ -e "$shader" ] || continue
+    "$GLSLANG" -V "$shader" -o "$shader.spv" || exit 1
+done
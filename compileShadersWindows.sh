@@ -1,2 +1,9 @@
-C:/VulkanSDK/1.1.101.0/Bin/glslangValidator.exe -V $1
-C:/VulkanSDK/1.1.101.0/Bin/glslangValidator.exe -V $2
+#!/bin/sh
+# Windows version of compileShaders.sh, using the glslangValidator from the Vulkan SDK.
+cd "$(dirname "$0")"
+GLSLANG="$VULKAN_SDK/Bin/glslangValidator.exe"
+
+for shader in shaders/*.vert shaders/*.frag shaders/*.comp; do
+    [ -e "$shader" ] || continue
+    "$GLSLANG" -V "$shader" -o "$shader.spv" || exit 1
+done
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "frustum_culling.hpp"
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace graphics {
+
+    const uint32_t BVH_MAX_LEAF_SIZE = 4;
+    const uint32_t BVH_INVALID = ~0u;
+
+    /** \brief A node of a 4 wide BVH, two cache lines.
+     *
+     * The boxes of all four children are stored side by side, so a single classifyBoxes4 (or
+     * four lanes of a ray test) handles the whole node. A child is either another node, or a
+     * leaf of up to BVH_MAX_LEAF_SIZE objects stored inline, which saves a node per leaf.
+     */
+    struct alignas(64) BvhNode {
+        Box4 bounds;          // of the children. Unused slots are empty boxes
+        uint32_t child[4];    // node index, first entry of Bvh::objects() for leaves, or BVH_INVALID
+        uint8_t leafSize[4];  // objects in a leaf child, 0 for node children
+        uint32_t parent;      // BVH_INVALID for the root
+        uint32_t first;       // range of Bvh::objects() the whole subtree covers
+        uint32_t count;
+    };
+    static_assert(sizeof(BvhNode) == 128, "BvhNode should fill exactly two cache lines");
+
+    struct BvhStats {
+        uint32_t nodes = 0;
+        uint32_t leaves = 0;
+        uint32_t depth = 0;
+        float cost = 0;                // SAH cost, relative to testing every object
+        double buildMilliseconds = 0;
+    };
+
+    /** \brief Bounding volume hierarchy over a set of axis aligned boxes.
+     *
+     * Objects are identified by their index in the arrays passed to build. The tree is built
+     * top down with binned SAH splits, and once it is big enough the subtrees are built in
+     * parallel on the worker threads. Moving objects don't need a rebuild: update and refit
+     * grow the boxes along the way to the root, which keeps every query correct but slowly
+     * makes the tree worse, so callers should rebuild once stats().cost has grown too much.
+     */
+    class Bvh {
+    public:
+        void build(const glm::vec3* boundsMin, const glm::vec3* boundsMax, uint32_t count);
+        void clear();
+
+        /** Move every object to new boxes at once, keeping the tree structure. O(nodes). */
+        void refit(const glm::vec3* boundsMin, const glm::vec3* boundsMax);
+        /** Move a single object, refitting only the nodes above it. An empty box (min greater
+         * than max) takes it out of every query.
+         */
+        void update(uint32_t object, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+        /** Append the objects whose box intersects the frustum to visible, in no particular order. */
+        void cullFrustum(const Frustum& frustum, std::vector<uint32_t>& visible) const;
+        /** Closest object whose box the ray hits within maxDistance. direction need not be normalized,
+         * distance is in multiples of it.
+         */
+        bool raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance,
+                     uint32_t& object, float& distance) const;
+        /** Append the objects whose box overlaps [boundsMin, boundsMax] to objects. */
+        void queryBox(const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::vector<uint32_t>& objects) const;
+
+        uint32_t size() const { return static_cast<uint32_t>(boxMin.size()); }
+        const std::vector<BvhNode>& nodes() const { return nodes_; }
+        /** Object indices in leaf order; every leaf and subtree is a range of it. */
+        const std::vector<uint32_t>& objects() const { return objects_; }
+        /** Computed on every call, it walks the whole tree. */
+        BvhStats stats() const;
+
+    private:
+        void refitLeaf(uint32_t node, uint32_t slot);
+        void refitNode(uint32_t node, uint32_t slot);
+
+        std::vector<BvhNode> nodes_;
+        std::vector<uint32_t> objects_;
+        std::vector<uint32_t> objectSlot; // node * 4 + slot of each object's leaf
+        std::vector<glm::vec3> boxMin, boxMax;
+        double buildMilliseconds = 0;
+    };
+
+} // namespace graphics
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace graphics {
+
+    /** \brief A named span of CPU time on the calling thread.
+     *
+     * Every thread records into its own fixed size event ring, so recording a zone is just two
+     * clock reads and a store, with no locks or allocations. Once a ring is full the oldest
+     * events get overwritten, so a long run keeps the most recent few seconds.
+     */
+    class CpuZone {
+    public:
+        explicit CpuZone(const char* name);
+        ~CpuZone();
+        CpuZone(const CpuZone&) = delete;
+        CpuZone& operator=(const CpuZone&) = delete;
+    private:
+        const char* name; // must be a string literal (or otherwise outlive the export)
+        uint64_t start;
+    };
+
+    /** Name the calling thread in the exported trace. */
+    void setProfilerThreadName(const char* name);
+
+    /** \brief Write every recorded zone out in the Chrome trace event format.
+     *
+     * Open the file in chrome://tracing or ui.perfetto.dev. Should be called while no other
+     * thread is recording zones, such as at shutdown.
+     */
+    bool exportChromeTrace(const std::string& path);
+
+} // namespace graphics
+
+// zones compile away to nothing unless ENABLE_CPU_PROFILER is defined (see CMakeLists.txt)
+#ifdef ENABLE_CPU_PROFILER
+    #define PROFILE_CONCAT_INNER(a, b) a##b
+    #define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+    #define PROFILE_SCOPE(name) graphics::CpuZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+    #define PROFILE_THREAD(name) graphics::setProfilerThreadName(name)
+#else
+    #define PROFILE_SCOPE(name) ((void) 0)
+    #define PROFILE_THREAD(name) ((void) 0)
+#endif
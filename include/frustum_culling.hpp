@@ -0,0 +1,79 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include <cstdint>
+#include <vector>
+
+namespace graphics {
+
+    /** Six planes (left, right, bottom, top, near, far) as (normal, distance), normals pointing
+     * inwards and normalized, so dot(normal, p) + distance is the signed distance of p.
+     */
+    struct Frustum {
+        glm::vec4 planes[6];
+    };
+
+    /** \brief Extract the frustum planes from a projection * view matrix (Gribb and Hartmann).
+     *
+     * The near plane is taken for a -w..w depth range, which for a 0..w range is slightly
+     * further out, so culling is conservative with either convention.
+     */
+    Frustum extractFrustum(const glm::mat4& viewProj);
+
+    /** Box around a model space box once it is transformed by model, as center and half extent. */
+    void transformBox(const glm::mat4& model, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+                      glm::vec3& center, glm::vec3& halfExtent);
+
+    /** \brief Bounding volumes of a set of objects, in structure of arrays form.
+     *
+     * Each component lives in its own array, so the culling loops load 4 (SSE) or 8 (AVX)
+     * objects' worth of one component with a single load. The arrays are padded to a
+     * multiple of CULLING_BATCH with volumes that are never visible, so the loops don't need a
+     * scalar tail.
+     */
+    struct CullingBounds {
+        static const uint32_t CULLING_BATCH = 8;
+
+        std::vector<float> sphereX, sphereY, sphereZ, sphereRadius;
+        std::vector<float> boxCenterX, boxCenterY, boxCenterZ;
+        std::vector<float> boxExtentX, boxExtentY, boxExtentZ; // half sizes
+        uint32_t count = 0;
+
+        void resize(uint32_t objectCount);
+        void setSphere(uint32_t index, const glm::vec3& center, float radius);
+        void setBox(uint32_t index, const glm::vec3& center, const glm::vec3& halfExtent);
+    };
+
+    /** \brief Write the indices of the objects whose sphere intersects the frustum to visible.
+     *
+     * visible must have room for bounds.count indices. Returns how many were written, in
+     * increasing order. Uses AVX when built with it (see ENABLE_AVX in CMakeLists.txt), SSE
+     * otherwise on x86, and the scalar version everywhere else.
+     */
+    uint32_t cullSpheres(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible);
+
+    /** Same as cullSpheres, with the boxes. Tighter for long thin objects, and a bit slower. */
+    uint32_t cullBoxes(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible);
+
+    /** Plain C++ versions of the above, the reference for the SIMD ones. */
+    uint32_t cullSpheresScalar(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible);
+    uint32_t cullBoxesScalar(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible);
+
+    /** Four axis aligned boxes, one component per array, e.g. the children of a BVH node. */
+    struct Box4 {
+        float minX[4], minY[4], minZ[4];
+        float maxX[4], maxY[4], maxZ[4];
+    };
+
+    /** \brief Test four boxes against the frustum at once.
+     *
+     * Bit i of the result is set if box i intersects the frustum, and bit i + 4 if it is also
+     * entirely inside it, in which case nothing it contains needs testing. Empty boxes (min
+     * greater than max) are never visible.
+     */
+    uint32_t classifyBoxes4(const Frustum& frustum, const Box4& boxes);
+
+    /** Name of the instruction set cullSpheres and cullBoxes were built for. */
+    const char* cullingInstructionSet();
+
+} // namespace graphics
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "frustum_culling.hpp"
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace graphics {
+
+    /** \brief What shaders/cull.comp knows about an object, std430 layout.
+     *
+     * The draw parameters are copied into the object's indirect command as they are, with
+     * instanceCount set to 1 if the sphere is inside the frustum and 0 otherwise.
+     */
+    struct GpuCullObject {
+        glm::vec4 sphere;       // world space center and radius
+        uint32_t indexCount;
+        uint32_t firstIndex;
+        int32_t vertexOffset;
+        uint32_t firstInstance; // picks the object's model matrix out of the instance stream
+    };
+    static_assert(sizeof(GpuCullObject) == 32, "GpuCullObject must match the std430 layout in cull.comp");
+
+    /** Same layout as VkDrawIndexedIndirectCommand, which is what cull.comp writes. */
+    struct IndirectDrawCommand {
+        uint32_t indexCount;
+        uint32_t instanceCount;
+        uint32_t firstIndex;
+        int32_t vertexOffset;
+        uint32_t firstInstance;
+    };
+    static_assert(sizeof(IndirectDrawCommand) == 20, "IndirectDrawCommand must match VkDrawIndexedIndirectCommand");
+
+    /** Push constants of cull.comp and occlusion_cull.comp. */
+    struct GpuCullConstants {
+        glm::vec4 planes[6]; // see Frustum
+        uint32_t objectCount;
+        uint32_t phase;      // occlusion_cull.comp only, one of the GPU_CULL_PHASE_ values
+    };
+
+    // occlusion_cull.comp runs twice a frame. The first pass keeps the objects that were visible
+    // last frame, which are drawn into the depth prepass, and the second tests every object
+    // against the Hi-Z pyramid built from that depth, and remembers which ones passed
+    const uint32_t GPU_CULL_PHASE_PREPASS = 0;
+    const uint32_t GPU_CULL_PHASE_OCCLUSION = 1;
+
+    /** Uniforms of occlusion_cull.comp, std140 layout. */
+    struct GpuOcclusionConstants {
+        glm::mat4 viewProj;
+        glm::vec2 depthSize; // of the depth buffer the pyramid was built from, in pixels
+        uint32_t hizLevels;
+        uint32_t padding;
+    };
+    static_assert(sizeof(GpuOcclusionConstants) == 80, "GpuOcclusionConstants must match the std140 layout in occlusion_cull.comp");
+
+    const uint32_t GPU_CULL_GROUP_SIZE = 64; // local_size_x of cull.comp and occlusion_cull.comp
+    const uint32_t HIZ_GROUP_SIZE = 8;       // local_size_x and local_size_y of hiz.comp
+
+    /** \brief CPU version of cull.comp, for validating what the GPU wrote.
+     *
+     * Writes one command per object, in the same order, with the same sphere test as
+     * cullSpheresScalar.
+     */
+    void cullObjectsReference(const Frustum& frustum, const GpuCullObject* objects, uint32_t count,
+                              IndirectDrawCommand* commands);
+
+    /** \brief Number of commands the GPU got wrong, checked against cullObjectsReference.
+     *
+     * The GPU is free to fuse the plane distance into multiply-adds, so spheres that touch a
+     * plane to within rounding can go either way and aren't counted. When the commands went
+     * through occlusion culling, pass occluded: objects inside the frustum that weren't drawn
+     * are then counted there instead of as mismatches.
+     */
+    uint32_t countCullingMismatches(const Frustum& frustum, const GpuCullObject* objects, uint32_t count,
+                                    const IndirectDrawCommand* commands, uint32_t* occluded = nullptr);
+
+    /** \brief Levels of the Hi-Z pyramid over a width x height depth buffer.
+     *
+     * Level 0 is half the size of the depth buffer, rounded up, and every level after that
+     * halves again down to 1x1. Rounding up means texel x of level l covers exactly the depth
+     * pixels [x * 2^(l+1), (x+1) * 2^(l+1)), whatever the size of the depth buffer.
+     */
+    uint32_t hizLevelCount(uint32_t width, uint32_t height);
+    /** Width (or height) of level of the pyramid over a depth buffer size pixels wide. */
+    uint32_t hizLevelSize(uint32_t size, uint32_t level);
+
+    /** \brief CPU version of hiz.comp: the pyramid of farthest depths over a depth buffer.
+     *
+     * Each texel is the max of the 2x2 texels under it in the level below, or in depth for
+     * level 0. Texels on the far edge of an odd sized level cover a single row or column.
+     */
+    void buildHiZReference(const float* depth, uint32_t width, uint32_t height, std::vector<std::vector<float>>& levels);
+
+    /** \brief CPU version of the occlusion test in occlusion_cull.comp.
+     *
+     * The corners of the box around the sphere are projected to find its screen rectangle and
+     * nearest depth, and the sphere is occluded if that depth is behind the farthest depth of
+     * the pyramid over the whole rectangle. The level is picked so that the rectangle spans
+     * at most 2x2 of its texels. Spheres reaching behind the camera are never occluded.
+     */
+    bool sphereOccludedReference(const GpuOcclusionConstants& constants, const std::vector<std::vector<float>>& levels,
+                                 const glm::vec4& sphere);
+
+} // namespace graphics
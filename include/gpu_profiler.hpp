@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace graphics {
+
+    struct GpuScopeStats {
+        std::string name;
+        uint32_t samples = 0;  // frames in the rolling window
+        double minMilliseconds = 0;
+        double avgMilliseconds = 0;
+        double p99Milliseconds = 0;
+        double lastMilliseconds = 0;
+    };
+
+    /** \brief Create a timestamp query pool per frame in flight.
+     *
+     * Does nothing (and every other call becomes a no-op) if the graphics queue doesn't support
+     * timestamps. Must be called after the logical device is created.
+     */
+    bool createGpuProfiler();
+    void destroyGpuProfiler();
+
+    /** \brief Collect the frame's previous results and reset its queries.
+     *
+     * Must be the first thing recorded into the frame's primary command buffer, once the
+     * frame's fence has signaled. The results read back here are framesInFlight frames old, but
+     * since the fence already signaled, reading them never stalls.
+     */
+    void beginGpuFrame(VkCommandBuffer cmd, uint32_t frameIndex);
+
+    /** Write a timestamp at the start of a named scope. Returns the id to end it with. */
+    uint32_t beginGpuScope(VkCommandBuffer cmd, const char* name);
+    void endGpuScope(VkCommandBuffer cmd, uint32_t scope);
+
+    /** Times everything recorded into cmd while it is alive. */
+    class GpuScope {
+    public:
+        GpuScope(VkCommandBuffer cmd, const char* name) : cmd(cmd), scope(beginGpuScope(cmd, name)) {}
+        ~GpuScope() { endGpuScope(cmd, scope); }
+        GpuScope(const GpuScope&) = delete;
+        GpuScope& operator=(const GpuScope&) = delete;
+    private:
+        VkCommandBuffer cmd;
+        uint32_t scope;
+    };
+
+    /** Rolling min / avg / p99 over the last few hundred frames, per scope, in first seen order. */
+    std::vector<GpuScopeStats> getGpuProfilerStats();
+    void printGpuProfilerStats();
+
+} // namespace graphics
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include "frustum_culling.hpp"
+#include "gpu_culling.hpp"
+#include "memory_allocator.hpp"
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace graphics {
+
+    struct Mesh;
+
+    // cull GpuScenes with cull.comp and draw them with vkCmdDrawIndexedIndirect. When off, or
+    // if the device can't (see gpuDrivenSupported), they are culled on the CPU with
+    // cullObjectsReference and drawn through submitCulledDraw instead
+    extern bool gpuDrivenRendering;
+    // read every frame's indirect commands back and check them against cullObjectsReference.
+    // The commands then live in host memory, so this is for debugging only. Set before any
+    // GpuScene draws its first frame
+    extern bool gpuCullingValidation;
+    // also cull GpuScene objects hidden behind others, with a depth prepass and a Hi-Z pyramid
+    // (see occlusion_cull.comp). Needs GPU driven rendering, see occlusionCullingSupported
+    extern bool occlusionCulling;
+
+    struct GpuSceneStats {
+        uint32_t drawCalls = 0;       // vkCmdDrawIndexedIndirect calls in the last frame
+        uint64_t framesValidated = 0;
+        uint64_t mismatches = 0;      // commands the GPU got wrong, over all validated frames
+        uint64_t occluded = 0;        // objects in the frustum hidden by occlusion culling, over all validated frames
+    };
+
+    /** Which dispatch GpuScene::recordCulling records. */
+    enum class CullPhase {
+        Frustum,   // cull.comp, frustum culling only
+        Prepass,   // occlusion_cull.comp before the depth prepass, keeps what was visible last frame
+        Occlusion, // occlusion_cull.comp after the Hi-Z build, tests everything against it
+    };
+
+    /** \brief Create the culling compute pipeline, if the device supports GPU driven rendering.
+     *
+     * firstInstance in indirect draws needs the drawIndirectFirstInstance feature. Without
+     * multiDrawIndirect every command is drawn with its own vkCmdDrawIndexedIndirect, which
+     * still needs no CPU work per object beyond the call itself. Must be called after the
+     * logical device (which enables both features when available) is created.
+     */
+    bool createGpuCulling();
+    void destroyGpuCulling();
+    bool gpuDrivenSupported();
+    /** GPU driven rendering, plus a depth format that the Hi-Z build can sample. */
+    bool occlusionCullingSupported();
+
+    /** \brief Objects that are culled and drawn entirely by the GPU.
+     *
+     * Like Scene, objects are added once and only touched when they move. Their bounds and
+     * draw parameters live in a storage buffer, their model matrices in an instance stream,
+     * and every frame cull.comp turns them into indirect draw commands, so the CPU records the
+     * same handful of commands whatever the object count: a dispatch, then one indirect draw
+     * per mesh. Objects are kept sorted by mesh to make that work, so adding or removing one
+     * re-uploads the whole scene, while moving one only uploads that object.
+     *
+     * Each frame in flight has its own copy of the buffers, so uploads never touch anything a
+     * frame still in flight reads. Draw with submitGpuScene. The GPU must be done with every
+     * frame that drew the scene before it is destroyed.
+     *
+     * With occlusion culling, the objects that were drawn last frame are drawn into a depth
+     * prepass first, and everything is then tested against the Hi-Z pyramid of that depth. What
+     * was drawn is remembered in a visibility buffer shared by all frames, which starts out
+     * with everything visible whenever the slots change.
+     */
+    class GpuScene {
+    public:
+        GpuScene() = default;
+        ~GpuScene();
+        GpuScene(const GpuScene&) = delete;
+        GpuScene& operator=(const GpuScene&) = delete;
+
+        /** Returns the object's id, which stays valid until it is removed. mesh must outlive it. */
+        uint32_t add(const Mesh& mesh, const glm::mat4& model);
+        void remove(uint32_t object);
+        void setTransform(uint32_t object, const glm::mat4& model);
+        const glm::mat4& transform(uint32_t object) const { return objects[object].model; }
+
+        uint32_t size() const { return static_cast<uint32_t>(objects.size() - freeObjects.size()); }
+        const GpuSceneStats& stats() const { return stats_; }
+
+        /** \brief CPU side of a frame: bring the frame's buffers up to date and set up culling.
+         *
+         * Also checks the commands the frame wrote last time, when validating. Must be called
+         * once the frame's fence has signaled, and after the frame's uniform region is reset.
+         * Set occlusion to cull with the Prepass and Occlusion phases instead of Frustum.
+         * Returns false if there is nothing to draw.
+         */
+        bool prepareFrame(uint32_t frameIndex, const Frustum& frustum, const glm::mat4& viewProj, bool occlusion);
+        /** \brief Record a culling dispatch, outside of a render pass, and make its output visible
+         * to the indirect draws.
+         *
+         * Without occlusion culling that is the Frustum phase. With it, the Prepass phase goes
+         * before the depth prepass, and the Occlusion phase after the Hi-Z build.
+         */
+        void recordCulling(VkCommandBuffer cmd, uint32_t frameIndex, CullPhase phase);
+        /** Record the indirect draws, inside the render pass. The caller binds the view and
+         * projection UBO, which the instanced pipelines read.
+         */
+        void recordDraws(VkCommandBuffer cmd, uint32_t frameIndex);
+        /** Same as recordDraws, with the depth only pipelines of the depth prepass. */
+        void recordDepthDraws(VkCommandBuffer cmd, uint32_t frameIndex);
+
+        /** The fallback without GPU culling: cull with cullObjectsReference and submit the
+         * visible objects through submitCulledDraw. Returns how many were submitted.
+         */
+        uint32_t submitVisible(const Frustum& frustum);
+
+    private:
+        struct Object {
+            const Mesh* mesh; // null once removed
+            glm::mat4 model;
+            uint32_t slot;    // into the GPU arrays, which are sorted by mesh
+        };
+
+        /** A run of slots with the same mesh, drawn with one indirect draw. */
+        struct Batch {
+            const Mesh* mesh;
+            uint32_t firstSlot;
+            uint32_t count;
+        };
+
+        struct FrameBuffers {
+            VkBuffer objectBuffer = VK_NULL_HANDLE;  // GpuCullObject per slot, storage
+            VkBuffer modelBuffer = VK_NULL_HANDLE;   // mat4 per slot, instance rate vertex buffer
+            VkBuffer commandBuffer = VK_NULL_HANDLE; // IndirectDrawCommand per slot, written by cull.comp
+            Allocation objectAllocation, modelAllocation, commandAllocation;
+            uint32_t capacity = 0;
+            VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+            bool fullUpload = true;       // every slot has to be uploaded again
+            std::vector<uint32_t> moved;  // slots to upload before the frame is drawn again
+
+            // what the occlusion bindings of descriptorSet point at
+            VkBuffer boundVisibility = VK_NULL_HANDLE;
+            uint32_t boundHiZGeneration = 0;
+
+            // what the commands were culled against, checked on the frame's next use
+            bool validationPending = false;
+            bool validationOcclusion = false;
+            Frustum validationFrustum;
+            std::vector<GpuCullObject> validationObjects;
+        };
+
+        /** A visibility buffer that was replaced, kept until no frame in flight can read it. */
+        struct RetiredBuffer {
+            VkBuffer buffer;
+            Allocation allocation;
+            uint32_t pendingFrames; // bit per frame index that hasn't been prepared since
+        };
+
+        void writeSlot(uint32_t object);
+        void rebuildSlots();
+        bool createFrameBuffers(FrameBuffers& frame, uint32_t capacity);
+        void destroyFrameBuffers(FrameBuffers& frame);
+        bool prepareOcclusion(FrameBuffers& frame, const glm::mat4& viewProj);
+        void recordIndirectDraws(VkCommandBuffer cmd, uint32_t frameIndex, const std::vector<VkPipeline>& pipelines);
+
+        std::vector<Object> objects;
+        std::vector<uint32_t> freeObjects;
+        bool slotsChanged = false;
+
+        // in slot order, what the GPU buffers hold
+        std::vector<GpuCullObject> slotObjects;
+        std::vector<glm::mat4> slotModels;  // with any dequantization folded in
+        std::vector<uint32_t> slotToObject;
+        std::vector<Batch> batches;
+
+        std::vector<FrameBuffers> frames;
+        VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+        GpuCullConstants constants;
+
+        // 1 per slot if the object was drawn last frame, read and written by occlusion_cull.comp
+        VkBuffer visibilityBuffer = VK_NULL_HANDLE;
+        Allocation visibilityAllocation;
+        uint32_t visibilityCapacity = 0;
+        bool visibilityReset = true; // the slots changed, so the next prepass draws everything
+        std::vector<RetiredBuffer> retiredBuffers;
+        uint32_t occlusionOffset = 0; // of the frame's GpuOcclusionConstants in the uniform ring
+        std::vector<IndirectDrawCommand> fallbackCommands;
+        GpuSceneStats stats_;
+    };
+
+} // namespace graphics
@@ -1,3 +1,5 @@
+#pragma once
+
 #define GLFW_INCLUDE_VULKAN
 #include "GLFW/glfw3.h"
 #define GLM_FORCE_RADIANS
@@ -6,12 +8,136 @@
 #include <vector>
 #include <array>
 
+#include "bvh.hpp"
+#include "cpu_profiler.hpp"
+#include "frustum_culling.hpp"
+#include "gpu_profiler.hpp"
+#include "gpu_scene.hpp"
+#include "headless.hpp"
+#include "hiz_pyramid.hpp"
+#include "memory_allocator.hpp"
+#include "mesh_cache.hpp"
+#include "mesh_loader.hpp"
+#include "mesh_optimizer.hpp"
+#include "pipeline_cache.hpp"
+#include "scene.hpp"
+#include "shader_registry.hpp"
+#include "staging_buffer.hpp"
+#include "uniform_ring.hpp"
+#include "vertex_layout.hpp"
+#include "worker_threads.hpp"
+
+// validation layers are on by default. Turn them off for benchmarks, or on machines that
+// don't have them installed
+extern bool enableValidationLayers;
+
 namespace graphics {
 
     bool initVulkan(int screenWidth, int screenHeight);
     void cleanup();
 
+    /** A level of detail of a Mesh: a range of its index buffer. */
+    struct MeshLodRange {
+        uint32_t firstIndex;
+        uint32_t indexCount;
+        float error;         // in the mesh's units, see MeshLod
+    };
+
+    /** A mesh that has been uploaded to the GPU, ready to be drawn with submitDraw. */
+    struct Mesh {
+        VkBuffer vertexBuffer = VK_NULL_HANDLE;
+        VkBuffer indexBuffer = VK_NULL_HANDLE;
+        Allocation vertexAllocation;
+        Allocation indexAllocation;
+        uint32_t vertexCount = 0;
+        uint32_t indexCount = 0;
+        VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+        uint32_t pipelineIndex = 0;          // into graphicsPipelines, for the mesh's vertex layout
+        bool quantized = false;              // if set, draws apply dequantize before the model matrix
+        glm::mat4 dequantize = glm::mat4(1.0f);
+        glm::vec3 boundsMin = glm::vec3(0.0f);  // in model space, before dequantize. For culling
+        glm::vec3 boundsMax = glm::vec3(0.0f);
+        // level 0 is the first indexCount indices, level i > 0 is lods[i - 1], further down
+        // the same index buffer
+        std::vector<MeshLodRange> lods;
+    };
+
+    /** \brief Upload data into a new mesh, with its vertices encoded in layout.
+     *
+     * Indices are stored as 16 bit whenever the mesh has few enough vertices, and as 32 bit
+     * otherwise. The buffers are filled through the staging ring, so the mesh can be drawn
+     * right away. The first mesh with a new layout creates a pipeline for it. The levels of
+     * detail in data.lods go into the same index buffer. Must be called after initVulkan.
+     */
+    bool createMesh(const MeshData& data, Mesh& mesh, const VertexLayout& layout = VertexLayout::standard());
+    /** Same as above, straight out of a mapped .mesh file. The file can be closed right after. */
+    bool createMesh(const MeshCache& cache, Mesh& mesh);
+    /** Destroy the buffers of a mesh. The GPU must be done with any frame that drew it. */
+    void destroyMesh(Mesh& mesh);
+
+    struct DrawCommand {
+        const Mesh* mesh;
+        glm::mat4 model;
+        uint32_t lod;
+    };
+
+    struct FrameStats {
+        uint64_t frames = 0;                // frames recorded
+        uint64_t draws = 0;                 // draw calls recorded, over all frames
+        uint64_t instances = 0;             // instances drawn by submitInstances, over all frames
+        uint64_t culled = 0;                // submitted draws dropped by frustum culling, over all frames
+        uint64_t gpuObjects = 0;            // objects of GpuScenes culled by the GPU, over all frames
+        uint64_t triangles = 0;             // drawn by submitDraw and submitCulledDraw, over all frames
+        uint64_t coarseDraws = 0;           // of those draws, the ones at a level of detail above 0
+        double recordMilliseconds = 0;      // CPU time spent recording, over all frames
+        double lastRecordMilliseconds = 0;
+    };
+
+    /** \brief Add a draw of mesh to the next frame.
+     *
+     * The draw list is rebuilt every frame: drawFrame records whatever was submitted since the
+     * last drawFrame into a fresh command buffer, then clears the list. The mesh must stay
+     * alive until drawFrame is called.
+     */
+    void submitDraw(const Mesh& mesh, const glm::mat4& model);
+
+    /** Like submitDraw, for draws the caller has already culled (see Scene), which skip the
+     * draw list's own frustum culling. They are drawn at level of detail lod as they are.
+     */
+    void submitCulledDraw(const Mesh& mesh, const glm::mat4& model, uint32_t lod = 0);
+
+    /** The camera the next frame is recorded with. Only valid after initVulkan. */
+    void getCameraMatrices(glm::mat4& view, glm::mat4& proj);
+
+    /** Pixels that one unit at distance one from the camera covers on screen, for selectLod. */
+    float lodPixelScale(const glm::mat4& proj);
+    /** \brief The coarsest level of detail of mesh whose error projects to at most lodPixelError pixels.
+     *
+     * The error is scaled by the model matrix and projected at the distance from the camera to
+     * the nearest point of the mesh's bounding sphere. current is the level the object was
+     * drawn at last frame: going coarser than that needs the error to fall LOD_HYSTERESIS
+     * below the limit, so objects sitting right at a switching distance don't pop back and
+     * forth between two levels.
+     */
+    uint32_t selectLod(const Mesh& mesh, const glm::mat4& model, const glm::vec3& camera, float pixelScale, uint32_t current);
+
+    /** \brief Add count instances of mesh to the next frame, as a single instanced draw call.
+     *
+     * The model matrices are copied, and reach the vertex shader through a second vertex
+     * binding with VK_VERTEX_INPUT_RATE_INSTANCE instead of a UBO per object, so 100k instances
+     * cost one vkCmdDrawIndexed and one memcpy.
+     */
+    void submitInstances(const Mesh& mesh, const glm::mat4* models, uint32_t count);
+    /** \brief Draw every object of scene in the next frame, culled on the GPU.
+     *
+     * The culling dispatch is recorded ahead of the render pass, and the scene's indirect draws
+     * go after the submitted draws. With occlusion culling, the scene is also drawn into a depth
+     * prepass ahead of the render pass, which the main pass then starts from, so only GpuScene
+     * objects occlude anything. Like submitDraw, this only lasts for one frame.
+     */
+    void submitGpuScene(GpuScene& scene);
     bool drawFrame();
+    FrameStats getFrameStats();
 
     bool createInstance();
     bool setupDebugCallback();
@@ -20,25 +146,39 @@ namespace graphics {
     bool createLogicalDevice();
     bool createSwapChain();
     bool createImageViews();
+    /** Pick a depth format, sampleable if possible for the Hi-Z build, and create the depth buffer. */
+    bool createDepthResources();
     bool createRenderPass();
+    bool createMainRenderPass(VkAttachmentLoadOp depthLoadOp, VkRenderPass& pass);
+    bool createDepthPrepassRenderPass();
     bool createDescriptorSetLayout();
     bool createGraphicsPipeline();
+    bool createVertexLayoutPipeline(const VertexLayout& layout, bool instanced, VkPipeline& pipeline, bool depthOnly = false);
+    /** Index into graphicsPipelines of the pipeline for layout, created if it's a new layout. */
+    bool getVertexLayoutPipeline(const VertexLayout& layout, uint32_t& index);
     bool createFramebuffers();
     bool createCommandPool();
-    bool createVertexBuffer();
-    bool createIndexBuffer();
-    bool createUniformBuffers();
+    bool createVertexBuffer(const void* vertices, uint32_t vertexCount, uint32_t stride, Mesh& mesh);
+    bool createIndexBuffer(const void* indices, uint32_t indexCount, VkIndexType indexType, Mesh& mesh);
+    bool createQuadMesh();
     bool createDescriptorPool();
     bool createDescriptorSets();
     bool createCommandBuffers();
+    bool recordCommandBuffer(VkCommandBuffer cmd, uint32_t imageIndex);
+    bool recordFrame(uint32_t imageIndex);
+    bool drawHeadlessFrame();
     bool createSyncObjects();
     void cleanupSwapChain();
-    void recreateSwapChain();
+    void cleanupRenderPass();
+    bool recreateSwapChain();
 
 
     struct QueueFamilyIndices {
         uint32_t graphicsFamily = -1;
         uint32_t presentFamily = -1;
+        // family used for uploads. Only differs from graphicsFamily if the device has a
+        // dedicated transfer family and useDedicatedTransferQueue is on
+        uint32_t transferFamily = -1;
 
         bool isComplete() const {
             return graphicsFamily != -1 && presentFamily != -1;
@@ -51,6 +191,22 @@ namespace graphics {
         QueueFamilyIndices indices;
     };
 
+    // set before initVulkan to disable the async transfer queue (uploads use graphicsQueue)
+    extern bool useDedicatedTransferQueue;
+    // number of frames the CPU can record ahead of the GPU. Set before initVulkan
+    extern uint32_t framesInFlight;
+    // threads that record large draw lists in parallel, including the main thread (0 picks one
+    // per core, 1 records everything on the main thread). Set before initVulkan
+    extern uint32_t recordingThreads;
+    // drop submitDraw draws whose bounds are outside the view frustum before recording them
+    extern bool frustumCulling;
+    // draw meshes with levels of detail at the coarsest one whose error is at most
+    // lodPixelError pixels on screen (see selectLod). submitDraw draws pick theirs every frame
+    // without any history, Scene objects keep theirs from frame to frame
+    extern bool levelOfDetail;
+    extern float lodPixelError;
+    const float LOD_HYSTERESIS = 0.25f;
+
     // TODO: make private
     extern GLFWwindow* window;
     extern int SW, SH;
@@ -59,32 +215,39 @@ namespace graphics {
     extern VkSurfaceKHR surface;
     extern PhysicalDeviceInfo physicalDeviceInfo;
     extern VkDevice logicalDevice;
-    extern VkQueue graphicsQueue, presentQueue;
+    extern VkQueue graphicsQueue, presentQueue, transferQueue;
     extern VkSwapchainKHR swapChain;
     extern std::vector<VkImage> swapChainImages;
     extern VkFormat swapChainImageFormat;
     extern VkExtent2D swapChainExtent;
     extern std::vector<VkImageView> swapChainImageViews;
     extern VkRenderPass renderPass;
+    extern VkRenderPass depthLoadRenderPass;    // same as renderPass, starting from the depth prepass
+    extern VkRenderPass depthPrepassRenderPass;
+    extern VkFormat depthFormat;
+    extern VkImage depthImage;
+    extern VkImageView depthImageView;
     extern VkDescriptorSetLayout descriptorSetLayout;
     extern VkPipelineLayout pipelineLayout;
-    extern VkPipeline graphicsPipeline;
+    extern std::vector<VertexLayout> pipelineVertexLayouts; // [0] is VertexLayout::standard()
+    extern std::vector<VkPipeline> graphicsPipelines;       // one per entry of pipelineVertexLayouts
+    extern std::vector<VkPipeline> instancedPipelines;      // same, for submitInstances
+    extern std::vector<VkPipeline> depthPipelines;          // same, depth only, for the depth prepass
     extern std::vector<VkFramebuffer> swapChainFramebuffers;
-    extern VkCommandPool commandPool;
+    extern VkFramebuffer depthPrepassFramebuffer;
+    extern std::vector<VkCommandPool> frameCommandPools;
+    extern std::vector<std::vector<VkCommandPool>> workerCommandPools;     // [frame][slice]
+    extern std::vector<std::vector<VkCommandBuffer>> workerCommandBuffers; // [frame][slice], secondary
     extern std::vector<VkCommandBuffer> commandBuffers;
     extern std::vector<VkSemaphore> imageAvailableSemaphores;
     extern std::vector<VkSemaphore> renderFinishedSemaphores;
     extern std::vector<VkFence> inFlightFences;
+    extern std::vector<VkFence> imagesInFlight;
     extern size_t currentFrame;
     extern bool framebufferResized;
-    extern VkBuffer vertexBuffer;
-    extern VkDeviceMemory vertexBufferMemory;
-    extern VkBuffer indexBuffer;
-    extern VkDeviceMemory indexBufferMemory;
-    extern std::vector<VkBuffer> uniformBuffers;
-    extern std::vector<VkDeviceMemory> uniformBuffersMemory;
+    extern Mesh quadMesh;
     extern VkDescriptorPool descriptorPool;
-    extern std::vector<VkDescriptorSet> descriptorSets;
+    extern VkDescriptorSet descriptorSet;
 
 
 } // namespace graphics
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <cstdint>
+#include <functional>
+
+namespace graphics {
+
+    /** Called with every frame rendered in headless mode. pixels is tightly packed RGBA8, and is
+     * only valid for the duration of the call.
+     */
+    using ReadbackCallback = std::function<void(const uint8_t* pixels, uint32_t width, uint32_t height, uint64_t frame)>;
+
+    // set before initVulkan to render into offscreen images instead of a window. No window,
+    // surface, VK_KHR_swapchain or present queue is needed, so it runs on servers and on
+    // software implementations like lavapipe
+    extern bool headless;
+    // set to get the rendered frames back on the CPU. Leave empty to skip the readback copies
+    extern ReadbackCallback readbackCallback;
+
+    /** \brief Create the offscreen color targets that stand in for the swap chain images.
+     *
+     * There is one target per frame in flight, so frames never have to wait on each other's
+     * images. They fill in swapChainImages / swapChainImageFormat / swapChainExtent, so the
+     * image views, framebuffers and render pass are created exactly like with a swap chain.
+     * Also creates a host visible readback buffer per frame in flight.
+     */
+    bool createOffscreenTargets();
+    void destroyOffscreenTargets();
+
+    /** Record a copy of the target into the frame's readback buffer. Goes after the render pass. */
+    void recordReadback(VkCommandBuffer cmd, uint32_t imageIndex, uint32_t frameIndex);
+
+    /** \brief Hand the frame's last readback to readbackCallback, if it has one pending.
+     *
+     * Must only be called once the frame's fence has signaled. Readbacks are delivered
+     * framesInFlight frames late, so the CPU never stalls waiting on a copy to finish.
+     */
+    void deliverReadback(uint32_t frameIndex);
+
+} // namespace graphics
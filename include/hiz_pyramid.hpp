@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <cstdint>
+
+namespace graphics {
+
+    /** What occlusion_cull.comp needs to read the Hi-Z pyramid. */
+    struct HiZPyramid {
+        VkImageView view = VK_NULL_HANDLE;  // all of the levels
+        VkSampler sampler = VK_NULL_HANDLE; // nearest, the pyramid is only read with texelFetch
+        uint32_t width = 0, height = 0;     // of the depth buffer it is built from
+        uint32_t levels = 0;
+        uint32_t generation = 0;            // bumped every time the pyramid is recreated
+    };
+
+    /** \brief Create the compute pipeline that builds the Hi-Z pyramid.
+     *
+     * Occlusion culling needs to sample the depth buffer, which not every depth format
+     * supports. Without it this does nothing and hizSupported returns false. Must be called
+     * after the depth buffer's format is picked (see createDepthResources).
+     */
+    bool createHiZPipeline();
+    void destroyHiZPipeline();
+    bool hizSupported();
+
+    /** \brief Create the pyramid over the depth buffer, with a level per halving down to 1x1.
+     *
+     * Level 0 is half the size of the depth buffer, rounded up (see hizLevelCount), and every
+     * texel holds the farthest depth of the pixels under it. Lives as long as the depth buffer,
+     * so it is recreated along with the swap chain.
+     */
+    bool createHiZPyramid();
+    void destroyHiZPyramid();
+
+    /** \brief Record the build of the whole pyramid from the depth buffer, outside a render pass.
+     *
+     * One dispatch per level, each reading the level before. The depth buffer must be in
+     * DEPTH_STENCIL_READ_ONLY_OPTIMAL and visible to compute shaders, which the depth prepass
+     * takes care of. Afterwards the pyramid is in GENERAL and readable by compute shaders.
+     */
+    void recordHiZBuild(VkCommandBuffer cmd);
+    const HiZPyramid& getHiZPyramid();
+
+} // namespace graphics
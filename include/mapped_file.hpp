@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace graphics {
+
+    /** \brief Read-only view of a whole file.
+     *
+     * Files of at least mmapThreshold bytes are memory mapped, so the OS pages them in as they
+     * are read and nothing is copied. Smaller files (and every file on Windows) are read into
+     * memory instead, since setting up a mapping costs more than reading a few pages. Either way
+     * the data is aligned to at least 4 bytes and stays valid until the MappedFile is closed or
+     * destroyed.
+     */
+    class MappedFile {
+    public:
+        MappedFile() = default;
+        ~MappedFile() { close(); }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool open(const std::string& path, size_t mmapThreshold = 64 * 1024);
+        void close();
+
+        const char* data() const { return data_; }
+        size_t size() const { return size_; }
+        bool mapped() const { return mapped_; }
+
+    private:
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+        bool mapped_ = false;
+        std::vector<uint32_t> buffer_; // backing store when the file is read rather than mapped
+    };
+
+} // namespace graphics
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <cstdint>
+
+namespace graphics {
+
+    /** \brief A sub-allocated range of a VkDeviceMemory block.
+     *
+     * Returned by allocateMemory and handed back to freeMemory once the resource bound to it
+     * is destroyed. Host visible memory is persistently mapped, so mappedData can be written
+     * directly instead of calling vkMapMemory (which can't be done twice on the same block).
+     */
+    struct Allocation {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;           // size that was requested
+        void* mappedData = nullptr;      // nullptr if the memory is not host visible
+        uint32_t memoryTypeIndex = 0;
+
+        // bookkeeping for the allocator, don't touch
+        uint32_t poolIndex = 0;
+        uint32_t blockId = 0;
+        uint32_t order = 0;
+        bool dedicated = false;
+    };
+
+    struct AllocatorStats {
+        VkDeviceSize bytesReserved = 0;    // total size of all live VkDeviceMemory objects
+        VkDeviceSize bytesAllocated = 0;   // bytes handed out, including the power of 2 rounding
+        VkDeviceSize bytesInUse = 0;       // bytes actually requested by the resources
+        VkDeviceSize largestFreeRange = 0; // biggest single allocation that fits without a new block
+        uint32_t deviceMemoryCount = 0;    // live vkAllocateMemory objects
+        uint32_t allocationCount = 0;      // live sub-allocations
+        uint64_t totalAllocations = 0;     // allocateMemory calls since startup
+        uint64_t totalDeviceMemoryAllocations = 0; // vkAllocateMemory calls since startup
+
+        /** Fraction of the handed out memory lost to rounding up to a power of 2. */
+        float internalFragmentation() const {
+            return bytesAllocated ? 1.0f - bytesInUse / (float) bytesAllocated : 0.0f;
+        }
+
+        /** Fraction of the free memory that can't be used for one allocation of that size. */
+        float externalFragmentation() const {
+            VkDeviceSize freeBytes = bytesReserved - bytesAllocated;
+            return freeBytes ? 1.0f - largestFreeRange / (float) freeBytes : 0.0f;
+        }
+    };
+
+    /** \brief Sets up the sub-allocator. Must be called after the logical device is created.
+     *
+     * Memory is reserved from the driver in large blocks per memory type, and resources get
+     * power of 2 ranges out of those blocks with a buddy allocator. Buddy ranges are naturally
+     * aligned to their size, so any alignment <= the range size comes for free. Linear (buffers)
+     * and optimal tiling (images) resources are kept in separate blocks whenever the device's
+     * bufferImageGranularity is bigger than the smallest range, so they never share a page.
+     */
+    bool createAllocator();
+    void destroyAllocator();
+
+    /** Sub-allocate memory satisfying the given requirements and properties. Set linear to
+     * false for optimal tiling images.
+     */
+    bool allocateMemory(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties,
+                        bool linear, Allocation& allocation);
+    void freeMemory(Allocation& allocation);
+
+    AllocatorStats getAllocatorStats();
+    void printAllocatorStats();
+
+    /** Find the first memory type allowed by typeFilter that has all of the given properties. */
+    bool findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties, uint32_t& index);
+
+    /** Create a buffer and bind it to a freshly sub-allocated range of memory. */
+    bool createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
+                      VkBuffer& buffer, Allocation& allocation);
+    void destroyBuffer(VkBuffer& buffer, Allocation& allocation);
+
+} // namespace graphics
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "mapped_file.hpp"
+#include "mesh_loader.hpp"
+
+#include <cstdint>
+#include <string>
+
+namespace graphics {
+
+    const uint32_t MESH_CACHE_MAGIC = 0x4853454d; // "MESH" in a little endian file
+    // bump whenever MeshCacheHeader or the blob layout changes, old files are then rejected
+    const uint32_t MESH_CACHE_VERSION = 2;
+    // blobs start on a cache line, so they can be copied out of the mapping at full speed
+    const uint32_t MESH_CACHE_ALIGNMENT = 64;
+    const uint32_t MESH_CACHE_MAX_ATTRIBUTES = 8;
+    const uint32_t MESH_CACHE_MAX_LODS = MAX_MESH_LODS;
+
+    struct MeshCacheAttribute {
+        uint32_t location;
+        uint32_t format;  // VkFormat
+        uint32_t offset;
+    };
+
+    /** A level of detail, as a range of the index blob. */
+    struct MeshCacheLod {
+        uint32_t firstIndex;
+        uint32_t indexCount;
+        float error;      // see MeshLod
+    };
+
+    /** \brief The start of a .mesh file, followed by the vertex and index blobs.
+     *
+     * Everything is stored exactly the way the GPU consumes it: the vertices are in the
+     * VertexLayout described by attributes (quantized positions are relative to the bounds),
+     * and the indices are already narrowed to indexType. Loading a mesh is a mapping plus one
+     * copy into the staging ring per blob, with no parsing at all.
+     *
+     * The index blob holds every level of detail one after the other, starting with the full
+     * mesh, so indexCount counts all of them and lods[0] is the full mesh.
+     */
+    struct MeshCacheHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t headerSize;
+        uint32_t vertexCount;
+        uint32_t vertexStride;
+        uint32_t indexCount;
+        uint32_t indexType;      // VkIndexType
+        uint32_t attributeCount;
+        MeshCacheAttribute attributes[MESH_CACHE_MAX_ATTRIBUTES];
+        float boundsMin[3];
+        float boundsMax[3];
+        float sphereCenter[3];
+        float sphereRadius;
+        uint32_t lodCount;       // at least 1
+        MeshCacheLod lods[MESH_CACHE_MAX_LODS];
+        uint32_t reserved;
+        uint64_t vertexOffset;   // from the start of the file
+        uint64_t vertexBytes;
+        uint64_t indexOffset;
+        uint64_t indexBytes;
+        uint64_t checksum;       // of the vertex blob followed by the index blob
+    };
+    static_assert(sizeof(MeshCacheHeader) == 312, "MeshCacheHeader is part of the file format");
+
+    /** Write mesh out as a .mesh file with its vertices encoded in layout, and with 16 bit
+     * indices if it has few enough vertices. Its levels of detail go along.
+     */
+    bool writeMeshCache(const std::string& path, const MeshData& mesh,
+                        const VertexLayout& layout = VertexLayout::standard());
+
+    /** \brief A mapped .mesh file.
+     *
+     * open always checks that the header is consistent and that the blobs fit in the file,
+     * which is cheap. With verify set it also checks the checksum and that every index is in
+     * range, which has to touch the whole file; do that in tools, or after a failed load.
+     */
+    class MeshCache {
+    public:
+        bool open(const std::string& path, bool verify = false);
+        void close();
+
+        const MeshCacheHeader& header() const { return *header_; }
+        const void* vertexData() const { return file.data() + header_->vertexOffset; }
+        const void* indexData() const { return file.data() + header_->indexOffset; }
+
+        /** The layout the vertices are stored in. False if it uses an unknown format. */
+        bool getVertexLayout(VertexLayout& layout) const;
+        /** Copy the mesh out, for code that works on it on the CPU. */
+        bool toMeshData(MeshData& mesh) const;
+
+    private:
+        MappedFile file;
+        const MeshCacheHeader* header_ = nullptr;
+    };
+
+} // namespace graphics
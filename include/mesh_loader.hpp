@@ -0,0 +1,49 @@
+#pragma once
+
+#include "vertex_layout.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace graphics {
+
+    // levels of detail a mesh can have, the full mesh included
+    const uint32_t MAX_MESH_LODS = 8;
+
+    /** A coarser version of a mesh, over the same vertices. */
+    struct MeshLod {
+        std::vector<uint32_t> indices;
+        float error = 0.0f; // how far the surface may have moved, in the mesh's units
+    };
+
+    /** Indexed triangle list on the CPU side, ready to be handed to createMesh. */
+    struct MeshData {
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<MeshLod> lods; // coarser levels of detail, from generateLods
+        glm::vec3 boundsMin = glm::vec3(0.0f);
+        glm::vec3 boundsMax = glm::vec3(0.0f);
+    };
+
+    struct MeshLoadStats {
+        uint64_t bytesRead = 0;
+        uint32_t positions = 0;       // v lines
+        uint32_t normals = 0;         // vn lines
+        uint32_t faces = 0;           // f lines, before triangulation
+        uint32_t cornersDeduplicated = 0; // face corners that reused an existing vertex
+        double milliseconds = 0;
+    };
+
+    /** \brief Load the triangles of a Wavefront OBJ file.
+     *
+     * The file is memory mapped and parsed in a single pass with a hand written number parser,
+     * so large files load at close to disk speed. Polygons are split into triangle fans, and
+     * face corners with the same position and normal share one vertex. Normals are kept when
+     * the file has them. Vertex colors come from the normals if there are any, then from
+     * "v x y z r g b" colors, and otherwise from the position within the bounding box. Texture
+     * coordinates, groups and materials are ignored.
+     */
+    bool loadObj(const std::string& path, MeshData& mesh, MeshLoadStats* stats = nullptr);
+
+} // namespace graphics
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "mesh_loader.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace graphics {
+
+    // post-transform cache size the optimizer targets and analyzeVertexCache simulates. GPUs
+    // don't have a literal FIFO any more, but orders that do well on a 16 entry FIFO do well
+    // on all of them
+    const uint32_t VERTEX_CACHE_SIZE = 16;
+
+    struct VertexCacheStats {
+        uint32_t verticesTransformed = 0; // vertex shader invocations, with a FIFO cache
+        float acmr = 0.0f;                // average cache miss ratio: transformed / triangles, 0.5 at best
+        float atvr = 0.0f;                // average transformed vertex ratio: transformed / vertices, 1 at best
+    };
+
+    struct MeshOptimizeStats {
+        VertexCacheStats before;
+        VertexCacheStats after;
+        uint32_t clusters = 0;            // triangle clusters sorted for overdraw
+        double milliseconds = 0;
+    };
+
+    /** Simulate a FIFO post-transform cache of cacheSize entries over the triangle list. */
+    VertexCacheStats analyzeVertexCache(const std::vector<uint32_t>& indices, uint32_t vertexCount,
+                                        uint32_t cacheSize = VERTEX_CACHE_SIZE);
+
+    /** \brief Reorder triangles for the post-transform cache, with Tipsify.
+     *
+     * Tipsify (Sander, Nehab and Barczak 2007) fans around one vertex at a time and picks the
+     * next vertex among those still in the cache, which runs in linear time and gets close to
+     * the ACMR of slower methods like Forsyth's. If clusters is given it gets the index (in
+     * triangles) where each run of the output starts, for optimizeOverdraw.
+     */
+    void optimizeVertexCache(std::vector<uint32_t>& indices, uint32_t vertexCount,
+                             std::vector<uint32_t>* clusters = nullptr, uint32_t cacheSize = VERTEX_CACHE_SIZE);
+
+    /** \brief Reorder the clusters from optimizeVertexCache so outward facing ones draw first.
+     *
+     * Clusters are split further wherever that costs less than threshold times their ACMR, then
+     * sorted by how far they face away from the center of the mesh. Triangles on the outside
+     * of a mesh tend to occlude the ones on the inside, so this cuts down overdraw from any
+     * view direction, without giving back more than the threshold of vertex cache efficiency.
+     */
+    void optimizeOverdraw(std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices,
+                          const std::vector<uint32_t>& clusters, float threshold = 1.05f,
+                          uint32_t* clusterCount = nullptr);
+
+    /** \brief Reorder vertices in the order the indices first use them, and remap the indices.
+     *
+     * The vertex fetches then walk the vertex buffer mostly sequentially. Vertices that no
+     * triangle uses are dropped. Any levels of detail are remapped along with the mesh.
+     */
+    void optimizeVertexFetch(MeshData& mesh);
+
+    /** Run all of the above, in the order that keeps each pass' work intact. */
+    void optimizeMesh(MeshData& mesh, MeshOptimizeStats* stats = nullptr);
+
+    /** \brief Collapse edges of the triangle list until at most targetIndexCount indices are left.
+     *
+     * Quadric error edge collapse (Garland and Heckbert 1997), restricted to collapsing an
+     * edge onto one of its two vertices, so the result only uses vertices that were already
+     * there and can share their vertex buffer. Every vertex carries the area weighted planes of
+     * the triangles around it, and the open borders of the mesh get planes of their own, so
+     * they stay in place. The cheapest collapses go first, a batch at a time, and collapses
+     * that would flip a triangle are skipped. Vertices with the same position move together,
+     * each onto the copy at the other end with the closest attributes.
+     *
+     * Stops early if nothing more can be collapsed. Returns the error: how far the surface may
+     * have moved, in the mesh's units.
+     */
+    float simplifyMesh(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, uint32_t targetIndexCount);
+
+    /** \brief Fill mesh.lods with a chain of levels of detail, each about ratio times the last.
+     *
+     * The levels come out of a single simplifyMesh run, so each one is a simplification of
+     * the one before and the errors only grow. The chain stops at maxLevels, the full mesh
+     * included, or when simplifying stops paying off. Run this after optimizeMesh, which it
+     * relies on for the vertex order; the levels get their own vertex cache optimization.
+     */
+    void generateLods(MeshData& mesh, uint32_t maxLevels = MAX_MESH_LODS, float ratio = 0.5f);
+
+} // namespace graphics
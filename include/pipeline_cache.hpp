@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <string>
+
+namespace graphics {
+
+    struct PipelineCacheStats {
+        size_t loadedBytes = 0;          // size of the data the cache was seeded with
+        uint32_t pipelinesCreated = 0;
+        double creationMilliseconds = 0; // total time spent in vkCreate*Pipelines
+    };
+
+    // where the pipeline cache is loaded from and saved to. Set before initVulkan to change it
+    extern std::string pipelineCachePath;
+    extern VkPipelineCache pipelineCache;
+
+    /** \brief Create the pipeline cache, seeded with the data saved by a previous run.
+     *
+     * The saved data is only used if its header matches this device (vendorID, deviceID and
+     * pipelineCacheUUID), since drivers may reject or even crash on data from a different
+     * device or driver version. Otherwise the cache just starts out empty.
+     */
+    bool createPipelineCache();
+
+    /** \brief Write the pipeline cache back to pipelineCachePath and destroy it.
+     *
+     * The data gets written to a temporary file first, which is then renamed over the old
+     * cache, so a crash mid-write can never leave a truncated cache behind.
+     */
+    void destroyPipelineCache();
+
+    /** Count a pipeline creation that took the given time, for the stats. */
+    void recordPipelineCreation(double milliseconds);
+    PipelineCacheStats getPipelineCacheStats();
+
+} // namespace graphics
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "bvh.hpp"
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace graphics {
+
+    struct Mesh;
+
+    /** \brief Objects that stay in the scene from frame to frame, culled through a BVH.
+     *
+     * submitDraw is immediate mode: everything is resubmitted and tested one by one every
+     * frame. Scene objects are added once and only touched when they move, and submitVisible
+     * culls them hierarchically, so a whole region outside the view costs a single test. Moved
+     * objects are refitted into the tree where they are, and the tree is rebuilt once that has
+     * made it SCENE_REBUILD_COST_RATIO times worse than it was when built.
+     */
+    class Scene {
+    public:
+        static constexpr float SCENE_REBUILD_COST_RATIO = 1.5f;
+
+        /** Returns the object's id, which stays valid until it is removed. mesh must outlive it. */
+        uint32_t add(const Mesh& mesh, const glm::mat4& model);
+        void remove(uint32_t object);
+        void setTransform(uint32_t object, const glm::mat4& model);
+        const glm::mat4& transform(uint32_t object) const { return objects[object].model; }
+
+        /** \brief Bring the BVH up to date and submit the objects inside the view frustum.
+         *
+         * The draws go through submitCulledDraw, in the order the objects were added, so they
+         * skip the draw list's own culling. Each object's level of detail is picked with
+         * selectLod, starting from the one it was drawn at last time. Returns how many were
+         * submitted.
+         */
+        uint32_t submitVisible(const glm::mat4& view, const glm::mat4& proj);
+        /** Closest object whose world space box the ray hits, for picking. */
+        bool pick(const glm::vec3& origin, const glm::vec3& direction, uint32_t& object, float& distance);
+        /** Objects whose world space box overlaps [boundsMin, boundsMax]. */
+        void query(const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::vector<uint32_t>& result);
+
+        uint32_t size() const { return static_cast<uint32_t>(objects.size() - freeObjects.size()); }
+        const Bvh& bvh() const { return bvh_; }
+
+    private:
+        struct Object {
+            const Mesh* mesh; // null once removed
+            glm::mat4 model;
+            uint32_t lod;     // drawn at last time, for the hysteresis
+        };
+
+        void updateBounds(uint32_t object);
+        void updateBvh();
+
+        std::vector<Object> objects;
+        std::vector<glm::vec3> boundsMin, boundsMax; // world space, empty for removed objects
+        std::vector<uint32_t> freeObjects;
+        std::vector<uint32_t> moved;                 // to refit before the next query
+        float builtCost = 0;
+        Bvh bvh_;
+        std::vector<uint32_t> visible;
+    };
+
+} // namespace graphics
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace graphics {
+
+    struct ShaderRegistryStats {
+        uint32_t modulesCreated = 0;
+        uint64_t lookups = 0;
+    };
+
+    /** \brief Get the shader module for embedded SPIR-V, creating it the first time it's asked for.
+     *
+     * Modules are keyed by a hash of the SPIR-V itself, checked against a copy of the code, so
+     * blobs with the same contents share one module. size is in bytes. Modules stay alive until
+     * destroyShaderRegistry, so rebuilding a pipeline creates no new modules.
+     */
+    bool getShaderModule(const uint32_t* code, size_t size, VkShaderModule& module);
+
+    void destroyShaderRegistry();
+    ShaderRegistryStats getShaderRegistryStats();
+
+} // namespace graphics
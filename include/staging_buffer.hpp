@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <cstdint>
+
+namespace graphics {
+
+    struct UploadStats {
+        uint64_t bytesUploaded = 0;
+        uint64_t copiesRecorded = 0;
+        uint64_t batchesSubmitted = 0;
+        uint64_t stalls = 0;          // times an upload had to wait on the GPU to free ring space
+        double stallMilliseconds = 0;
+    };
+
+    /** \brief Create the persistently mapped staging ring and its upload batches.
+     *
+     * Uploads are copied into a ring buffer in host visible memory, and the copies out of the
+     * ring are recorded into one command buffer per batch. A batch is submitted once per frame
+     * (or earlier, if the ring fills up) with its own fence, and the ring space it used is
+     * reclaimed once that fence has signaled. Nothing ever waits on the queue to go idle.
+     * If the device has a separate transfer family (see QueueFamilyIndices::transferFamily),
+     * the copies run on that queue, overlapping with rendering, and the buffers are handed over
+     * to the graphics family with a queue family ownership transfer. A buffer that was uploaded
+     * to before is first handed back by the graphics family, so re-uploading part of a buffer
+     * leaves the rest of it intact.
+     */
+    bool createStagingBuffer();
+    void destroyStagingBuffer();
+
+    /** \brief Queue a copy of size bytes from data into dstBuffer at dstOffset.
+     *
+     * The data is copied into the ring immediately, so the caller can free it right away. The
+     * copy itself happens on the GPU once the batch is flushed, and is guaranteed to finish
+     * before any work submitted to the graphics queue after the flush reads the buffer.
+     */
+    bool uploadToBuffer(VkBuffer dstBuffer, VkDeviceSize dstOffset, const void* data, VkDeviceSize size);
+
+    /** Called by destroyBuffer, so that a new buffer reusing the handle isn't taken to be owned
+     * by the graphics family.
+     */
+    void forgetUploadedBuffer(VkBuffer buffer);
+
+    /** Submit all of the queued copies as one batch. Does nothing if no copies are queued. */
+    bool flushUploads();
+
+    /** Block until every submitted upload batch has finished. */
+    void waitForUploads();
+
+    UploadStats getUploadStats();
+
+} // namespace graphics
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <cstdint>
+
+namespace graphics {
+
+    struct UniformRingStats {
+        VkDeviceSize bytesPerFrame = 0;
+        VkDeviceSize peakBytesUsed = 0; // most bytes any one frame has used
+        uint64_t allocations = 0;
+        uint64_t failedAllocations = 0; // allocations that didn't fit in the frame's region
+    };
+
+    /** \brief Create the persistently mapped uniform ring.
+     *
+     * One host visible buffer is split into a region per frame in flight, and uniform data for
+     * a frame is bump allocated out of that frame's region. Every allocation is aligned to
+     * minUniformBufferOffsetAlignment, so its offset can be passed straight to
+     * vkCmdBindDescriptorSets as the dynamic offset of a VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+     * descriptor. A single descriptor set then covers every object drawn in every frame. The
+     * buffer can also be bound as a vertex buffer, for per frame instance data.
+     */
+    bool createUniformRing(VkDeviceSize bytesPerFrame);
+    void destroyUniformRing();
+
+    /** Start handing out the region of frameIndex again. The fence of the last frame that used
+     * the region must have signaled.
+     */
+    void beginUniformFrame(uint32_t frameIndex);
+
+    /** Reserve size bytes in the current frame's region. data points into the mapped buffer,
+     * and dynamicOffset is the offset to bind it with. Safe to call from multiple threads.
+     */
+    bool allocateUniforms(VkDeviceSize size, void*& data, uint32_t& dynamicOffset);
+
+    template<typename T>
+    T* allocateUniforms(uint32_t& dynamicOffset) {
+        void* data;
+        return allocateUniforms(sizeof(T), data, dynamicOffset) ? static_cast<T*>(data) : nullptr;
+    }
+
+    VkBuffer getUniformRingBuffer();
+    UniformRingStats getUniformRingStats();
+
+} // namespace graphics
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include "glm/glm.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace graphics {
+
+    /** Full precision vertex, the way meshes are kept on the CPU. What the GPU gets depends on
+     * the VertexLayout the mesh is created with.
+     */
+    struct Vertex {
+        glm::vec3 pos;
+        glm::vec3 normal; // zero if the source had none
+        glm::vec3 color;
+    };
+
+    /** What an attribute is. The value is the vertex shader input location it is bound to. */
+    enum class VertexSemantic : uint32_t {
+        Position = 0,
+        Color = 1,
+        Normal = 2,
+    };
+
+    /** \brief How an attribute is stored.
+     *
+     * Unorm encodings are relative to a range that depends on the semantic: the mesh bounds for
+     * positions, [-1, 1] for normals and [0, 1] for colors. Quantized positions come out of the
+     * vertex fetch in [0, 1], and are scaled back by the mesh's dequantization transform, which
+     * is folded into the model matrix so the shaders don't need to know.
+     */
+    enum class VertexEncoding : uint32_t {
+        Float3,       // R32G32B32_SFLOAT, 12 bytes
+        Unorm16x4,    // R16G16B16A16_UNORM, 8 bytes, w is unused
+        Unorm8x4,     // R8G8B8A8_UNORM, 4 bytes, w is unused (or alpha)
+        Octahedral16, // R16G16_SNORM, 4 bytes, unit vectors folded onto an octahedron
+    };
+
+    struct VertexAttribute {
+        VertexSemantic semantic;
+        VertexEncoding encoding;
+        uint32_t offset;
+    };
+
+    /** \brief Description of how vertices are laid out in a vertex buffer.
+     *
+     * The binding and attribute descriptions for the pipeline, the size of a vertex and the
+     * conversion from Vertex are all generated from the same list of attributes, so they can't
+     * get out of sync.
+     */
+    class VertexLayout {
+    public:
+        /** Append an attribute, right after the previous one. */
+        VertexLayout& add(VertexSemantic semantic, VertexEncoding encoding);
+
+        /** Float3 position and color, 24 bytes. Drawn as is, no dequantization. */
+        static VertexLayout standard();
+        /** Unorm16x4 position and Unorm8x4 color, 12 bytes. No shader reads normals, so there
+         * are none; add an Octahedral16 Normal for one that does.
+         */
+        static VertexLayout quantized();
+
+        uint32_t stride() const { return stride_; }
+        const std::vector<VertexAttribute>& attributes() const { return attributes_; }
+        bool hasQuantizedPosition() const;
+
+        VkVertexInputBindingDescription getBindingDescription(uint32_t binding = 0) const;
+        std::vector<VkVertexInputAttributeDescription> getAttributeDescriptions(uint32_t binding = 0) const;
+
+        /** Pack count vertices into out, which must have room for count * stride() bytes. */
+        void encode(const Vertex* vertices, size_t count, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+                    void* out) const;
+        /** Unpack vertices, the inverse of encode up to the precision of the encodings. */
+        void decode(const void* data, size_t count, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+                    Vertex* out) const;
+        /** Transform from the positions the vertex shader sees to the ones that were encoded. */
+        glm::mat4 dequantizeTransform(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const;
+
+        bool operator==(const VertexLayout& other) const;
+        bool operator!=(const VertexLayout& other) const { return !(*this == other); }
+
+    private:
+        std::vector<VertexAttribute> attributes_;
+        uint32_t stride_ = 0;
+    };
+
+    VkFormat vertexEncodingFormat(VertexEncoding encoding);
+    uint32_t vertexEncodingSize(VertexEncoding encoding);
+    /** Inverse of vertexEncodingFormat. Returns false for formats no encoding uses. */
+    bool vertexEncodingFromFormat(VkFormat format, VertexEncoding& encoding);
+
+} // namespace graphics
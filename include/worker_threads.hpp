@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+namespace graphics {
+
+    /** \brief Start count worker threads (0 picks one per core, minus the calling thread).
+     *
+     * The workers sleep until runOnWorkers hands them a job, so there's no cost to keeping
+     * them around when nothing is running in parallel.
+     */
+    bool createWorkerThreads(uint32_t count = 0);
+    void destroyWorkerThreads();
+
+    /** Number of threads that run a job, including the calling thread. */
+    uint32_t workerThreadCount();
+
+    /** \brief Call task(i, thread) for every i in [0, taskCount), spread over the workers.
+     *
+     * thread is a stable index in [0, workerThreadCount()), with the calling thread being 0,
+     * so tasks can use it to pick per-thread resources. Blocks until every task is done. Must
+     * only be called from the thread that created the workers.
+     */
+    void runOnWorkers(uint32_t taskCount, const std::function<void(uint32_t task, uint32_t thread)>& task);
+
+} // namespace graphics
@@ -0,0 +1,27 @@
+#version 450
+
+layout(binding = 0) uniform UBO {
+    mat4 M; // unused, every instance has its own model matrix
+    mat4 V;
+    mat4 P;
+} ubo;
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 color;
+
+// per instance model matrix, one column per location
+layout(location = 3) in vec4 instanceModel0;
+layout(location = 4) in vec4 instanceModel1;
+layout(location = 5) in vec4 instanceModel2;
+layout(location = 6) in vec4 instanceModel3;
+
+layout(location = 0) out vec3 fragColor;
+
+// the depth prepass draws with other pipelines, and the main pass tests against its depth
+invariant gl_Position;
+
+void main() {
+    mat4 model = mat4(instanceModel0, instanceModel1, instanceModel2, instanceModel3);
+    gl_Position = ubo.P * ubo.V * model * vec4(position, 1.0);
+    fragColor = color;
+}
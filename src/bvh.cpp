@@ -0,0 +1,551 @@
+#include "bvh.hpp"
+#include "cpu_profiler.hpp"
+#include "worker_threads.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace graphics {
+
+    namespace {
+
+        const uint32_t SAH_BINS = 16;
+        // smaller trees aren't worth waking the workers up for
+        const uint32_t PARALLEL_BUILD_MIN_OBJECTS = 16 * 1024;
+        const float EMPTY = std::numeric_limits<float>::max();
+
+        struct Bounds {
+            glm::vec3 min = glm::vec3(EMPTY);
+            glm::vec3 max = glm::vec3(-EMPTY);
+
+            void grow(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+                min = glm::min(min, boundsMin);
+                max = glm::max(max, boundsMax);
+            }
+            void grow(const Bounds& other) { grow(other.min, other.max); }
+            bool empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+            float area() const {
+                if (empty())
+                    return 0.0f;
+                glm::vec3 extent = max - min;
+                return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+            }
+            bool operator==(const Bounds& other) const { return min == other.min && max == other.max; }
+        };
+
+        Bounds slotBounds(const Box4& boxes, uint32_t slot) {
+            Bounds bounds;
+            bounds.min = glm::vec3(boxes.minX[slot], boxes.minY[slot], boxes.minZ[slot]);
+            bounds.max = glm::vec3(boxes.maxX[slot], boxes.maxY[slot], boxes.maxZ[slot]);
+            return bounds;
+        }
+
+        void setSlotBounds(Box4& boxes, uint32_t slot, const Bounds& bounds) {
+            boxes.minX[slot] = bounds.min.x;
+            boxes.minY[slot] = bounds.min.y;
+            boxes.minZ[slot] = bounds.min.z;
+            boxes.maxX[slot] = bounds.max.x;
+            boxes.maxY[slot] = bounds.max.y;
+            boxes.maxZ[slot] = bounds.max.z;
+        }
+
+        void initNode(BvhNode& node, uint32_t parent, uint32_t first, uint32_t count) {
+            for (uint32_t slot = 0; slot < 4; ++slot) {
+                setSlotBounds(node.bounds, slot, Bounds());
+                node.child[slot] = BVH_INVALID;
+                node.leafSize[slot] = 0;
+            }
+            node.parent = parent;
+            node.first = first;
+            node.count = count;
+        }
+
+        /** An object's box during the build. The build partitions these rather than indices,
+         * so every pass over a range reads memory front to back instead of jumping around.
+         */
+        struct BuildPrimitive {
+            glm::vec3 min;
+            uint32_t object;
+            glm::vec3 max;
+            uint32_t padding;
+
+            glm::vec3 centroid() const { return min + max; } // the factor of 2 doesn't matter
+        };
+
+        /** A contiguous run of the object array, with its bounds and the bounds of its centroids. */
+        struct Range {
+            uint32_t first;
+            uint32_t count;
+            Bounds bounds;
+            Bounds centroids;
+        };
+
+        /** Subtree whose build is left to a worker, along with where it hangs in the tree. */
+        struct DeferredSubtree {
+            uint32_t parent;
+            uint32_t slot;
+            Range range;
+        };
+
+        /** \brief Top down binned SAH builder.
+         *
+         * Every builder writes to its own node array and only reorders its own part of the
+         * primitives, so builders of disjoint subtrees can run at the same time.
+         */
+        struct Builder {
+            BuildPrimitive* primitives;
+            std::vector<BvhNode>& nodes;
+            uint32_t deferBelow;           // subtrees smaller than this go to deferred, if set
+            std::vector<DeferredSubtree>* deferred;
+
+            Range makeRange(uint32_t first, uint32_t count) const {
+                Range range = { first, count, Bounds(), Bounds() };
+                for (uint32_t i = first; i < first + count; ++i) {
+                    range.bounds.grow(primitives[i].min, primitives[i].max);
+                    range.centroids.grow(primitives[i].centroid(), primitives[i].centroid());
+                }
+                return range;
+            }
+
+            /** Split range in two at the cheapest of the bin boundaries along its longest axis. */
+            void split(const Range& range, Range& left, Range& right) const {
+                glm::vec3 extent = range.centroids.max - range.centroids.min;
+                int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+                BuildPrimitive* begin = primitives + range.first;
+                BuildPrimitive* end = begin + range.count;
+                uint32_t middle;
+
+                if (extent[axis] > 0.0f) {
+                    float origin = range.centroids.min[axis];
+                    float scale = SAH_BINS / extent[axis];
+                    auto binOf = [&](const BuildPrimitive& primitive) {
+                        return std::min(SAH_BINS - 1, static_cast<uint32_t>((primitive.centroid()[axis] - origin) * scale));
+                    };
+
+                    Bounds binBounds[SAH_BINS], binCentroids[SAH_BINS];
+                    uint32_t binCount[SAH_BINS] = {};
+                    for (BuildPrimitive* primitive = begin; primitive != end; ++primitive) {
+                        uint32_t bin = binOf(*primitive);
+                        binBounds[bin].grow(primitive->min, primitive->max);
+                        binCentroids[bin].grow(primitive->centroid(), primitive->centroid());
+                        binCount[bin]++;
+                    }
+
+                    // cost of splitting before bin i is area(left) * count(left) + area(right) * count(right)
+                    float leftArea[SAH_BINS];
+                    uint32_t leftCount[SAH_BINS];
+                    Bounds accumulated;
+                    uint32_t count = 0;
+                    for (uint32_t i = 0; i < SAH_BINS - 1; ++i) {
+                        accumulated.grow(binBounds[i]);
+                        count += binCount[i];
+                        leftArea[i] = accumulated.area();
+                        leftCount[i] = count;
+                    }
+                    accumulated = Bounds();
+                    count = 0;
+                    float bestCost = std::numeric_limits<float>::max();
+                    uint32_t bestSplit = 0;
+                    for (uint32_t i = SAH_BINS - 1; i > 0; --i) {
+                        accumulated.grow(binBounds[i]);
+                        count += binCount[i];
+                        float cost = leftArea[i - 1] * leftCount[i - 1] + accumulated.area() * count;
+                        if (leftCount[i - 1] && count && cost < bestCost) {
+                            bestCost = cost;
+                            bestSplit = i;
+                        }
+                    }
+                    if (bestSplit) {
+                        middle = static_cast<uint32_t>(std::partition(begin, end, [&](const BuildPrimitive& primitive) {
+                            return binOf(primitive) < bestSplit;
+                        }) - begin);
+                        // the bins already know the bounds of both sides, no need for another pass
+                        left = { range.first, middle, Bounds(), Bounds() };
+                        right = { range.first + middle, range.count - middle, Bounds(), Bounds() };
+                        for (uint32_t i = 0; i < SAH_BINS; ++i) {
+                            Range& side = i < bestSplit ? left : right;
+                            side.bounds.grow(binBounds[i]);
+                            side.centroids.grow(binCentroids[i]);
+                        }
+                        return;
+                    }
+                }
+
+                // everything in one spot, or in a single bin: fall back to halving by count
+                middle = range.count / 2;
+                std::nth_element(begin, begin + middle, end, [&](const BuildPrimitive& a, const BuildPrimitive& b) {
+                    return a.centroid()[axis] < b.centroid()[axis];
+                });
+                left = makeRange(range.first, middle);
+                right = makeRange(range.first + middle, range.count - middle);
+            }
+
+            /** Build the node covering range and everything under it, returning its index. */
+            uint32_t buildNode(const Range& range, uint32_t parent) {
+                uint32_t index = static_cast<uint32_t>(nodes.size());
+                nodes.emplace_back();
+                initNode(nodes[index], parent, range.first, range.count);
+
+                // keep splitting the child with the largest area, which is the one most likely
+                // to be visited, until the node is full
+                Range children[4] = { range };
+                uint32_t childCount = 1;
+                while (childCount < 4) {
+                    int largest = -1;
+                    float largestArea = -1.0f;
+                    for (uint32_t i = 0; i < childCount; ++i) {
+                        if (children[i].count > BVH_MAX_LEAF_SIZE && children[i].bounds.area() > largestArea) {
+                            largest = static_cast<int>(i);
+                            largestArea = children[i].bounds.area();
+                        }
+                    }
+                    if (largest < 0)
+                        break;
+                    Range left, right;
+                    split(children[largest], left, right);
+                    children[largest] = left;
+                    children[childCount++] = right;
+                }
+
+                for (uint32_t i = 0; i < childCount; ++i) {
+                    // nodes can grow below, so index rather than hold on to a reference
+                    setSlotBounds(nodes[index].bounds, i, children[i].bounds);
+                    if (children[i].count <= BVH_MAX_LEAF_SIZE) {
+                        nodes[index].child[i] = children[i].first;
+                        nodes[index].leafSize[i] = static_cast<uint8_t>(children[i].count);
+                    } else if (deferred && children[i].count < deferBelow) {
+                        deferred->push_back({ index, i, children[i] });
+                    } else {
+                        uint32_t child = buildNode(children[i], index);
+                        nodes[index].child[i] = child;
+                    }
+                }
+                return index;
+            }
+        };
+
+        /** Slab test of a ray against a box, clipped to [0, maxDistance]. */
+        bool intersectRay(const Bounds& bounds, const glm::vec3& origin, const glm::vec3& inverseDirection,
+                          float maxDistance, float& entry) {
+            glm::vec3 t0 = (bounds.min - origin) * inverseDirection;
+            glm::vec3 t1 = (bounds.max - origin) * inverseDirection;
+            glm::vec3 nearest = glm::min(t0, t1), farthest = glm::max(t0, t1);
+            entry = std::max(std::max(nearest.x, nearest.y), std::max(nearest.z, 0.0f));
+            float exit = std::min(std::min(farthest.x, farthest.y), std::min(farthest.z, maxDistance));
+            return entry <= exit;
+        }
+
+        bool overlaps(const Bounds& a, const Bounds& b) {
+            return a.min.x <= b.max.x && a.min.y <= b.max.y && a.min.z <= b.max.z &&
+                   a.max.x >= b.min.x && a.max.y >= b.min.y && a.max.z >= b.min.z;
+        }
+
+        bool contains(const Bounds& outer, const Bounds& inner) {
+            return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z &&
+                   outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+        }
+
+    } // namespace anonymous
+
+    void Bvh::build(const glm::vec3* boundsMin, const glm::vec3* boundsMax, uint32_t count) {
+        PROFILE_SCOPE("bvh build");
+        auto start = std::chrono::high_resolution_clock::now();
+        clear();
+        if (count == 0)
+            return;
+        boxMin.assign(boundsMin, boundsMin + count);
+        boxMax.assign(boundsMax, boundsMax + count);
+        std::vector<BuildPrimitive> primitives(count);
+        for (uint32_t i = 0; i < count; ++i)
+            primitives[i] = { boxMin[i], i, boxMax[i], 0 };
+
+        // the top of the tree is built here until the subtrees are small enough that there are
+        // a few per thread, then the workers build those and they get stitched in below
+        bool parallel = count >= PARALLEL_BUILD_MIN_OBJECTS && workerThreadCount() > 1;
+        std::vector<DeferredSubtree> deferred;
+        Builder top = { primitives.data(), nodes_,
+                        parallel ? count / (workerThreadCount() * 4) : 0, parallel ? &deferred : nullptr };
+        top.buildNode(top.makeRange(0, count), BVH_INVALID);
+
+        if (!deferred.empty()) {
+            std::vector<std::vector<BvhNode>> subtrees(deferred.size());
+            runOnWorkers(static_cast<uint32_t>(deferred.size()), [&](uint32_t task, uint32_t) {
+                Builder builder = { primitives.data(), subtrees[task], 0, nullptr };
+                builder.buildNode(deferred[task].range, BVH_INVALID);
+            });
+
+            // appending keeps children after their parents, which refit relies on
+            for (size_t i = 0; i < deferred.size(); ++i) {
+                uint32_t offset = static_cast<uint32_t>(nodes_.size());
+                for (BvhNode node : subtrees[i]) {
+                    for (uint32_t slot = 0; slot < 4; ++slot) {
+                        if (!node.leafSize[slot] && node.child[slot] != BVH_INVALID)
+                            node.child[slot] += offset;
+                    }
+                    node.parent = node.parent == BVH_INVALID ? deferred[i].parent : node.parent + offset;
+                    nodes_.push_back(node);
+                }
+                nodes_[deferred[i].parent].child[deferred[i].slot] = offset;
+            }
+        }
+
+        objects_.resize(count);
+        for (uint32_t i = 0; i < count; ++i)
+            objects_[i] = primitives[i].object;
+        objectSlot.resize(count);
+        for (uint32_t node = 0; node < nodes_.size(); ++node) {
+            for (uint32_t slot = 0; slot < 4; ++slot) {
+                for (uint32_t i = 0; i < nodes_[node].leafSize[slot]; ++i)
+                    objectSlot[objects_[nodes_[node].child[slot] + i]] = node * 4 + slot;
+            }
+        }
+        buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    void Bvh::clear() {
+        nodes_.clear();
+        objects_.clear();
+        objectSlot.clear();
+        boxMin.clear();
+        boxMax.clear();
+        buildMilliseconds = 0;
+    }
+
+    void Bvh::refitLeaf(uint32_t node, uint32_t slot) {
+        BvhNode& leafNode = nodes_[node];
+        Bounds bounds;
+        for (uint32_t i = 0; i < leafNode.leafSize[slot]; ++i) {
+            uint32_t object = objects_[leafNode.child[slot] + i];
+            bounds.grow(boxMin[object], boxMax[object]);
+        }
+        setSlotBounds(leafNode.bounds, slot, bounds);
+    }
+
+    void Bvh::refitNode(uint32_t node, uint32_t slot) {
+        const BvhNode& child = nodes_[nodes_[node].child[slot]];
+        Bounds bounds;
+        for (uint32_t i = 0; i < 4; ++i)
+            bounds.grow(slotBounds(child.bounds, i)); // unused slots are empty, and change nothing
+        setSlotBounds(nodes_[node].bounds, slot, bounds);
+    }
+
+    void Bvh::refit(const glm::vec3* boundsMin, const glm::vec3* boundsMax) {
+        PROFILE_SCOPE("bvh refit");
+        std::copy(boundsMin, boundsMin + boxMin.size(), boxMin.begin());
+        std::copy(boundsMax, boundsMax + boxMax.size(), boxMax.begin());
+        // children always come after their parent, so going backwards visits them first
+        for (size_t node = nodes_.size(); node-- > 0;) {
+            for (uint32_t slot = 0; slot < 4; ++slot) {
+                if (nodes_[node].child[slot] == BVH_INVALID)
+                    continue;
+                if (nodes_[node].leafSize[slot])
+                    refitLeaf(static_cast<uint32_t>(node), slot);
+                else
+                    refitNode(static_cast<uint32_t>(node), slot);
+            }
+        }
+    }
+
+    void Bvh::update(uint32_t object, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+        boxMin[object] = boundsMin;
+        boxMax[object] = boundsMax;
+        uint32_t node = objectSlot[object] / 4;
+        refitLeaf(node, objectSlot[object] % 4);
+
+        // walk up until a node's box comes out the same as before
+        while (nodes_[node].parent != BVH_INVALID) {
+            uint32_t parent = nodes_[node].parent;
+            uint32_t slot = 0;
+            while (nodes_[parent].leafSize[slot] || nodes_[parent].child[slot] != node)
+                ++slot;
+            Bounds before = slotBounds(nodes_[parent].bounds, slot);
+            refitNode(parent, slot);
+            if (slotBounds(nodes_[parent].bounds, slot) == before)
+                break;
+            node = parent;
+        }
+    }
+
+    void Bvh::cullFrustum(const Frustum& frustum, std::vector<uint32_t>& visible) const {
+        if (nodes_.empty())
+            return;
+        auto appendRange = [&](uint32_t first, uint32_t count) {
+            for (uint32_t i = first; i < first + count; ++i) {
+                uint32_t object = objects_[i];
+                if (boxMin[object].x <= boxMax[object].x) // removed objects have empty boxes
+                    visible.push_back(object);
+            }
+        };
+
+        uint32_t stack[64];
+        std::vector<uint32_t> overflow; // only for very unbalanced trees
+        uint32_t stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize || !overflow.empty()) {
+            uint32_t index;
+            if (!overflow.empty()) {
+                index = overflow.back();
+                overflow.pop_back();
+            } else {
+                index = stack[--stackSize];
+            }
+            const BvhNode& node = nodes_[index];
+            uint32_t mask = classifyBoxes4(frustum, node.bounds);
+            for (uint32_t slot = 0; slot < 4; ++slot) {
+                if (!(mask & (1u << slot)) || node.child[slot] == BVH_INVALID)
+                    continue;
+                bool contained = (mask & (16u << slot)) != 0;
+                if (node.leafSize[slot] && contained) {
+                    appendRange(node.child[slot], node.leafSize[slot]);
+                } else if (node.leafSize[slot]) {
+                    // straddles a plane, test the objects themselves
+                    Box4 boxes;
+                    for (uint32_t i = 0; i < 4; ++i) {
+                        Bounds bounds;
+                        if (i < node.leafSize[slot])
+                            bounds.grow(boxMin[objects_[node.child[slot] + i]], boxMax[objects_[node.child[slot] + i]]);
+                        setSlotBounds(boxes, i, bounds);
+                    }
+                    uint32_t objectMask = classifyBoxes4(frustum, boxes);
+                    for (uint32_t i = 0; i < node.leafSize[slot]; ++i) {
+                        if (objectMask & (1u << i))
+                            visible.push_back(objects_[node.child[slot] + i]);
+                    }
+                } else if (contained) {
+                    // nothing under a node that is entirely inside needs testing
+                    const BvhNode& child = nodes_[node.child[slot]];
+                    appendRange(child.first, child.count);
+                } else if (stackSize < 64) {
+                    stack[stackSize++] = node.child[slot];
+                } else {
+                    overflow.push_back(node.child[slot]);
+                }
+            }
+        }
+    }
+
+    bool Bvh::raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance,
+                      uint32_t& object, float& distance) const {
+        if (nodes_.empty())
+            return false;
+        glm::vec3 inverseDirection = 1.0f / direction;
+        float closest = maxDistance;
+        bool hit = false;
+
+        // nodes are pushed far to near, so the nearest gets visited first and shrinks closest
+        std::vector<std::pair<float, uint32_t>> stack;
+        stack.emplace_back(0.0f, 0);
+        while (!stack.empty()) {
+            std::pair<float, uint32_t> entry = stack.back();
+            stack.pop_back();
+            if (entry.first > closest)
+                continue;
+            const BvhNode& node = nodes_[entry.second];
+            std::pair<float, uint32_t> children[4];
+            uint32_t childCount = 0;
+            for (uint32_t slot = 0; slot < 4; ++slot) {
+                float entryDistance;
+                if (node.child[slot] == BVH_INVALID ||
+                        !intersectRay(slotBounds(node.bounds, slot), origin, inverseDirection, closest, entryDistance))
+                    continue;
+                if (node.leafSize[slot]) {
+                    for (uint32_t i = 0; i < node.leafSize[slot]; ++i) {
+                        uint32_t candidate = objects_[node.child[slot] + i];
+                        Bounds bounds;
+                        bounds.grow(boxMin[candidate], boxMax[candidate]);
+                        float objectDistance;
+                        if (!bounds.empty() && intersectRay(bounds, origin, inverseDirection, closest, objectDistance)) {
+                            closest = objectDistance;
+                            object = candidate;
+                            hit = true;
+                        }
+                    }
+                } else {
+                    children[childCount++] = { entryDistance, node.child[slot] };
+                }
+            }
+            std::sort(children, children + childCount, [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) {
+                return a.first > b.first;
+            });
+            stack.insert(stack.end(), children, children + childCount);
+        }
+        if (hit)
+            distance = closest;
+        return hit;
+    }
+
+    void Bvh::queryBox(const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::vector<uint32_t>& objects) const {
+        if (nodes_.empty())
+            return;
+        Bounds query;
+        query.grow(boundsMin, boundsMax);
+
+        std::vector<uint32_t> stack(1, 0);
+        while (!stack.empty()) {
+            const BvhNode& node = nodes_[stack.back()];
+            stack.pop_back();
+            for (uint32_t slot = 0; slot < 4; ++slot) {
+                Bounds bounds = slotBounds(node.bounds, slot);
+                if (node.child[slot] == BVH_INVALID || bounds.empty() || !overlaps(bounds, query))
+                    continue;
+                if (node.leafSize[slot]) {
+                    for (uint32_t i = 0; i < node.leafSize[slot]; ++i) {
+                        uint32_t object = objects_[node.child[slot] + i];
+                        Bounds objectBounds;
+                        objectBounds.grow(boxMin[object], boxMax[object]);
+                        if (!objectBounds.empty() && overlaps(objectBounds, query))
+                            objects.push_back(object);
+                    }
+                } else if (contains(query, bounds)) {
+                    const BvhNode& child = nodes_[node.child[slot]];
+                    for (uint32_t i = child.first; i < child.first + child.count; ++i) {
+                        if (boxMin[objects_[i]].x <= boxMax[objects_[i]].x)
+                            objects.push_back(objects_[i]);
+                    }
+                } else {
+                    stack.push_back(node.child[slot]);
+                }
+            }
+        }
+    }
+
+    BvhStats Bvh::stats() const {
+        BvhStats stats;
+        stats.buildMilliseconds = buildMilliseconds;
+        stats.nodes = static_cast<uint32_t>(nodes_.size());
+        if (nodes_.empty())
+            return stats;
+
+        Bounds root;
+        for (uint32_t slot = 0; slot < 4; ++slot)
+            root.grow(slotBounds(nodes_[0].bounds, slot));
+        float rootArea = std::max(root.area(), std::numeric_limits<float>::min());
+
+        // expected number of box tests for a query that hits the root, where a node costs the
+        // four tests of its children and a leaf one per object
+        std::vector<uint32_t> depth(nodes_.size(), 1);
+        float tests = 4.0f;
+        for (uint32_t node = 0; node < nodes_.size(); ++node) {
+            if (node) {
+                depth[node] = depth[nodes_[node].parent] + 1;
+                stats.depth = std::max(stats.depth, depth[node]);
+            }
+            for (uint32_t slot = 0; slot < 4; ++slot) {
+                if (nodes_[node].child[slot] == BVH_INVALID)
+                    continue;
+                float area = slotBounds(nodes_[node].bounds, slot).area() / rootArea;
+                if (nodes_[node].leafSize[slot]) {
+                    stats.leaves++;
+                    tests += area * nodes_[node].leafSize[slot];
+                } else {
+                    tests += area * 4.0f;
+                }
+            }
+        }
+        stats.depth = std::max(stats.depth, 1u);
+        stats.cost = tests / size();
+        return stats;
+    }
+
+} // namespace graphics
@@ -0,0 +1,110 @@
+#include "cpu_profiler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace graphics {
+
+    namespace {
+
+        const uint32_t EVENTS_PER_THREAD = 1 << 16; // power of 2, so wrapping is a mask
+
+        struct ZoneEvent {
+            const char* name;
+            uint64_t start; // nanoseconds since the profiler's epoch
+            uint64_t end;
+        };
+
+        struct ThreadEvents {
+            uint32_t threadId;
+            std::string threadName;
+            std::vector<ZoneEvent> events = std::vector<ZoneEvent>(EVENTS_PER_THREAD);
+            // only ever written by the owning thread. Keeps counting past the end of the
+            // ring, so it also tells how many events were overwritten
+            std::atomic<uint64_t> count{0};
+        };
+
+        const auto epoch = std::chrono::steady_clock::now();
+
+        // the rings stay alive after their thread exits, so its events still get exported
+        std::mutex threadsMutex;
+        std::vector<std::unique_ptr<ThreadEvents>> threads;
+
+        uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        /** The calling thread's ring, registered the first time the thread records a zone. */
+        ThreadEvents& threadEvents() {
+            thread_local ThreadEvents* events = nullptr;
+            if (!events) {
+                std::lock_guard<std::mutex> lock(threadsMutex);
+                threads.push_back(std::make_unique<ThreadEvents>());
+                events = threads.back().get();
+                events->threadId = static_cast<uint32_t>(threads.size() - 1);
+            }
+            return *events;
+        }
+
+        /** Escape the characters that aren't allowed in a JSON string. */
+        std::string escapeJson(const std::string& str) {
+            std::string escaped;
+            for (char c : str) {
+                if (c == '"' || c == '\\')
+                    escaped += '\\';
+                if (static_cast<unsigned char>(c) >= 0x20)
+                    escaped += c;
+            }
+            return escaped;
+        }
+
+    } // namespace anonymous
+
+    CpuZone::CpuZone(const char* name) : name(name), start(now()) {}
+
+    CpuZone::~CpuZone() {
+        uint64_t end = now();
+        ThreadEvents& events = threadEvents();
+        uint64_t index = events.count.load(std::memory_order_relaxed);
+        events.events[index & (EVENTS_PER_THREAD - 1)] = { name, start, end };
+        events.count.store(index + 1, std::memory_order_release);
+    }
+
+    void setProfilerThreadName(const char* name) {
+        threadEvents().threadName = name;
+    }
+
+    bool exportChromeTrace(const std::string& path) {
+        std::ofstream file(path);
+        if (!file)
+            return false;
+
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        file << "{\"traceEvents\":[\n";
+        bool first = true;
+        for (const auto& thread : threads) {
+            std::string threadName = thread->threadName.empty() ? "thread " + std::to_string(thread->threadId) : thread->threadName;
+            file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << thread->threadId
+                 << ",\"args\":{\"name\":\"" << escapeJson(threadName) << "\"}}";
+            first = false;
+
+            // after a wrap the oldest surviving event is the one right after the newest
+            uint64_t count = thread->count.load(std::memory_order_acquire);
+            uint64_t begin = count > EVENTS_PER_THREAD ? count - EVENTS_PER_THREAD : 0;
+            for (uint64_t i = begin; i < count; ++i) {
+                const ZoneEvent& event = thread->events[i & (EVENTS_PER_THREAD - 1)];
+                // complete events, with the times in (fractional) microseconds
+                file << ",\n{\"name\":\"" << escapeJson(event.name) << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread->threadId
+                     << ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << (event.end - event.start) / 1000.0 << "}";
+            }
+        }
+        file << "\n]}\n";
+        return bool(file);
+    }
+
+} // namespace graphics
@@ -0,0 +1,301 @@
+#include "frustum_culling.hpp"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CULLING_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULLING_SSE
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <cmath>
+#include <limits>
+
+namespace graphics {
+
+    namespace {
+
+        // padding lanes are so far behind every plane that they can never be visible
+        const float NEVER_VISIBLE = -std::numeric_limits<float>::max();
+
+        uint32_t lowestBit(uint32_t mask) {
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return index;
+#else
+            return __builtin_ctz(mask);
+#endif
+        }
+
+        /** Append base + i for every set bit i of mask. */
+        uint32_t appendVisible(uint32_t mask, uint32_t base, uint32_t* visible, uint32_t visibleCount) {
+            while (mask) {
+                visible[visibleCount++] = base + lowestBit(mask);
+                mask &= mask - 1;
+            }
+            return visibleCount;
+        }
+
+#if defined(CULLING_AVX)
+        typedef __m256 Lanes;
+        const uint32_t LANE_COUNT = 8;
+        inline Lanes load(const float* p) { return _mm256_loadu_ps(p); }
+        inline Lanes broadcast(float value) { return _mm256_set1_ps(value); }
+        inline Lanes add(Lanes a, Lanes b) { return _mm256_add_ps(a, b); }
+        inline Lanes multiply(Lanes a, Lanes b) { return _mm256_mul_ps(a, b); }
+        inline Lanes negate(Lanes a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+        inline Lanes greaterEqual(Lanes a, Lanes b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+        inline Lanes bitAnd(Lanes a, Lanes b) { return _mm256_and_ps(a, b); }
+        inline Lanes allSet() { return _mm256_castsi256_ps(_mm256_set1_epi32(-1)); }
+        inline uint32_t laneMask(Lanes a) { return static_cast<uint32_t>(_mm256_movemask_ps(a)); }
+#elif defined(CULLING_SSE)
+        typedef __m128 Lanes;
+        const uint32_t LANE_COUNT = 4;
+        inline Lanes load(const float* p) { return _mm_loadu_ps(p); }
+        inline Lanes broadcast(float value) { return _mm_set1_ps(value); }
+        inline Lanes add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+        inline Lanes multiply(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+        inline Lanes negate(Lanes a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+        inline Lanes greaterEqual(Lanes a, Lanes b) { return _mm_cmpge_ps(a, b); }
+        inline Lanes bitAnd(Lanes a, Lanes b) { return _mm_and_ps(a, b); }
+        inline Lanes allSet() { return _mm_castsi128_ps(_mm_set1_epi32(-1)); }
+        inline uint32_t laneMask(Lanes a) { return static_cast<uint32_t>(_mm_movemask_ps(a)); }
+#endif
+
+#if defined(CULLING_AVX) || defined(CULLING_SSE)
+        /** The planes with every component broadcast to all lanes, hoisted out of the loops. */
+        struct FrustumLanes {
+            Lanes x[6], y[6], z[6], w[6];
+            Lanes absX[6], absY[6], absZ[6];
+
+            explicit FrustumLanes(const Frustum& frustum) {
+                for (int p = 0; p < 6; ++p) {
+                    const glm::vec4& plane = frustum.planes[p];
+                    x[p] = broadcast(plane.x);
+                    y[p] = broadcast(plane.y);
+                    z[p] = broadcast(plane.z);
+                    w[p] = broadcast(plane.w);
+                    absX[p] = broadcast(std::abs(plane.x));
+                    absY[p] = broadcast(std::abs(plane.y));
+                    absZ[p] = broadcast(std::abs(plane.z));
+                }
+            }
+        };
+#endif
+
+        /** Signed distance of (x, y, z) to plane, in the same order of operations as the SIMD
+         * versions, so both agree exactly.
+         */
+        float planeDistance(const glm::vec4& plane, float x, float y, float z) {
+            return plane.x * x + plane.y * y + plane.z * z + plane.w;
+        }
+
+    } // namespace anonymous
+
+    Frustum extractFrustum(const glm::mat4& viewProj) {
+        // glm is column major, so row i of the matrix is (m[0][i], m[1][i], m[2][i], m[3][i])
+        glm::vec4 row0(viewProj[0][0], viewProj[1][0], viewProj[2][0], viewProj[3][0]);
+        glm::vec4 row1(viewProj[0][1], viewProj[1][1], viewProj[2][1], viewProj[3][1]);
+        glm::vec4 row2(viewProj[0][2], viewProj[1][2], viewProj[2][2], viewProj[3][2]);
+        glm::vec4 row3(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+
+        Frustum frustum;
+        frustum.planes[0] = row3 + row0; // left
+        frustum.planes[1] = row3 - row0; // right
+        frustum.planes[2] = row3 + row1; // bottom (top with a flipped y)
+        frustum.planes[3] = row3 - row1;
+        frustum.planes[4] = row3 + row2; // near
+        frustum.planes[5] = row3 - row2; // far
+        for (glm::vec4& plane : frustum.planes) {
+            float length = glm::length(glm::vec3(plane));
+            if (length > 0.0f)
+                plane /= length;
+        }
+        return frustum;
+    }
+
+    void transformBox(const glm::mat4& model, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+                      glm::vec3& center, glm::vec3& halfExtent) {
+        // the center goes through the matrix, the extents through its absolute value (Arvo)
+        glm::mat3 absolute(glm::abs(glm::vec3(model[0])), glm::abs(glm::vec3(model[1])), glm::abs(glm::vec3(model[2])));
+        center = glm::vec3(model * glm::vec4(0.5f * (boundsMin + boundsMax), 1.0f));
+        halfExtent = absolute * (0.5f * (boundsMax - boundsMin));
+    }
+
+    void CullingBounds::resize(uint32_t objectCount) {
+        count = objectCount;
+        size_t padded = (size_t(objectCount) + CULLING_BATCH - 1) / CULLING_BATCH * CULLING_BATCH;
+        for (std::vector<float>* component : { &sphereX, &sphereY, &sphereZ, &sphereRadius, &boxCenterX, &boxCenterY,
+                                               &boxCenterZ, &boxExtentX, &boxExtentY, &boxExtentZ })
+            component->resize(padded, 0.0f);
+        for (size_t i = objectCount; i < padded; ++i) {
+            sphereRadius[i] = NEVER_VISIBLE;
+            boxExtentX[i] = boxExtentY[i] = boxExtentZ[i] = NEVER_VISIBLE;
+        }
+    }
+
+    void CullingBounds::setSphere(uint32_t index, const glm::vec3& center, float radius) {
+        sphereX[index] = center.x;
+        sphereY[index] = center.y;
+        sphereZ[index] = center.z;
+        sphereRadius[index] = radius;
+    }
+
+    void CullingBounds::setBox(uint32_t index, const glm::vec3& center, const glm::vec3& halfExtent) {
+        boxCenterX[index] = center.x;
+        boxCenterY[index] = center.y;
+        boxCenterZ[index] = center.z;
+        boxExtentX[index] = halfExtent.x;
+        boxExtentY[index] = halfExtent.y;
+        boxExtentZ[index] = halfExtent.z;
+    }
+
+    uint32_t cullSpheresScalar(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible) {
+        uint32_t visibleCount = 0;
+        for (uint32_t i = 0; i < bounds.count; ++i) {
+            float negativeRadius = -bounds.sphereRadius[i];
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; ++p)
+                inside = planeDistance(frustum.planes[p], bounds.sphereX[i], bounds.sphereY[i], bounds.sphereZ[i]) >= negativeRadius;
+            if (inside)
+                visible[visibleCount++] = i;
+        }
+        return visibleCount;
+    }
+
+    uint32_t cullBoxesScalar(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible) {
+        uint32_t visibleCount = 0;
+        for (uint32_t i = 0; i < bounds.count; ++i) {
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; ++p) {
+                const glm::vec4& plane = frustum.planes[p];
+                // how far the box reaches along the plane normal, from its center
+                float reach = std::abs(plane.x) * bounds.boxExtentX[i] + std::abs(plane.y) * bounds.boxExtentY[i] +
+                              std::abs(plane.z) * bounds.boxExtentZ[i];
+                inside = planeDistance(plane, bounds.boxCenterX[i], bounds.boxCenterY[i], bounds.boxCenterZ[i]) >= -reach;
+            }
+            if (inside)
+                visible[visibleCount++] = i;
+        }
+        return visibleCount;
+    }
+
+#if defined(CULLING_AVX) || defined(CULLING_SSE)
+    /* All six planes are tested for every batch, without early outs: a branch per plane would
+     * cost more than the handful of instructions it skips, and mispredicts whenever a batch
+     * straddles a frustum edge. */
+
+    uint32_t cullSpheres(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible) {
+        FrustumLanes planes(frustum);
+        uint32_t visibleCount = 0;
+        uint32_t padded = static_cast<uint32_t>(bounds.sphereX.size());
+        for (uint32_t i = 0; i < padded; i += LANE_COUNT) {
+            Lanes x = load(&bounds.sphereX[i]);
+            Lanes y = load(&bounds.sphereY[i]);
+            Lanes z = load(&bounds.sphereZ[i]);
+            Lanes negativeRadius = negate(load(&bounds.sphereRadius[i]));
+            Lanes inside = allSet();
+            for (int p = 0; p < 6; ++p) {
+                Lanes distance = add(add(add(multiply(planes.x[p], x), multiply(planes.y[p], y)),
+                                         multiply(planes.z[p], z)), planes.w[p]);
+                inside = bitAnd(inside, greaterEqual(distance, negativeRadius));
+            }
+            visibleCount = appendVisible(laneMask(inside), i, visible, visibleCount);
+        }
+        return visibleCount;
+    }
+
+    uint32_t cullBoxes(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible) {
+        FrustumLanes planes(frustum);
+        uint32_t visibleCount = 0;
+        uint32_t padded = static_cast<uint32_t>(bounds.boxCenterX.size());
+        for (uint32_t i = 0; i < padded; i += LANE_COUNT) {
+            Lanes x = load(&bounds.boxCenterX[i]);
+            Lanes y = load(&bounds.boxCenterY[i]);
+            Lanes z = load(&bounds.boxCenterZ[i]);
+            Lanes extentX = load(&bounds.boxExtentX[i]);
+            Lanes extentY = load(&bounds.boxExtentY[i]);
+            Lanes extentZ = load(&bounds.boxExtentZ[i]);
+            Lanes inside = allSet();
+            for (int p = 0; p < 6; ++p) {
+                Lanes distance = add(add(add(multiply(planes.x[p], x), multiply(planes.y[p], y)),
+                                         multiply(planes.z[p], z)), planes.w[p]);
+                Lanes reach = add(add(multiply(planes.absX[p], extentX), multiply(planes.absY[p], extentY)),
+                                  multiply(planes.absZ[p], extentZ));
+                inside = bitAnd(inside, greaterEqual(distance, negate(reach)));
+            }
+            visibleCount = appendVisible(laneMask(inside), i, visible, visibleCount);
+        }
+        return visibleCount;
+    }
+#else
+    uint32_t cullSpheres(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible) {
+        return cullSpheresScalar(frustum, bounds, visible);
+    }
+
+    uint32_t cullBoxes(const Frustum& frustum, const CullingBounds& bounds, uint32_t* visible) {
+        return cullBoxesScalar(frustum, bounds, visible);
+    }
+#endif
+
+    uint32_t classifyBoxes4(const Frustum& frustum, const Box4& boxes) {
+#if defined(CULLING_AVX) || defined(CULLING_SSE)
+        // always 4 wide, AVX implies SSE
+        __m128 half = _mm_set1_ps(0.5f);
+        __m128 minX = _mm_loadu_ps(boxes.minX), minY = _mm_loadu_ps(boxes.minY), minZ = _mm_loadu_ps(boxes.minZ);
+        __m128 maxX = _mm_loadu_ps(boxes.maxX), maxY = _mm_loadu_ps(boxes.maxY), maxZ = _mm_loadu_ps(boxes.maxZ);
+        __m128 x = _mm_mul_ps(_mm_add_ps(minX, maxX), half);
+        __m128 y = _mm_mul_ps(_mm_add_ps(minY, maxY), half);
+        __m128 z = _mm_mul_ps(_mm_add_ps(minZ, maxZ), half);
+        __m128 extentX = _mm_mul_ps(_mm_sub_ps(maxX, minX), half);
+        __m128 extentY = _mm_mul_ps(_mm_sub_ps(maxY, minY), half);
+        __m128 extentZ = _mm_mul_ps(_mm_sub_ps(maxZ, minZ), half);
+        __m128 valid = _mm_and_ps(_mm_cmpge_ps(extentX, _mm_setzero_ps()),
+                                  _mm_and_ps(_mm_cmpge_ps(extentY, _mm_setzero_ps()), _mm_cmpge_ps(extentZ, _mm_setzero_ps())));
+        __m128 intersecting = valid, contained = valid;
+        for (const glm::vec4& plane : frustum.planes) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), x), _mm_mul_ps(_mm_set1_ps(plane.y), y)),
+                                                    _mm_mul_ps(_mm_set1_ps(plane.z), z)), _mm_set1_ps(plane.w));
+            __m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::abs(plane.x)), extentX),
+                                                 _mm_mul_ps(_mm_set1_ps(std::abs(plane.y)), extentY)),
+                                      _mm_mul_ps(_mm_set1_ps(std::abs(plane.z)), extentZ));
+            intersecting = _mm_and_ps(intersecting, _mm_cmpge_ps(distance, _mm_xor_ps(reach, _mm_set1_ps(-0.0f))));
+            contained = _mm_and_ps(contained, _mm_cmpge_ps(distance, reach));
+        }
+        return static_cast<uint32_t>(_mm_movemask_ps(intersecting) | (_mm_movemask_ps(contained) << 4));
+#else
+        uint32_t mask = 0;
+        for (int i = 0; i < 4; ++i) {
+            glm::vec3 boxMin(boxes.minX[i], boxes.minY[i], boxes.minZ[i]);
+            glm::vec3 boxMax(boxes.maxX[i], boxes.maxY[i], boxes.maxZ[i]);
+            glm::vec3 center = (boxMin + boxMax) * 0.5f, extent = (boxMax - boxMin) * 0.5f;
+            if (extent.x < 0.0f || extent.y < 0.0f || extent.z < 0.0f)
+                continue;
+            bool intersecting = true, contained = true;
+            for (const glm::vec4& plane : frustum.planes) {
+                float distance = planeDistance(plane, center.x, center.y, center.z);
+                float reach = std::abs(plane.x) * extent.x + std::abs(plane.y) * extent.y + std::abs(plane.z) * extent.z;
+                intersecting = intersecting && distance >= -reach;
+                contained = contained && distance >= reach;
+            }
+            mask |= (intersecting ? 1u << i : 0) | (intersecting && contained ? 1u << (i + 4) : 0);
+        }
+        return mask;
+#endif
+    }
+
+    const char* cullingInstructionSet() {
+#if defined(CULLING_AVX)
+        return "avx";
+#elif defined(CULLING_SSE)
+        return "sse2";
+#else
+        return "scalar";
+#endif
+    }
+
+} // namespace graphics
@@ -0,0 +1,147 @@
+#include "gpu_culling.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace graphics {
+
+    namespace {
+
+        // relative to the sphere's size and position, so it scales with the scene
+        const float BOUNDARY_TOLERANCE = 1e-5f;
+
+        /** Signed distance of the sphere's center to plane, in the order cullSpheresScalar uses. */
+        float planeDistance(const glm::vec4& plane, const glm::vec4& sphere) {
+            return plane.x * sphere.x + plane.y * sphere.y + plane.z * sphere.z + plane.w;
+        }
+
+        bool sphereVisible(const Frustum& frustum, const glm::vec4& sphere) {
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; ++p)
+                inside = planeDistance(frustum.planes[p], sphere) >= -sphere.w;
+            return inside;
+        }
+
+        /** Smallest margin by which the sphere passes or fails a plane. Negative means culled. */
+        float sphereMargin(const Frustum& frustum, const glm::vec4& sphere) {
+            float margin = std::numeric_limits<float>::max();
+            for (const glm::vec4& plane : frustum.planes)
+                margin = std::min(margin, planeDistance(plane, sphere) + sphere.w);
+            return margin;
+        }
+
+    } // namespace anonymous
+
+    void cullObjectsReference(const Frustum& frustum, const GpuCullObject* objects, uint32_t count,
+                              IndirectDrawCommand* commands) {
+        for (uint32_t i = 0; i < count; ++i) {
+            const GpuCullObject& object = objects[i];
+            commands[i].indexCount = object.indexCount;
+            commands[i].instanceCount = sphereVisible(frustum, object.sphere) ? 1 : 0;
+            commands[i].firstIndex = object.firstIndex;
+            commands[i].vertexOffset = object.vertexOffset;
+            commands[i].firstInstance = object.firstInstance;
+        }
+    }
+
+    uint32_t countCullingMismatches(const Frustum& frustum, const GpuCullObject* objects, uint32_t count,
+                                    const IndirectDrawCommand* commands, uint32_t* occluded) {
+        uint32_t mismatches = 0;
+        if (occluded)
+            *occluded = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            const GpuCullObject& object = objects[i];
+            const IndirectDrawCommand& command = commands[i];
+            if (command.indexCount != object.indexCount || command.firstIndex != object.firstIndex ||
+                command.vertexOffset != object.vertexOffset || command.firstInstance != object.firstInstance) {
+                ++mismatches;
+                continue;
+            }
+
+            float margin = sphereMargin(frustum, object.sphere);
+            float scale = std::max(1.0f, std::abs(object.sphere.x) + std::abs(object.sphere.y) +
+                                         std::abs(object.sphere.z) + std::abs(object.sphere.w));
+            if (std::abs(margin) <= BOUNDARY_TOLERANCE * scale)
+                continue;
+            bool visible = sphereVisible(frustum, object.sphere);
+            if (occluded && visible && command.instanceCount == 0)
+                ++*occluded;
+            else if (command.instanceCount != (visible ? 1u : 0u))
+                ++mismatches;
+        }
+        return mismatches;
+    }
+
+    uint32_t hizLevelCount(uint32_t width, uint32_t height) {
+        uint32_t levels = 1;
+        while (hizLevelSize(width, levels - 1) > 1 || hizLevelSize(height, levels - 1) > 1)
+            ++levels;
+        return levels;
+    }
+
+    uint32_t hizLevelSize(uint32_t size, uint32_t level) {
+        uint32_t texelSize = 2u << level;
+        return std::max(1u, (size + texelSize - 1) / texelSize);
+    }
+
+    void buildHiZReference(const float* depth, uint32_t width, uint32_t height, std::vector<std::vector<float>>& levels) {
+        levels.resize(hizLevelCount(width, height));
+        const float* source = depth;
+        uint32_t sourceWidth = width, sourceHeight = height;
+        for (uint32_t level = 0; level < levels.size(); ++level) {
+            uint32_t levelWidth = hizLevelSize(width, level), levelHeight = hizLevelSize(height, level);
+            levels[level].resize(levelWidth * levelHeight);
+            for (uint32_t y = 0; y < levelHeight; ++y) {
+                for (uint32_t x = 0; x < levelWidth; ++x) {
+                    // same clamp as hiz.comp, which doubles up the last row or column of odd sizes
+                    uint32_t x0 = 2 * x, x1 = std::min(x0 + 1, sourceWidth - 1);
+                    uint32_t y0 = 2 * y, y1 = std::min(y0 + 1, sourceHeight - 1);
+                    levels[level][y * levelWidth + x] =
+                        std::max(std::max(source[y0 * sourceWidth + x0], source[y0 * sourceWidth + x1]),
+                                 std::max(source[y1 * sourceWidth + x0], source[y1 * sourceWidth + x1]));
+                }
+            }
+            source = levels[level].data();
+            sourceWidth = levelWidth;
+            sourceHeight = levelHeight;
+        }
+    }
+
+    bool sphereOccludedReference(const GpuOcclusionConstants& constants, const std::vector<std::vector<float>>& levels,
+                                 const glm::vec4& sphere) {
+        // the corners of the box around the sphere, in clip space
+        glm::vec4 center = constants.viewProj * glm::vec4(glm::vec3(sphere), 1.0f);
+        glm::vec4 axes[3] = {constants.viewProj[0] * sphere.w, constants.viewProj[1] * sphere.w,
+                             constants.viewProj[2] * sphere.w};
+        float nearestW = std::numeric_limits<float>::max();
+        glm::vec3 lower(std::numeric_limits<float>::max()), upper(-std::numeric_limits<float>::max());
+        for (int corner = 0; corner < 8; ++corner) {
+            glm::vec4 clip = center + (corner & 1 ? axes[0] : -axes[0]) + (corner & 2 ? axes[1] : -axes[1]) +
+                             (corner & 4 ? axes[2] : -axes[2]);
+            glm::vec3 ndc = glm::vec3(clip) / clip.w;
+            nearestW = std::min(nearestW, clip.w);
+            lower = glm::min(lower, ndc);
+            upper = glm::max(upper, ndc);
+        }
+        if (!(nearestW > 0.0f))
+            return false;
+
+        glm::vec2 lowerPixel = glm::clamp((glm::vec2(lower) * 0.5f + 0.5f) * constants.depthSize, glm::vec2(0.0f),
+                                          constants.depthSize - 1.0f);
+        glm::vec2 upperPixel = glm::clamp((glm::vec2(upper) * 0.5f + 0.5f) * constants.depthSize, glm::vec2(0.0f),
+                                          constants.depthSize - 1.0f);
+        glm::vec2 size = upperPixel - lowerPixel;
+        float level = std::ceil(std::log2(std::max(std::max(size.x, size.y), 1.0f))) - 1.0f;
+        level = glm::clamp(level, 0.0f, float(constants.hizLevels - 1));
+        float texelSize = std::exp2(level + 1.0f);
+        glm::ivec2 lowerTexel(glm::floor(lowerPixel / texelSize)), upperTexel(glm::floor(upperPixel / texelSize));
+
+        const std::vector<float>& hiz = levels[uint32_t(level)];
+        uint32_t levelWidth = hizLevelSize(uint32_t(constants.depthSize.x), uint32_t(level));
+        float farthest = std::max(std::max(hiz[lowerTexel.y * levelWidth + lowerTexel.x], hiz[lowerTexel.y * levelWidth + upperTexel.x]),
+                                  std::max(hiz[upperTexel.y * levelWidth + lowerTexel.x], hiz[upperTexel.y * levelWidth + upperTexel.x]));
+        return lower.z > farthest;
+    }
+
+} // namespace graphics
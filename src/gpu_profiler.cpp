@@ -0,0 +1,183 @@
+#include "gpu_profiler.hpp"
+#include "graphics_api.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+namespace graphics {
+
+    namespace {
+
+        const uint32_t MAX_SCOPES_PER_FRAME = 64;
+        const uint32_t HISTORY_SIZE = 256; // frames kept per scope for the rolling stats
+        const uint32_t INVALID_SCOPE = ~0u;
+
+        struct PendingScope {
+            uint32_t nameIndex;
+            uint32_t firstQuery; // begin timestamp, the end one is firstQuery + 1
+        };
+
+        struct FrameQueries {
+            VkQueryPool pool = VK_NULL_HANDLE;
+            std::vector<PendingScope> scopes;
+        };
+
+        struct ScopeHistory {
+            std::string name;
+            std::vector<double> samples; // ring of the last HISTORY_SIZE durations
+            uint32_t next = 0;
+        };
+
+        bool enabled = false;
+        double nanosecondsPerTick = 1.0;
+        uint64_t timestampMask = ~0ull;
+        std::vector<FrameQueries> frames;
+        FrameQueries* recordingFrame = nullptr;
+        std::vector<ScopeHistory> histories;
+
+        uint32_t findHistory(const char* name) {
+            for (uint32_t i = 0; i < histories.size(); ++i) {
+                if (histories[i].name == name)
+                    return i;
+            }
+            histories.push_back({ name, {}, 0 });
+            return static_cast<uint32_t>(histories.size() - 1);
+        }
+
+        void addSample(ScopeHistory& history, double milliseconds) {
+            if (history.samples.size() < HISTORY_SIZE) {
+                history.samples.push_back(milliseconds);
+            } else {
+                history.samples[history.next] = milliseconds;
+            }
+            history.next = (history.next + 1) % HISTORY_SIZE;
+        }
+
+        /** Read back the timestamps of the frame's last submission, if there was one. */
+        void collectResults(FrameQueries& frame) {
+            if (frame.scopes.empty())
+                return;
+
+            uint32_t queryCount = static_cast<uint32_t>(frame.scopes.size() * 2);
+            std::vector<uint64_t> timestamps(queryCount);
+            // no WAIT bit: the frame's fence has signaled, so the results are already there
+            VkResult result = vkGetQueryPoolResults(logicalDevice, frame.pool, 0, queryCount,
+                timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+            if (result == VK_SUCCESS) {
+                for (const auto& scope : frame.scopes) {
+                    uint64_t begin = timestamps[scope.firstQuery] & timestampMask;
+                    uint64_t end = timestamps[scope.firstQuery + 1] & timestampMask;
+                    double ticks = double((end - begin) & timestampMask);
+                    addSample(histories[scope.nameIndex], ticks * nanosecondsPerTick / 1e6);
+                }
+            }
+            frame.scopes.clear();
+        }
+
+    } // namespace anonymous
+
+    bool createGpuProfiler() {
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDeviceInfo.device, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDeviceInfo.device, &queueFamilyCount, queueFamilies.data());
+        uint32_t validBits = queueFamilies[physicalDeviceInfo.indices.graphicsFamily].timestampValidBits;
+
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDeviceInfo.device, &deviceProperties);
+        enabled = validBits > 0 && deviceProperties.limits.timestampPeriod > 0;
+        if (!enabled)
+            return true; // not an error, there just won't be any GPU timings
+
+        nanosecondsPerTick = deviceProperties.limits.timestampPeriod;
+        timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+        VkQueryPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        poolInfo.queryCount = MAX_SCOPES_PER_FRAME * 2;
+
+        frames.resize(framesInFlight);
+        for (auto& frame : frames) {
+            if (vkCreateQueryPool(logicalDevice, &poolInfo, nullptr, &frame.pool) != VK_SUCCESS)
+                return false;
+        }
+        return true;
+    }
+
+    void destroyGpuProfiler() {
+        for (auto& frame : frames)
+            vkDestroyQueryPool(logicalDevice, frame.pool, nullptr);
+        frames.clear();
+        recordingFrame = nullptr;
+        enabled = false;
+    }
+
+    void beginGpuFrame(VkCommandBuffer cmd, uint32_t frameIndex) {
+        if (!enabled)
+            return;
+
+        recordingFrame = &frames[frameIndex];
+        collectResults(*recordingFrame);
+        // queries have to be reset outside of a render pass before they can be written again
+        vkCmdResetQueryPool(cmd, recordingFrame->pool, 0, MAX_SCOPES_PER_FRAME * 2);
+    }
+
+    uint32_t beginGpuScope(VkCommandBuffer cmd, const char* name) {
+        if (!enabled || !recordingFrame || recordingFrame->scopes.size() == MAX_SCOPES_PER_FRAME)
+            return INVALID_SCOPE;
+
+        uint32_t scope = static_cast<uint32_t>(recordingFrame->scopes.size());
+        uint32_t firstQuery = scope * 2;
+        recordingFrame->scopes.push_back({ findHistory(name), firstQuery });
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, recordingFrame->pool, firstQuery);
+        return scope;
+    }
+
+    void endGpuScope(VkCommandBuffer cmd, uint32_t scope) {
+        if (scope == INVALID_SCOPE)
+            return;
+        // the end timestamp is written once all the work before it has completely finished
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, recordingFrame->pool,
+                            recordingFrame->scopes[scope].firstQuery + 1);
+    }
+
+    std::vector<GpuScopeStats> getGpuProfilerStats() {
+        std::vector<GpuScopeStats> stats;
+        for (const auto& history : histories) {
+            GpuScopeStats scopeStats;
+            scopeStats.name = history.name;
+            scopeStats.samples = static_cast<uint32_t>(history.samples.size());
+            if (!history.samples.empty()) {
+                std::vector<double> sorted = history.samples;
+                std::sort(sorted.begin(), sorted.end());
+                double total = 0;
+                for (double sample : sorted)
+                    total += sample;
+                scopeStats.minMilliseconds = sorted.front();
+                scopeStats.avgMilliseconds = total / sorted.size();
+                scopeStats.p99Milliseconds = sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)];
+                scopeStats.lastMilliseconds = history.samples[(history.next + HISTORY_SIZE - 1) % HISTORY_SIZE];
+            }
+            stats.push_back(scopeStats);
+        }
+        return stats;
+    }
+
+    void printGpuProfilerStats() {
+        if (!enabled) {
+            std::cout << "GPU profiler: timestamps not supported on this queue" << std::endl;
+            return;
+        }
+
+        std::cout << "GPU timings (ms)        min      avg      p99" << std::endl;
+        for (const auto& scope : getGpuProfilerStats()) {
+            std::cout << "  " << std::left << std::setw(18) << scope.name << std::right << std::fixed << std::setprecision(3)
+                      << std::setw(9) << scope.minMilliseconds << std::setw(9) << scope.avgMilliseconds
+                      << std::setw(9) << scope.p99Milliseconds << std::endl;
+        }
+        std::cout.unsetf(std::ios::fixed);
+    }
+
+} // namespace graphics
@@ -0,0 +1,538 @@
+#include "gpu_scene.hpp"
+#include "graphics_api.hpp"
+#include "shaders/cull_comp.hpp"
+#include "shaders/occlusion_cull_comp.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+
+namespace graphics {
+
+    bool gpuDrivenRendering = true;
+    bool gpuCullingValidation = false;
+    bool occlusionCulling = true;
+
+    namespace {
+
+        const uint32_t MIN_CAPACITY = 256;
+        const uint32_t CULL_BINDINGS = 5;
+
+        bool supported = false;
+        bool multiDrawIndirect = false;
+        uint32_t maxDrawIndirectCount = 1;
+        VkDescriptorSetLayout cullSetLayout = VK_NULL_HANDLE;
+        VkPipelineLayout cullPipelineLayout = VK_NULL_HANDLE;
+        VkPipeline cullPipeline = VK_NULL_HANDLE;
+        VkPipeline occlusionCullPipeline = VK_NULL_HANDLE;
+
+        bool createCullPipeline(const uint32_t* code, size_t size, VkPipeline& pipeline) {
+            VkShaderModule module;
+            if (!getShaderModule(code, size, module))
+                return false;
+
+            VkComputePipelineCreateInfo pipelineInfo = {};
+            pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+            pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+            pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+            pipelineInfo.stage.module = module;
+            pipelineInfo.stage.pName = "main";
+            pipelineInfo.layout = cullPipelineLayout;
+
+            auto createStart = std::chrono::high_resolution_clock::now();
+            if (vkCreateComputePipelines(logicalDevice, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+                return false;
+            recordPipelineCreation(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - createStart).count());
+            return true;
+        }
+
+    } // namespace anonymous
+
+    bool createGpuCulling() {
+        VkPhysicalDeviceFeatures features;
+        vkGetPhysicalDeviceFeatures(physicalDeviceInfo.device, &features);
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDeviceInfo.device, &properties);
+        supported = features.drawIndirectFirstInstance == VK_TRUE;
+        multiDrawIndirect = features.multiDrawIndirect == VK_TRUE;
+        maxDrawIndirectCount = multiDrawIndirect ? properties.limits.maxDrawIndirectCount : 1;
+        if (!supported)
+            return true; // not an error, GpuScenes just get culled on the CPU
+
+        // binding 0 is the objects, binding 1 the commands. occlusion_cull.comp adds the
+        // visibility buffer, the Hi-Z pyramid, and its constants in the uniform ring, which
+        // cull.comp doesn't touch, so both share one layout
+        VkDescriptorSetLayoutBinding bindings[CULL_BINDINGS] = {};
+        for (uint32_t i = 0; i < CULL_BINDINGS; ++i) {
+            bindings[i].binding = i;
+            bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            bindings[i].descriptorCount = 1;
+            bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
+        bindings[3].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        bindings[4].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = CULL_BINDINGS;
+        layoutInfo.pBindings = bindings;
+        if (vkCreateDescriptorSetLayout(logicalDevice, &layoutInfo, nullptr, &cullSetLayout) != VK_SUCCESS)
+            return false;
+
+        VkPushConstantRange pushConstants = { VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GpuCullConstants) };
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &cullSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstants;
+        if (vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &cullPipelineLayout) != VK_SUCCESS)
+            return false;
+
+        return createCullPipeline(shaders::cull_comp, sizeof(shaders::cull_comp), cullPipeline) &&
+               createCullPipeline(shaders::occlusion_cull_comp, sizeof(shaders::occlusion_cull_comp), occlusionCullPipeline);
+    }
+
+    void destroyGpuCulling() {
+        vkDestroyPipeline(logicalDevice, cullPipeline, nullptr);
+        vkDestroyPipeline(logicalDevice, occlusionCullPipeline, nullptr);
+        vkDestroyPipelineLayout(logicalDevice, cullPipelineLayout, nullptr);
+        vkDestroyDescriptorSetLayout(logicalDevice, cullSetLayout, nullptr);
+        cullPipeline = VK_NULL_HANDLE;
+        occlusionCullPipeline = VK_NULL_HANDLE;
+        cullPipelineLayout = VK_NULL_HANDLE;
+        cullSetLayout = VK_NULL_HANDLE;
+        supported = false;
+    }
+
+    bool gpuDrivenSupported() {
+        return supported;
+    }
+
+    bool occlusionCullingSupported() {
+        return supported && hizSupported() && occlusionCullPipeline != VK_NULL_HANDLE;
+    }
+
+    GpuScene::~GpuScene() {
+        for (FrameBuffers& frame : frames)
+            destroyFrameBuffers(frame);
+        if (visibilityBuffer != VK_NULL_HANDLE)
+            destroyBuffer(visibilityBuffer, visibilityAllocation);
+        for (RetiredBuffer& retired : retiredBuffers)
+            destroyBuffer(retired.buffer, retired.allocation);
+        if (descriptorPool != VK_NULL_HANDLE)
+            vkDestroyDescriptorPool(logicalDevice, descriptorPool, nullptr);
+    }
+
+    uint32_t GpuScene::add(const Mesh& mesh, const glm::mat4& model) {
+        uint32_t object;
+        if (!freeObjects.empty()) {
+            object = freeObjects.back();
+            freeObjects.pop_back();
+        } else {
+            object = static_cast<uint32_t>(objects.size());
+            objects.push_back({});
+        }
+        objects[object] = { &mesh, model, 0 };
+        slotsChanged = true;
+        return object;
+    }
+
+    void GpuScene::remove(uint32_t object) {
+        objects[object].mesh = nullptr;
+        freeObjects.push_back(object);
+        slotsChanged = true;
+    }
+
+    void GpuScene::setTransform(uint32_t object, const glm::mat4& model) {
+        objects[object].model = model;
+        // a rebuild is coming anyway, which writes every slot
+        if (slotsChanged)
+            return;
+
+        writeSlot(object);
+        uint32_t slot = objects[object].slot;
+        for (FrameBuffers& frame : frames) {
+            if (frame.fullUpload)
+                continue;
+            // a frame that isn't drawn for a while would collect moves forever
+            if (frame.moved.size() >= slotObjects.size()) {
+                frame.fullUpload = true;
+                frame.moved.clear();
+            } else {
+                frame.moved.push_back(slot);
+            }
+        }
+    }
+
+    void GpuScene::writeSlot(uint32_t object) {
+        const Object& o = objects[object];
+        glm::vec3 center, halfExtent;
+        transformBox(o.model, o.mesh->boundsMin, o.mesh->boundsMax, center, halfExtent);
+
+        GpuCullObject& slot = slotObjects[o.slot];
+        slot.sphere = glm::vec4(center, glm::length(halfExtent));
+        slot.indexCount = o.mesh->indexCount;
+        slot.firstIndex = 0;
+        slot.vertexOffset = 0;
+        slot.firstInstance = o.slot;
+        // the instanced pipelines only see this matrix, so it includes the dequantization
+        slotModels[o.slot] = o.mesh->quantized ? o.model * o.mesh->dequantize : o.model;
+    }
+
+    void GpuScene::rebuildSlots() {
+        // sorted by pipeline, then mesh, so each mesh is one contiguous run of commands and
+        // the pipeline changes as rarely as possible
+        std::vector<uint32_t> order;
+        order.reserve(size());
+        for (uint32_t i = 0; i < objects.size(); ++i) {
+            if (objects[i].mesh)
+                order.push_back(i);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            const Mesh* meshA = objects[a].mesh;
+            const Mesh* meshB = objects[b].mesh;
+            if (meshA->pipelineIndex != meshB->pipelineIndex)
+                return meshA->pipelineIndex < meshB->pipelineIndex;
+            return std::less<const Mesh*>()(meshA, meshB);
+        });
+
+        slotObjects.resize(order.size());
+        slotModels.resize(order.size());
+        slotToObject = order;
+        batches.clear();
+        for (uint32_t slot = 0; slot < order.size(); ++slot) {
+            Object& object = objects[order[slot]];
+            object.slot = slot;
+            writeSlot(order[slot]);
+            if (batches.empty() || batches.back().mesh != object.mesh)
+                batches.push_back({ object.mesh, slot, 0 });
+            batches.back().count++;
+        }
+
+        for (FrameBuffers& frame : frames) {
+            frame.fullUpload = true;
+            frame.moved.clear();
+        }
+        // the objects moved to other slots, so last frame's visibility means nothing
+        visibilityReset = true;
+        slotsChanged = false;
+    }
+
+    bool GpuScene::createFrameBuffers(FrameBuffers& frame, uint32_t capacity) {
+        // validation reads the commands back, so they go to host memory instead
+        VkMemoryPropertyFlags commandMemory = gpuCullingValidation ?
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+        if (!createBuffer(VkDeviceSize(capacity) * sizeof(GpuCullObject), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frame.objectBuffer, frame.objectAllocation) ||
+            !createBuffer(VkDeviceSize(capacity) * sizeof(glm::mat4), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frame.modelBuffer, frame.modelAllocation) ||
+            !createBuffer(VkDeviceSize(capacity) * sizeof(IndirectDrawCommand), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                          commandMemory, frame.commandBuffer, frame.commandAllocation)) {
+            destroyFrameBuffers(frame);
+            return false;
+        }
+        frame.capacity = capacity;
+
+        VkDescriptorBufferInfo bufferInfos[2] = {
+            { frame.objectBuffer, 0, VK_WHOLE_SIZE },
+            { frame.commandBuffer, 0, VK_WHOLE_SIZE },
+        };
+        VkWriteDescriptorSet writes[2] = {};
+        for (uint32_t i = 0; i < 2; ++i) {
+            writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[i].dstSet = frame.descriptorSet;
+            writes[i].dstBinding = i;
+            writes[i].descriptorCount = 1;
+            writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writes[i].pBufferInfo = &bufferInfos[i];
+        }
+        vkUpdateDescriptorSets(logicalDevice, 2, writes, 0, nullptr);
+        return true;
+    }
+
+    void GpuScene::destroyFrameBuffers(FrameBuffers& frame) {
+        if (frame.objectBuffer != VK_NULL_HANDLE)
+            destroyBuffer(frame.objectBuffer, frame.objectAllocation);
+        if (frame.modelBuffer != VK_NULL_HANDLE)
+            destroyBuffer(frame.modelBuffer, frame.modelAllocation);
+        if (frame.commandBuffer != VK_NULL_HANDLE)
+            destroyBuffer(frame.commandBuffer, frame.commandAllocation);
+        frame.capacity = 0;
+    }
+
+    bool GpuScene::prepareFrame(uint32_t frameIndex, const Frustum& frustum, const glm::mat4& viewProj, bool occlusion) {
+        PROFILE_SCOPE("gpu scene upload");
+        if (frames.empty()) {
+            // every frame in flight gets a set pointing at its own buffers
+            VkDescriptorPoolSize poolSizes[3] = {
+                { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3 * framesInFlight },
+                { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, framesInFlight },
+                { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, framesInFlight },
+            };
+            VkDescriptorPoolCreateInfo poolInfo = {};
+            poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+            poolInfo.poolSizeCount = 3;
+            poolInfo.pPoolSizes = poolSizes;
+            poolInfo.maxSets = framesInFlight;
+            if (vkCreateDescriptorPool(logicalDevice, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS)
+                return false;
+
+            std::vector<VkDescriptorSetLayout> layouts(framesInFlight, cullSetLayout);
+            std::vector<VkDescriptorSet> sets(framesInFlight);
+            VkDescriptorSetAllocateInfo allocInfo = {};
+            allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            allocInfo.descriptorPool = descriptorPool;
+            allocInfo.descriptorSetCount = framesInFlight;
+            allocInfo.pSetLayouts = layouts.data();
+            if (vkAllocateDescriptorSets(logicalDevice, &allocInfo, sets.data()) != VK_SUCCESS)
+                return false;
+            frames.resize(framesInFlight);
+
+            // the uniform ring never moves, only the dynamic offset changes
+            VkDescriptorBufferInfo uniformInfo = { getUniformRingBuffer(), 0, sizeof(GpuOcclusionConstants) };
+            std::vector<VkWriteDescriptorSet> writes(framesInFlight);
+            for (uint32_t i = 0; i < framesInFlight; ++i) {
+                frames[i].descriptorSet = sets[i];
+                writes[i] = {};
+                writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                writes[i].dstSet = sets[i];
+                writes[i].dstBinding = 4;
+                writes[i].descriptorCount = 1;
+                writes[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+                writes[i].pBufferInfo = &uniformInfo;
+            }
+            vkUpdateDescriptorSets(logicalDevice, framesInFlight, writes.data(), 0, nullptr);
+        }
+        if (slotsChanged)
+            rebuildSlots();
+
+        // this frame's fence has signaled, so it no longer reads any retired visibility buffer
+        for (size_t i = 0; i < retiredBuffers.size();) {
+            retiredBuffers[i].pendingFrames &= ~(1u << frameIndex);
+            if (retiredBuffers[i].pendingFrames == 0) {
+                destroyBuffer(retiredBuffers[i].buffer, retiredBuffers[i].allocation);
+                retiredBuffers[i] = retiredBuffers.back();
+                retiredBuffers.pop_back();
+            } else {
+                ++i;
+            }
+        }
+
+        // the frame's fence has signaled, so whatever cull.comp wrote last time is readable
+        FrameBuffers& frame = frames[frameIndex];
+        if (frame.validationPending) {
+            uint32_t occluded = 0;
+            stats_.mismatches += countCullingMismatches(frame.validationFrustum, frame.validationObjects.data(),
+                static_cast<uint32_t>(frame.validationObjects.size()),
+                static_cast<const IndirectDrawCommand*>(frame.commandAllocation.mappedData),
+                frame.validationOcclusion ? &occluded : nullptr);
+            stats_.occluded += occluded;
+            stats_.framesValidated++;
+            frame.validationPending = false;
+        }
+
+        uint32_t count = static_cast<uint32_t>(slotObjects.size());
+        stats_.drawCalls = 0;
+        if (count == 0)
+            return false;
+
+        // nothing in flight uses this frame's buffers any more, so they can simply be replaced
+        if (frame.capacity < count) {
+            destroyFrameBuffers(frame);
+            uint32_t capacity = MIN_CAPACITY;
+            while (capacity < count)
+                capacity *= 2;
+            if (!createFrameBuffers(frame, capacity))
+                return false;
+            frame.fullUpload = true;
+        }
+
+        // an object that moved more than once is only uploaded once
+        std::sort(frame.moved.begin(), frame.moved.end());
+        frame.moved.erase(std::unique(frame.moved.begin(), frame.moved.end()), frame.moved.end());
+        // a few large copies beat lots of tiny ones once a good part of the scene moved
+        if (frame.moved.size() > count / 4)
+            frame.fullUpload = true;
+        if (frame.fullUpload) {
+            if (!uploadToBuffer(frame.objectBuffer, 0, slotObjects.data(), count * sizeof(GpuCullObject)) ||
+                !uploadToBuffer(frame.modelBuffer, 0, slotModels.data(), count * sizeof(glm::mat4)))
+                return false;
+        } else {
+            // neighbouring slots go up as one range
+            for (size_t i = 0; i < frame.moved.size();) {
+                uint32_t first = frame.moved[i];
+                uint32_t last = first;
+                while (++i < frame.moved.size() && frame.moved[i] == last + 1)
+                    last++;
+                uint32_t runLength = last - first + 1;
+                if (!uploadToBuffer(frame.objectBuffer, first * sizeof(GpuCullObject), &slotObjects[first], runLength * sizeof(GpuCullObject)) ||
+                    !uploadToBuffer(frame.modelBuffer, first * sizeof(glm::mat4), &slotModels[first], runLength * sizeof(glm::mat4)))
+                    return false;
+            }
+        }
+        frame.fullUpload = false;
+        frame.moved.clear();
+
+        occlusionOffset = 0;
+        if (occlusion && !prepareOcclusion(frame, viewProj))
+            return false;
+
+        memcpy(constants.planes, frustum.planes, sizeof(constants.planes));
+        constants.objectCount = count;
+        if (gpuCullingValidation) {
+            frame.validationFrustum = frustum;
+            frame.validationObjects = slotObjects;
+            frame.validationOcclusion = occlusion;
+            frame.validationPending = true;
+        }
+
+        for (const Batch& batch : batches)
+            stats_.drawCalls += (batch.count + maxDrawIndirectCount - 1) / maxDrawIndirectCount;
+        return true;
+    }
+
+    bool GpuScene::prepareOcclusion(FrameBuffers& frame, const glm::mat4& viewProj) {
+        uint32_t count = static_cast<uint32_t>(slotObjects.size());
+        if (visibilityCapacity < count) {
+            // frames still in flight may read the old buffer, so it is only retired for now
+            if (visibilityBuffer != VK_NULL_HANDLE)
+                retiredBuffers.push_back({ visibilityBuffer, visibilityAllocation, (1u << framesInFlight) - 1 });
+            visibilityBuffer = VK_NULL_HANDLE;
+            visibilityCapacity = 0;
+            uint32_t capacity = MIN_CAPACITY;
+            while (capacity < count)
+                capacity *= 2;
+            if (!createBuffer(VkDeviceSize(capacity) * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, visibilityBuffer, visibilityAllocation))
+                return false;
+            visibilityCapacity = capacity;
+            visibilityReset = true;
+        }
+
+        const HiZPyramid& pyramid = getHiZPyramid();
+        if (frame.boundVisibility != visibilityBuffer || frame.boundHiZGeneration != pyramid.generation) {
+            VkDescriptorBufferInfo visibilityInfo = { visibilityBuffer, 0, VK_WHOLE_SIZE };
+            VkDescriptorImageInfo hizInfo = { pyramid.sampler, pyramid.view, VK_IMAGE_LAYOUT_GENERAL };
+            VkWriteDescriptorSet writes[2] = {};
+            for (uint32_t i = 0; i < 2; ++i) {
+                writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                writes[i].dstSet = frame.descriptorSet;
+                writes[i].dstBinding = 2 + i;
+                writes[i].descriptorCount = 1;
+            }
+            writes[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writes[0].pBufferInfo = &visibilityInfo;
+            writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            writes[1].pImageInfo = &hizInfo;
+            vkUpdateDescriptorSets(logicalDevice, 2, writes, 0, nullptr);
+            frame.boundVisibility = visibilityBuffer;
+            frame.boundHiZGeneration = pyramid.generation;
+        }
+
+        GpuOcclusionConstants* occlusion = allocateUniforms<GpuOcclusionConstants>(occlusionOffset);
+        if (!occlusion)
+            return false;
+        occlusion->viewProj = viewProj;
+        occlusion->depthSize = glm::vec2(pyramid.width, pyramid.height);
+        occlusion->hizLevels = pyramid.levels;
+        occlusion->padding = 0;
+        return true;
+    }
+
+    void GpuScene::recordCulling(VkCommandBuffer cmd, uint32_t frameIndex, CullPhase phase) {
+        const FrameBuffers& frame = frames[frameIndex];
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        if (phase == CullPhase::Prepass) {
+            // the visibility buffer was last written by the previous frame's Occlusion phase
+            if (visibilityReset) {
+                barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+                barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+                vkCmdFillBuffer(cmd, visibilityBuffer, 0, VK_WHOLE_SIZE, 1);
+                visibilityReset = false;
+            }
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        } else if (phase == CullPhase::Occlusion) {
+            // the depth prepass has to be done reading the commands this overwrites
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        }
+
+        constants.phase = phase == CullPhase::Occlusion ? GPU_CULL_PHASE_OCCLUSION : GPU_CULL_PHASE_PREPASS;
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, phase == CullPhase::Frustum ? cullPipeline : occlusionCullPipeline);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &frame.descriptorSet, 1, &occlusionOffset);
+        vkCmdPushConstants(cmd, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GpuCullConstants), &constants);
+        vkCmdDispatch(cmd, (constants.objectCount + GPU_CULL_GROUP_SIZE - 1) / GPU_CULL_GROUP_SIZE, 1, 1);
+
+        // the commands are read as indirect arguments by the draws, and by the host when validating
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+        VkPipelineStageFlags dstStages = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+        if (gpuCullingValidation) {
+            barrier.dstAccessMask |= VK_ACCESS_HOST_READ_BIT;
+            dstStages |= VK_PIPELINE_STAGE_HOST_BIT;
+        }
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, dstStages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    void GpuScene::recordDraws(VkCommandBuffer cmd, uint32_t frameIndex) {
+        recordIndirectDraws(cmd, frameIndex, instancedPipelines);
+    }
+
+    void GpuScene::recordDepthDraws(VkCommandBuffer cmd, uint32_t frameIndex) {
+        recordIndirectDraws(cmd, frameIndex, depthPipelines);
+    }
+
+    void GpuScene::recordIndirectDraws(VkCommandBuffer cmd, uint32_t frameIndex, const std::vector<VkPipeline>& pipelines) {
+        const FrameBuffers& frame = frames[frameIndex];
+        // the commands' firstInstance is the slot, which picks the slot's model matrix
+        VkDeviceSize modelOffset = 0;
+        vkCmdBindVertexBuffers(cmd, 1, 1, &frame.modelBuffer, &modelOffset);
+
+        uint32_t boundPipeline = ~0u;
+        for (const Batch& batch : batches) {
+            if (batch.mesh->pipelineIndex != boundPipeline) {
+                vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines[batch.mesh->pipelineIndex]);
+                boundPipeline = batch.mesh->pipelineIndex;
+            }
+            VkDeviceSize offset = 0;
+            vkCmdBindVertexBuffers(cmd, 0, 1, &batch.mesh->vertexBuffer, &offset);
+            vkCmdBindIndexBuffer(cmd, batch.mesh->indexBuffer, 0, batch.mesh->indexType);
+            // culled objects are still drawn, with 0 instances, which costs the GPU next to nothing
+            for (uint32_t first = 0; first < batch.count; first += maxDrawIndirectCount) {
+                uint32_t drawCount = std::min(maxDrawIndirectCount, batch.count - first);
+                vkCmdDrawIndexedIndirect(cmd, frame.commandBuffer, VkDeviceSize(batch.firstSlot + first) * sizeof(IndirectDrawCommand),
+                                         drawCount, sizeof(IndirectDrawCommand));
+            }
+        }
+    }
+
+    uint32_t GpuScene::submitVisible(const Frustum& frustum) {
+        PROFILE_SCOPE("gpu scene cpu culling");
+        if (slotsChanged)
+            rebuildSlots();
+        uint32_t count = static_cast<uint32_t>(slotObjects.size());
+        fallbackCommands.resize(count);
+        cullObjectsReference(frustum, slotObjects.data(), count, fallbackCommands.data());
+
+        uint32_t visible = 0;
+        for (const Batch& batch : batches) {
+            for (uint32_t slot = batch.firstSlot; slot < batch.firstSlot + batch.count; ++slot) {
+                if (!fallbackCommands[slot].instanceCount)
+                    continue;
+                submitCulledDraw(*batch.mesh, objects[slotToObject[slot]].model);
+                ++visible;
+            }
+        }
+        stats_.drawCalls = 0;
+        return visible;
+    }
+
+} // namespace graphics
@@ -1,4 +1,7 @@
 #include "graphics_api.hpp"
+#include "shaders/simple_vert.hpp"
+#include "shaders/simple_frag.hpp"
+#include "shaders/instanced_vert.hpp"
 
 #include <set>
 #include <string>
@@ -19,47 +22,22 @@ const std::vector<const char*> deviceExtensions = {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
-
-struct Vertex {
-    glm::vec3 pos;
-    glm::vec3 color;
-
-    static VkVertexInputBindingDescription getBindingDescription() {
-        VkVertexInputBindingDescription bindingDescription = {};
-        bindingDescription.binding = 0;
-        bindingDescription.stride = sizeof(Vertex);
-        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-
-        return bindingDescription;
-    }
-
-    static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() {
-        std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions = {};
-        attributeDescriptions[0].binding = 0;
-        attributeDescriptions[0].location = 0;
-        attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-        attributeDescriptions[0].offset = offsetof(Vertex, pos);
-        attributeDescriptions[1].binding = 0;
-        attributeDescriptions[1].location = 1;
-        attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-        attributeDescriptions[1].offset = offsetof(Vertex, color);
-
-        return attributeDescriptions;
-    }
-};
-
-const std::vector<Vertex> vertices = {
-    {{-0.5f, -0.5f, 0.0f}, {1.0f, 0.0f, 0.0f}},
-    {{0.5f,  -0.5f, 0.0f}, {0.0f, 1.0f, 0.0f}},
-    {{0.5f, 0.5f, 0.0f}, {0.0f, 0.0f, 1.0f}},
-    {{-0.5f, 0.5f, 0.0f}, {1.0f, 1.0f, 1.0f}},
+// the built in quad, drawn when no mesh is loaded
+const std::vector<graphics::Vertex> vertices = {
+    {{-0.5f, -0.5f, 0.0f}, {0.0f, 0.0f, 1.0f}, {1.0f, 0.0f, 0.0f}},
+    {{0.5f,  -0.5f, 0.0f}, {0.0f, 0.0f, 1.0f}, {0.0f, 1.0f, 0.0f}},
+    {{0.5f, 0.5f, 0.0f}, {0.0f, 0.0f, 1.0f}, {0.0f, 0.0f, 1.0f}},
+    {{-0.5f, 0.5f, 0.0f}, {0.0f, 0.0f, 1.0f}, {1.0f, 1.0f, 1.0f}},
 };
 
-const std::vector<uint16_t> indices = {
+const std::vector<uint32_t> indices = {
     0, 1, 2, 2, 3, 0
 };
 
+// space in the uniform ring for each frame's constants and instance transforms, enough for tens
+// of thousands of objects plus a couple hundred thousand instances
+const VkDeviceSize UNIFORM_BYTES_PER_FRAME = 16 * 1024 * 1024;
+
 struct UBO {
     alignas(16) glm::mat4 model;
     alignas(16) glm::mat4 view;
@@ -75,32 +53,251 @@ namespace graphics {
     VkSurfaceKHR surface;
     PhysicalDeviceInfo physicalDeviceInfo;
     VkDevice logicalDevice;
-    VkQueue graphicsQueue, presentQueue;
+    bool useDedicatedTransferQueue = true;
+    uint32_t framesInFlight = 2;
+    uint32_t recordingThreads = 1;
+    bool frustumCulling = true;
+    bool levelOfDetail = true;
+    float lodPixelError = 1.0f;
+    VkQueue graphicsQueue, presentQueue, transferQueue;
     VkSwapchainKHR swapChain;
     std::vector<VkImage> swapChainImages;
     VkFormat swapChainImageFormat;
     VkExtent2D swapChainExtent;
     std::vector<VkImageView> swapChainImageViews;
     VkRenderPass renderPass;
+    VkRenderPass depthLoadRenderPass;
+    VkRenderPass depthPrepassRenderPass;
+    VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+    VkImage depthImage;
+    VkImageView depthImageView;
     VkDescriptorSetLayout descriptorSetLayout;
     VkPipelineLayout pipelineLayout;
-    VkPipeline graphicsPipeline;
+    std::vector<VertexLayout> pipelineVertexLayouts;
+    std::vector<VkPipeline> graphicsPipelines;
+    std::vector<VkPipeline> instancedPipelines;
+    std::vector<VkPipeline> depthPipelines;
     std::vector<VkFramebuffer> swapChainFramebuffers;
-    VkCommandPool commandPool;
+    VkFramebuffer depthPrepassFramebuffer;
+    std::vector<VkCommandPool> frameCommandPools;
+    std::vector<std::vector<VkCommandPool>> workerCommandPools;
+    std::vector<std::vector<VkCommandBuffer>> workerCommandBuffers;
     std::vector<VkCommandBuffer> commandBuffers;
     std::vector<VkSemaphore> imageAvailableSemaphores;
     std::vector<VkSemaphore> renderFinishedSemaphores;
     std::vector<VkFence> inFlightFences;
+    std::vector<VkFence> imagesInFlight;
     size_t currentFrame = 0;
     bool framebufferResized = false;
-    VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
-    VkBuffer indexBuffer;
-    VkDeviceMemory indexBufferMemory;
-    std::vector<VkBuffer> uniformBuffers;
-    std::vector<VkDeviceMemory> uniformBuffersMemory;
+    Mesh quadMesh;
     VkDescriptorPool descriptorPool;
-    std::vector<VkDescriptorSet> descriptorSets;
+    VkDescriptorSet descriptorSet;
+
+    namespace {
+        std::vector<DrawCommand> drawList; // draws submitted for the next frame
+        std::vector<DrawCommand> culledDrawList; // submitCulledDraw draws, appended after culling
+
+        struct InstancedDraw {
+            const Mesh* mesh;
+            uint32_t firstInstance; // into instanceTransforms
+            uint32_t instanceCount;
+        };
+        std::vector<InstancedDraw> instancedDrawList;
+        std::vector<glm::mat4> instanceTransforms; // of every instanced draw, back to back
+        std::vector<GpuScene*> gpuSceneList;       // culled on the GPU, drawn indirectly
+        FrameStats frameStats;
+
+        Allocation depthAllocation;
+
+        // world space bounds of the draw list, rebuilt every frame for culling
+        CullingBounds drawBounds;
+        std::vector<uint32_t> visibleDraws;
+
+        // a worker slice smaller than this isn't worth the cost of a secondary command buffer
+        const size_t MIN_DRAWS_PER_THREAD = 256;
+
+        void setViewportAndScissor(VkCommandBuffer cmd) {
+            VkViewport viewport = { 0.0f, 0.0f, (float) swapChainExtent.width, (float) swapChainExtent.height, 0.0f, 1.0f };
+            VkRect2D scissor = { { 0, 0 }, swapChainExtent };
+            vkCmdSetViewport(cmd, 0, 1, &viewport);
+            vkCmdSetScissor(cmd, 0, 1, &scissor);
+        }
+
+        /** \brief Remove the draws whose bounds are entirely outside the frustum from the draw list.
+         *
+         * Each draw's model space box is transformed to a world space box around it, and the
+         * boxes are tested in batches by cullBoxes. The surviving draws keep their submission
+         * order.
+         */
+        void cullDrawList(const glm::mat4& viewProj) {
+            PROFILE_SCOPE("frustum culling");
+            uint32_t drawCount = static_cast<uint32_t>(drawList.size());
+            drawBounds.resize(drawCount);
+            for (uint32_t i = 0; i < drawCount; ++i) {
+                const DrawCommand& draw = drawList[i];
+                glm::vec3 center, halfExtent;
+                transformBox(draw.model, draw.mesh->boundsMin, draw.mesh->boundsMax, center, halfExtent);
+                drawBounds.setBox(i, center, halfExtent);
+            }
+
+            visibleDraws.resize(drawCount);
+            uint32_t visibleCount = cullBoxes(extractFrustum(viewProj), drawBounds, visibleDraws.data());
+            // the visible indices are increasing, so the list can be compacted in place
+            for (uint32_t i = 0; i < visibleCount; ++i)
+                drawList[i] = drawList[visibleDraws[i]];
+            drawList.resize(visibleCount);
+            frameStats.culled += drawCount - visibleCount;
+        }
+
+        /** The range of mesh's index buffer that level lod is drawn with. */
+        MeshLodRange lodRange(const Mesh& mesh, uint32_t lod) {
+            if (lod == 0 || lod > mesh.lods.size())
+                return { 0, mesh.indexCount, 0.0f };
+            return mesh.lods[lod - 1];
+        }
+
+        /** Pick the level of detail of every draw in the draw list, which has no history, so
+         * there's no hysteresis either.
+         */
+        void selectDrawListLods(const glm::mat4& view, const glm::mat4& proj) {
+            PROFILE_SCOPE("select lods");
+            glm::vec3 camera = glm::vec3(glm::inverse(view)[3]);
+            float pixelScale = lodPixelScale(proj);
+            for (DrawCommand& draw : drawList) {
+                if (!draw.mesh->lods.empty())
+                    draw.lod = selectLod(*draw.mesh, draw.model, camera, pixelScale, 0);
+            }
+        }
+
+        /** Record draws [begin, end) of the draw list. The render pass must already be active. */
+        void recordDraws(VkCommandBuffer cmd, size_t begin, size_t end, const glm::mat4& view, const glm::mat4& proj) {
+            // includes writing the UBOs, which happens per draw
+            PROFILE_SCOPE("record draws");
+            setViewportAndScissor(cmd);
+
+            const Mesh* boundMesh = nullptr;
+            uint32_t boundPipeline = ~0u;
+            for (size_t i = begin; i < end; ++i) {
+                const DrawCommand& draw = drawList[i];
+                // written straight into the mapped ring, no map / unmap or descriptor update needed
+                uint32_t uboOffset;
+                UBO* ubo = allocateUniforms<UBO>(uboOffset);
+                if (!ubo)
+                    break; // out of uniform space for this frame, drop the rest
+                // quantized positions are scaled back to the mesh's bounds along with the model
+                // transform, so the shaders are the same for every vertex layout
+                ubo->model = draw.mesh->quantized ? draw.model * draw.mesh->dequantize : draw.model;
+                ubo->view = view;
+                ubo->proj = proj;
+
+                if (draw.mesh->pipelineIndex != boundPipeline) {
+                    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipelines[draw.mesh->pipelineIndex]);
+                    boundPipeline = draw.mesh->pipelineIndex;
+                }
+                if (draw.mesh != boundMesh) {
+                    VkDeviceSize offset = 0;
+                    vkCmdBindVertexBuffers(cmd, 0, 1, &draw.mesh->vertexBuffer, &offset);
+                    vkCmdBindIndexBuffer(cmd, draw.mesh->indexBuffer, 0, draw.mesh->indexType);
+                    boundMesh = draw.mesh;
+                }
+                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                        pipelineLayout, 0, 1, &descriptorSet, 1, &uboOffset);
+                MeshLodRange range = lodRange(*draw.mesh, draw.lod);
+                vkCmdDrawIndexed(cmd, range.indexCount, 1, range.firstIndex, 0, 0);
+            }
+        }
+
+        /** \brief Copy the transforms of every instanced draw into the current frame's ring region.
+         *
+         * The ring doubles as the per instance vertex buffer, so the copy is all it takes to
+         * upload them. Quantized meshes get their dequantization folded in here, since the
+         * instanced shader only sees the per instance matrix.
+         */
+        bool uploadInstances(uint32_t& ringOffset) {
+            PROFILE_SCOPE("upload instances");
+            void* data;
+            if (!allocateUniforms(instanceTransforms.size() * sizeof(glm::mat4), data, ringOffset))
+                return false; // out of ring space for this frame, drop the instances
+            glm::mat4* transforms = static_cast<glm::mat4*>(data);
+            for (const InstancedDraw& draw : instancedDrawList) {
+                const glm::mat4* models = instanceTransforms.data() + draw.firstInstance;
+                if (!draw.mesh->quantized) {
+                    memcpy(transforms + draw.firstInstance, models, draw.instanceCount * sizeof(glm::mat4));
+                    continue;
+                }
+                for (uint32_t i = 0; i < draw.instanceCount; ++i)
+                    transforms[draw.firstInstance + i] = models[i] * draw.mesh->dequantize;
+            }
+            return true;
+        }
+
+        /** Record every instanced draw, one vkCmdDrawIndexed each. The render pass must already
+         * be active, and the transforms uploaded at instanceOffset in the ring.
+         */
+        void recordInstancedDraws(VkCommandBuffer cmd, uint32_t instanceOffset, const glm::mat4& view, const glm::mat4& proj) {
+            PROFILE_SCOPE("record instanced draws");
+            setViewportAndScissor(cmd);
+
+            // all of the instanced draws share one UBO, only the view and projection are used
+            uint32_t uboOffset;
+            UBO* ubo = allocateUniforms<UBO>(uboOffset);
+            if (!ubo)
+                return;
+            ubo->model = glm::mat4(1.0f);
+            ubo->view = view;
+            ubo->proj = proj;
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                    pipelineLayout, 0, 1, &descriptorSet, 1, &uboOffset);
+
+            // the draws pick their range of the instance stream with firstInstance
+            VkBuffer instanceBuffer = getUniformRingBuffer();
+            VkDeviceSize instanceBufferOffset = instanceOffset;
+            vkCmdBindVertexBuffers(cmd, 1, 1, &instanceBuffer, &instanceBufferOffset);
+
+            uint32_t boundPipeline = ~0u;
+            const Mesh* boundMesh = nullptr;
+            for (const InstancedDraw& draw : instancedDrawList) {
+                if (draw.mesh->pipelineIndex != boundPipeline) {
+                    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, instancedPipelines[draw.mesh->pipelineIndex]);
+                    boundPipeline = draw.mesh->pipelineIndex;
+                }
+                if (draw.mesh != boundMesh) {
+                    VkDeviceSize offset = 0;
+                    vkCmdBindVertexBuffers(cmd, 0, 1, &draw.mesh->vertexBuffer, &offset);
+                    vkCmdBindIndexBuffer(cmd, draw.mesh->indexBuffer, 0, draw.mesh->indexType);
+                    boundMesh = draw.mesh;
+                }
+                vkCmdDrawIndexed(cmd, draw.mesh->indexCount, draw.instanceCount, 0, 0, draw.firstInstance);
+            }
+        }
+
+        /** Record the indirect draws of every GpuScene that was prepared this frame. The render
+         * pass must already be active, and the culling dispatches recorded before it. depthOnly
+         * draws with the depth pipelines, for the depth prepass.
+         */
+        void recordGpuSceneDraws(VkCommandBuffer cmd, const glm::mat4& view, const glm::mat4& proj, bool depthOnly) {
+            PROFILE_SCOPE("record gpu scene draws");
+            setViewportAndScissor(cmd);
+
+            // the scenes draw with the instanced pipelines, which only use the view and projection
+            uint32_t uboOffset;
+            UBO* ubo = allocateUniforms<UBO>(uboOffset);
+            if (!ubo)
+                return;
+            ubo->model = glm::mat4(1.0f);
+            ubo->view = view;
+            ubo->proj = proj;
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                    pipelineLayout, 0, 1, &descriptorSet, 1, &uboOffset);
+
+            for (GpuScene* scene : gpuSceneList) {
+                if (depthOnly)
+                    scene->recordDepthDraws(cmd, static_cast<uint32_t>(currentFrame));
+                else
+                    scene->recordDraws(cmd, static_cast<uint32_t>(currentFrame));
+            }
+        }
+    } // namespace anonymous
 
     // helper functions
     namespace {
@@ -174,8 +371,10 @@ namespace graphics {
         /** \brief Find and select the first avaiable queues for graphics and presentation
         * Queues are where commands get submitted to and are processed asynchronously. Some queues
         * might only be usable for certain operations, like graphics or memory operations.
-        * Currently we just need 1 queue for graphics commands, and 1 queue for
-        * presenting the images we create to the surface.
+        * Currently we need 1 queue for graphics commands, and 1 queue for presenting the images
+        * we create to the surface. If the device has a family that is only meant for transfers
+        * (usually backed by a DMA engine) that is used for uploads, otherwise they share the
+        * graphics queue.
         */
         QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surface) {
             QueueFamilyIndices indices;
@@ -191,11 +390,15 @@ namespace graphics {
                 // check if the queue supports graphics operations
                 if (queueFamily.queueCount > 0 && queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
                     indices.graphicsFamily = i;
+                    // nothing gets presented in headless mode, so any graphics queue will do
+                    if (headless)
+                        indices.presentFamily = i;
                 }
 
                 // check if the queue supports presenting images to the surface
                 VkBool32 presentSupport = false;
-                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+                if (!headless)
+                    vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
 
                 if (queueFamily.queueCount > 0 && presentSupport) {
                     indices.presentFamily = i;
@@ -208,6 +411,24 @@ namespace graphics {
                 i++;
             }
 
+            // graphics queues can always do transfers, so that is the fallback
+            indices.transferFamily = indices.graphicsFamily;
+            if (!useDedicatedTransferQueue)
+                return indices;
+
+            // prefer a transfer only family, then one without graphics (async compute)
+            int bestScore = 0;
+            for (uint32_t f = 0; f < queueFamilyCount; ++f) {
+                VkQueueFlags flags = queueFamilies[f].queueFlags;
+                if (queueFamilies[f].queueCount == 0 || !(flags & VK_QUEUE_TRANSFER_BIT) || (flags & VK_QUEUE_GRAPHICS_BIT))
+                    continue;
+                int score = (flags & VK_QUEUE_COMPUTE_BIT) ? 1 : 2;
+                if (score > bestScore) {
+                    bestScore = score;
+                    indices.transferFamily = f;
+                }
+            }
+
             return indices;
         }
 
@@ -265,10 +486,10 @@ namespace graphics {
         int ratePhysicalDevice(const PhysicalDeviceInfo& deviceInfo) {
             // check the required features first: queueFamilies, extension support,
             // and swap chain support
-            bool extensionsSupported = checkPhysicalDeviceExtensionSupport(deviceInfo.device);
+            bool extensionsSupported = headless || checkPhysicalDeviceExtensionSupport(deviceInfo.device);
 
-            bool swapChainAdequate = false;
-            if (extensionsSupported) {
+            bool swapChainAdequate = headless;
+            if (extensionsSupported && !headless) {
                 SwapChainSupportDetails swapChainSupport = querySwapChainSupport(deviceInfo.device, surface);
                 swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
             }
@@ -290,120 +511,6 @@ namespace graphics {
             return score;
         }
 
-        /** Load a SPIR-V shader from the specified full path. */
-        std::vector<char> readShader(const std::string& filename) {
-            std::ifstream file(filename, std::ios::ate | std::ios::binary);
-
-            if (!file)
-                return {};
-
-            size_t fileSize = (size_t) file.tellg();
-            std::vector<char> buffer(fileSize);
-            file.seekg(0);
-            file.read(buffer.data(), fileSize);
-            file.close();
-
-            return buffer;
-        }
-
-        /** Have to wrap the shader bytecode in a VkShaderModule. Compilation and linking does not
-         * happen until the graphics pipeline is created.
-         */
-        bool createShaderModule(VkShaderModule& module, const std::vector<char>& code) {
-            VkShaderModuleCreateInfo createInfo = {};
-            createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-            createInfo.codeSize = code.size();
-            createInfo.pCode = (const uint32_t*) code.data();
-
-            return vkCreateShaderModule(logicalDevice, &createInfo, nullptr, &module) == VK_SUCCESS;
-        }
-
-        bool findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties, uint32_t& index) {
-            VkPhysicalDeviceMemoryProperties memProperties;
-            vkGetPhysicalDeviceMemoryProperties(physicalDeviceInfo.device, &memProperties);
-            // return the first suitable memory type found
-            for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i) {
-                if (typeFilter & (1 << i) && (memProperties.memoryTypes[i].propertyFlags & properties)
-                        == properties)
-                {
-                    index = i;
-                    return true;
-                }
-            }
-            return false;
-        }
-
-        bool createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
-                VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory)
-        {
-            VkBufferCreateInfo bufferInfo = {};
-            bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-            bufferInfo.size = size;
-            bufferInfo.usage = usage;
-            bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-            bufferInfo.flags = 0; // for sparse buffer memory, not relevent right now
-
-            if (vkCreateBuffer(logicalDevice, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
-                return false;
-
-            VkMemoryRequirements memRequirements;
-            vkGetBufferMemoryRequirements(logicalDevice, buffer, &memRequirements);
-
-            VkMemoryAllocateInfo allocInfo = {};
-            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-            allocInfo.allocationSize = memRequirements.size;
-            uint32_t index;
-            if (!findMemoryType(memRequirements.memoryTypeBits, properties, index))
-                return false;
-            allocInfo.memoryTypeIndex = index;
-
-            if (vkAllocateMemory(logicalDevice, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS)
-                return false;
-            vkBindBufferMemory(logicalDevice, buffer, bufferMemory, 0);
-
-            return true;
-        }
-
-        /** \brief Copies size bytes from one buffer to another.
-         *
-         * NOTE: Look into a better way to do this. Seems unnecessary that a new command buffer
-         * needs to be allocated every time a buffer needs to be copied
-         */
-        void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-            // memory transfer operations use command buffers, just like draw operations 
-            VkCommandBufferAllocateInfo allocInfo = {};
-            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-            allocInfo.commandPool = commandPool;
-            allocInfo.commandBufferCount = 1;
-            VkCommandBuffer commandBuffer;
-            vkAllocateCommandBuffers(logicalDevice, &allocInfo, &commandBuffer);
-
-            // start recording 
-            VkCommandBufferBeginInfo beginInfo = {};
-            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-            vkBeginCommandBuffer(commandBuffer, &beginInfo);
-
-            // copy
-            VkBufferCopy copyRegion = {};
-            copyRegion.srcOffset = 0;
-            copyRegion.dstOffset = 0;
-            copyRegion.size = size;
-            vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-            vkEndCommandBuffer(commandBuffer);
-
-            VkSubmitInfo submitInfo = {};
-            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-            submitInfo.commandBufferCount = 1;
-            submitInfo.pCommandBuffers = &commandBuffer;
-
-            // graphics queue is implicitly capable of doing memory transfer operations
-            vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-            vkQueueWaitIdle(graphicsQueue);
-            vkFreeCommandBuffers(logicalDevice, commandPool, 1, &commandBuffer);
-        }
-
     } // namespace anonymous
 
     static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
@@ -414,6 +521,15 @@ namespace graphics {
     bool initVulkan(int sw, int sh) {
         SW = sw;
         SH = sh;
+
+        if (headless) {
+            return createInstance() && setupDebugCallback() && pickPhysicalDevice() &&
+                createLogicalDevice() && createAllocator() && createPipelineCache() && createOffscreenTargets() && createImageViews() && createDepthResources() && createRenderPass() &&
+                createDescriptorSetLayout() && createGraphicsPipeline() && createGpuCulling() && createHiZPipeline() && createFramebuffers() &&
+                createHiZPyramid() && createCommandPool() && createGpuProfiler() && createStagingBuffer() && createQuadMesh() && createUniformRing(UNIFORM_BYTES_PER_FRAME) &&
+                createDescriptorPool() && createDescriptorSets() && createCommandBuffers() && createSyncObjects();
+        }
+
         if (!glfwInit()) {
             std::cout << "Failed to initialize GLFW" << std::endl;
             return false;
@@ -429,9 +545,9 @@ namespace graphics {
         }
 
         if (createInstance() && setupDebugCallback() && createSurface() && pickPhysicalDevice() &&
-            createLogicalDevice() && createSwapChain() && createImageViews() && createRenderPass() &&
-            createDescriptorSetLayout() && createGraphicsPipeline() && createFramebuffers() &&
-            createCommandPool() && createVertexBuffer() && createIndexBuffer() && createUniformBuffers() &&
+            createLogicalDevice() && createAllocator() && createPipelineCache() && createSwapChain() && createImageViews() && createDepthResources() && createRenderPass() &&
+            createDescriptorSetLayout() && createGraphicsPipeline() && createGpuCulling() && createHiZPipeline() && createFramebuffers() &&
+            createHiZPyramid() && createCommandPool() && createGpuProfiler() && createStagingBuffer() && createQuadMesh() && createUniformRing(UNIFORM_BYTES_PER_FRAME) &&
             createDescriptorPool() && createDescriptorSets() && createCommandBuffers() && createSyncObjects())
             return true;
 
@@ -441,27 +557,53 @@ namespace graphics {
     
 
     void cleanup() {
+        // frames are no longer waited on at the end of drawFrame, so they could still be running
+        vkDeviceWaitIdle(logicalDevice);
+
         cleanupSwapChain();
+        if (headless) {
+            // hand over whatever was still in flight, oldest first
+            for (uint32_t i = 0; i < framesInFlight; ++i)
+                deliverReadback((currentFrame + i) % framesInFlight);
+            destroyOffscreenTargets();
+        } else {
+            vkDestroySwapchainKHR(logicalDevice, swapChain, nullptr);
+        }
+        cleanupRenderPass();
+        destroyUniformRing();
+        vkDestroyDescriptorPool(logicalDevice, descriptorPool, nullptr);
         vkDestroyDescriptorSetLayout(logicalDevice, descriptorSetLayout, nullptr);
-        vkDestroyBuffer(logicalDevice, vertexBuffer, nullptr);
-        vkFreeMemory(logicalDevice, vertexBufferMemory, nullptr);
-        vkDestroyBuffer(logicalDevice, indexBuffer, nullptr);
-        vkFreeMemory(logicalDevice, indexBufferMemory, nullptr);
+        destroyMesh(quadMesh);
 
         // the nullptr arguments are the deallocators if using a custom allocator
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        for (size_t i = 0; i < framesInFlight; i++) {
             vkDestroySemaphore(logicalDevice, renderFinishedSemaphores[i], nullptr);
             vkDestroySemaphore(logicalDevice, imageAvailableSemaphores[i], nullptr);
             vkDestroyFence(logicalDevice, inFlightFences[i], nullptr);
         }
 
-        vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
+        destroyStagingBuffer();
+        destroyGpuProfiler();
+        destroyGpuCulling();
+        destroyHiZPipeline();
+        destroyShaderRegistry();
+        destroyPipelineCache();
+        for (auto pool : frameCommandPools)
+            vkDestroyCommandPool(logicalDevice, pool, nullptr);
+        for (auto& pools : workerCommandPools)
+            for (auto pool : pools)
+                vkDestroyCommandPool(logicalDevice, pool, nullptr);
+        destroyWorkerThreads();
+        destroyAllocator();
         vkDestroyDevice(logicalDevice, nullptr);
-        vkDestroySurfaceKHR(instance, surface, nullptr);
+        if (!headless)
+            vkDestroySurfaceKHR(instance, surface, nullptr);
         DestroyDebugUtilsMessengerEXT(nullptr);
         vkDestroyInstance(instance, nullptr);
-        glfwDestroyWindow(window);
-        glfwTerminate();
+        if (!headless) {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+        }
     }
 
     /** \brief Initializes the Vulkan library, extensions, and layers.
@@ -490,10 +632,12 @@ namespace graphics {
         // Vulkan by itself doesn't know how to do any platform specifc things, so we do need
         // extensions. Specifically, we at least need the ones to interface with the windowing API,
         // so ask glfw for the extensions needed for this. These are global to the program.
+        // Headless mode never touches a window, so it needs none of them.
         uint32_t glfwExtensionCount = 0;
-        const char** glfwExtensions;
+        const char** glfwExtensions = nullptr;
 
-        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        if (!headless)
+            glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
         std::vector<const char*> extensionNames(glfwExtensions, glfwExtensions + glfwExtensionCount);
 
         // Also want the debug utils extension so we can print out layer messages
@@ -637,8 +781,13 @@ namespace graphics {
     bool createLogicalDevice() {
         const auto& indices = physicalDeviceInfo.indices;
         VkPhysicalDeviceFeatures deviceFeatures = {};
+        // GPU driven rendering (see gpu_scene.hpp) uses these whenever they're there
+        VkPhysicalDeviceFeatures supportedFeatures;
+        vkGetPhysicalDeviceFeatures(physicalDeviceInfo.device, &supportedFeatures);
+        deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+        deviceFeatures.drawIndirectFirstInstance = supportedFeatures.drawIndirectFirstInstance;
         std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-        std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily, indices.presentFamily };
+        std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily, indices.presentFamily, indices.transferFamily };
 
         float queuePriority = 1.0f;
         for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -655,7 +804,8 @@ namespace graphics {
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.pEnabledFeatures = &deviceFeatures;
-        createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
+        // no swap chain in headless mode, so VK_KHR_swapchain isn't needed (or even supported)
+        createInfo.enabledExtensionCount = headless ? 0 : static_cast<uint32_t>(deviceExtensions.size());
         createInfo.ppEnabledExtensionNames = deviceExtensions.data();
 
         if (vkCreateDevice(physicalDeviceInfo.device, &createInfo, nullptr, &logicalDevice) != VK_SUCCESS)
@@ -663,6 +813,7 @@ namespace graphics {
 
         vkGetDeviceQueue(logicalDevice, indices.graphicsFamily, 0, &graphicsQueue);
         vkGetDeviceQueue(logicalDevice, indices.presentFamily, 0, &presentQueue);
+        vkGetDeviceQueue(logicalDevice, indices.transferFamily, 0, &transferQueue);
 
         return true;
     }
@@ -717,8 +868,9 @@ namespace graphics {
         createInfo.presentMode = presentMode;
         createInfo.clipped = VK_TRUE;
 
-        // only applies if you have to create a new swap chain (like on window resizing)
-        createInfo.oldSwapchain = VK_NULL_HANDLE;
+        // only applies if you have to create a new swap chain (like on window resizing). The
+        // old one is retired, but can't be destroyed until the new one is created
+        createInfo.oldSwapchain = swapChain;
 
         if (vkCreateSwapchainKHR(logicalDevice, &createInfo, nullptr, &swapChain) != VK_SUCCESS)
             return false;
@@ -765,13 +917,72 @@ namespace graphics {
         return true;
     }
 
-    /** \brief Create the render pass for the framebuffer attachments being used
+    /** \brief Create the depth buffer, shared by every framebuffer.
      *
-     * The render pass specifies each attachment, and how they should be used during operations.
+     * Frames in flight take turns with it, which the render passes' dependencies take care of.
+     * It is also sampled by the Hi-Z pyramid build, so formats that can be sampled win over
+     * ones that can't, and occlusion culling is off when none can.
      */
-    bool createRenderPass() {
-        // currently just one color attachment
-        VkAttachmentDescription colorAttachment = {};
+    bool createDepthResources() {
+        if (depthFormat == VK_FORMAT_UNDEFINED) {
+            const VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT, VK_FORMAT_X8_D24_UNORM_PACK32, VK_FORMAT_D16_UNORM };
+            for (VkFormatFeatureFlags features : { VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT,
+                                                   (VkFormatFeatureFlags) VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT }) {
+                for (VkFormat format : candidates) {
+                    VkFormatProperties properties;
+                    vkGetPhysicalDeviceFormatProperties(physicalDeviceInfo.device, format, &properties);
+                    if (depthFormat == VK_FORMAT_UNDEFINED && (properties.optimalTilingFeatures & features) == features)
+                        depthFormat = format;
+                }
+            }
+            if (depthFormat == VK_FORMAT_UNDEFINED) {
+                std::cout << "No supported depth format" << std::endl;
+                return false;
+            }
+        }
+
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(physicalDeviceInfo.device, depthFormat, &properties);
+        VkImageCreateInfo imageInfo = {};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.format = depthFormat;
+        imageInfo.extent = { swapChainExtent.width, swapChainExtent.height, 1 };
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+        if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)
+            imageInfo.usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        if (vkCreateImage(logicalDevice, &imageInfo, nullptr, &depthImage) != VK_SUCCESS)
+            return false;
+
+        VkMemoryRequirements memRequirements;
+        vkGetImageMemoryRequirements(logicalDevice, depthImage, &memRequirements);
+        if (!allocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, depthAllocation) ||
+            vkBindImageMemory(logicalDevice, depthImage, depthAllocation.memory, depthAllocation.offset) != VK_SUCCESS)
+            return false;
+
+        VkImageViewCreateInfo viewInfo = {};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = depthImage;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = depthFormat;
+        viewInfo.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+        return vkCreateImageView(logicalDevice, &viewInfo, nullptr, &depthImageView) == VK_SUCCESS;
+    }
+
+    /** \brief Create a render pass drawing color and depth, with the depth cleared or loaded.
+     *
+     * Both versions only differ in their load ops and layouts, so they are compatible, and
+     * share the pipelines and framebuffers.
+     */
+    bool createMainRenderPass(VkAttachmentLoadOp depthLoadOp, VkRenderPass& pass) {
+        VkAttachmentDescription attachments[2] = {};
+        VkAttachmentDescription& colorAttachment = attachments[0];
         colorAttachment.format = swapChainImageFormat;
         colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT; // used later for multisampling
         colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
@@ -780,47 +991,133 @@ namespace graphics {
         colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        // offscreen targets get copied out of instead of presented
+        colorAttachment.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+        // the depth is either cleared, or loaded from the depth prepass. Nothing reads it after
+        VkAttachmentDescription& depthAttachment = attachments[1];
+        depthAttachment.format = depthFormat;
+        depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+        depthAttachment.loadOp = depthLoadOp;
+        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.initialLayout = depthLoadOp == VK_ATTACHMENT_LOAD_OP_LOAD ?
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
+        depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
         // only 1 subpass currently
         VkAttachmentReference colorAttachmentRef = {};
         colorAttachmentRef.attachment = 0;
         colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        VkAttachmentReference depthAttachmentRef = {};
+        depthAttachmentRef.attachment = 1;
+        depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
-        
         VkSubpassDescription subpass = {};
         subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
         subpass.colorAttachmentCount = 1;
         subpass.pColorAttachments = &colorAttachmentRef;
+        subpass.pDepthStencilAttachment = &depthAttachmentRef;
 
         // 2 implicit dependencies for subpasses: start and end of render pass
         // the start of the render pass. At the start of the render pass the image actually hasnt
-        // been acquired for use yet, so need to wait (dependency) on the color attachment stage
+        // been acquired for use yet, so need to wait (dependency) on the color attachment stage.
+        // The depth buffer is shared between frames, so it also waits on the last frame's
+        // depth writes, and on the Hi-Z build reading the prepass' depth
         VkSubpassDependency dependency = {};
         dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
         dependency.dstSubpass = 0;
-        dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        dependency.srcAccessMask = 0;
-        dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
         VkRenderPassCreateInfo renderPassInfo = {};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-        renderPassInfo.attachmentCount = 1;
-        renderPassInfo.pAttachments = &colorAttachment;
+        renderPassInfo.attachmentCount = 2;
+        renderPassInfo.pAttachments = attachments;
         renderPassInfo.subpassCount = 1;
         renderPassInfo.pSubpasses = &subpass;
         renderPassInfo.dependencyCount = 1;
         renderPassInfo.pDependencies = &dependency;
 
-        return vkCreateRenderPass(logicalDevice, &renderPassInfo, nullptr, &renderPass) == VK_SUCCESS;
+        return vkCreateRenderPass(logicalDevice, &renderPassInfo, nullptr, &pass) == VK_SUCCESS;
+    }
+
+    /** \brief Create the depth only render pass of the depth prepass.
+     *
+     * The depth it leaves behind is read by the Hi-Z build, then loaded by depthLoadRenderPass.
+     */
+    bool createDepthPrepassRenderPass() {
+        VkAttachmentDescription depthAttachment = {};
+        depthAttachment.format = depthFormat;
+        depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+        depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+        VkAttachmentReference depthAttachmentRef = {};
+        depthAttachmentRef.attachment = 0;
+        depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+        VkSubpassDescription subpass = {};
+        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+        // in: the last frame's main pass and Hi-Z build are done with the depth buffer.
+        // out: the depth writes are visible to the Hi-Z build
+        VkSubpassDependency dependencies[2] = {};
+        dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[0].dstSubpass = 0;
+        dependencies[0].srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        dependencies[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[1].srcSubpass = 0;
+        dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[1].dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+        VkRenderPassCreateInfo renderPassInfo = {};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+        renderPassInfo.attachmentCount = 1;
+        renderPassInfo.pAttachments = &depthAttachment;
+        renderPassInfo.subpassCount = 1;
+        renderPassInfo.pSubpasses = &subpass;
+        renderPassInfo.dependencyCount = 2;
+        renderPassInfo.pDependencies = dependencies;
+
+        return vkCreateRenderPass(logicalDevice, &renderPassInfo, nullptr, &depthPrepassRenderPass) == VK_SUCCESS;
+    }
+
+    /** \brief Create the render passes for the framebuffer attachments being used
+     *
+     * The render pass specifies each attachment, and how they should be used during operations.
+     * renderPass clears the depth, depthLoadRenderPass continues from the depth prepass of
+     * occlusion culling, which has a render pass of its own.
+     */
+    bool createRenderPass() {
+        return createMainRenderPass(VK_ATTACHMENT_LOAD_OP_CLEAR, renderPass) &&
+               createMainRenderPass(VK_ATTACHMENT_LOAD_OP_LOAD, depthLoadRenderPass) &&
+               createDepthPrepassRenderPass();
     }
 
     bool createDescriptorSetLayout() {
         VkDescriptorSetLayoutBinding uboLayoutBinding = {};
         uboLayoutBinding.binding = 0; // must match the layout(uniform = _) in the shader
         uboLayoutBinding.descriptorCount = 1;
-        uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        // dynamic, so the one descriptor can point at any object's constants in the uniform ring
+        uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
         uboLayoutBinding.pImmutableSamplers = nullptr; // only relevent for image related stuff
         uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT; // which stages it is accessed
         VkDescriptorSetLayoutCreateInfo layoutInfo = {};
@@ -831,15 +1128,80 @@ namespace graphics {
         return vkCreateDescriptorSetLayout(logicalDevice, &layoutInfo, nullptr, &descriptorSetLayout) == VK_SUCCESS;
     }
 
+    /** \brief Create the pipeline layout, and a pipeline for every vertex layout in use.
+     *
+     * The first time around that is just the standard layout. After a render pass change the
+     * pipelines for every layout a mesh was created with are rebuilt, at the same indices.
+     */
     bool createGraphicsPipeline() {
-        auto vertShaderCode = readShader("../shaders/vert.spv");
-        auto fragShaderCode = readShader("../shaders/frag.spv");
-        if (!vertShaderCode.size() || !fragShaderCode.size())
+        // pipeline layout where you specify uniforms
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+
+        if (vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
             return false;
 
+        if (pipelineVertexLayouts.empty())
+            pipelineVertexLayouts.push_back(VertexLayout::standard());
+        graphicsPipelines.assign(pipelineVertexLayouts.size(), VK_NULL_HANDLE);
+        instancedPipelines.assign(pipelineVertexLayouts.size(), VK_NULL_HANDLE);
+        depthPipelines.assign(pipelineVertexLayouts.size(), VK_NULL_HANDLE);
+        for (size_t i = 0; i < pipelineVertexLayouts.size(); ++i) {
+            if (!createVertexLayoutPipeline(pipelineVertexLayouts[i], false, graphicsPipelines[i]) ||
+                !createVertexLayoutPipeline(pipelineVertexLayouts[i], true, instancedPipelines[i]) ||
+                !createVertexLayoutPipeline(pipelineVertexLayouts[i], true, depthPipelines[i], true))
+                return false;
+        }
+        return true;
+    }
+
+    bool getVertexLayoutPipeline(const VertexLayout& layout, uint32_t& index) {
+        for (size_t i = 0; i < pipelineVertexLayouts.size(); ++i) {
+            if (pipelineVertexLayouts[i] == layout) {
+                index = static_cast<uint32_t>(i);
+                return true;
+            }
+        }
+
+        // 16 bit and normalized formats aren't all guaranteed for vertex buffers
+        for (const VertexAttribute& attribute : layout.attributes()) {
+            VkFormatProperties properties;
+            vkGetPhysicalDeviceFormatProperties(physicalDeviceInfo.device, vertexEncodingFormat(attribute.encoding), &properties);
+            if (!(properties.bufferFeatures & VK_FORMAT_FEATURE_VERTEX_BUFFER_BIT)) {
+                std::cout << "Vertex format " << vertexEncodingFormat(attribute.encoding) << " is not supported" << std::endl;
+                return false;
+            }
+        }
+
+        VkPipeline pipeline, instancedPipeline, depthPipeline;
+        if (!createVertexLayoutPipeline(layout, false, pipeline))
+            return false;
+        if (!createVertexLayoutPipeline(layout, true, instancedPipeline)) {
+            vkDestroyPipeline(logicalDevice, pipeline, nullptr);
+            return false;
+        }
+        if (!createVertexLayoutPipeline(layout, true, depthPipeline, true)) {
+            vkDestroyPipeline(logicalDevice, pipeline, nullptr);
+            vkDestroyPipeline(logicalDevice, instancedPipeline, nullptr);
+            return false;
+        }
+        index = static_cast<uint32_t>(pipelineVertexLayouts.size());
+        pipelineVertexLayouts.push_back(layout);
+        graphicsPipelines.push_back(pipeline);
+        instancedPipelines.push_back(instancedPipeline);
+        depthPipelines.push_back(depthPipeline);
+        return true;
+    }
+
+    bool createVertexLayoutPipeline(const VertexLayout& layout, bool instanced, VkPipeline& pipeline, bool depthOnly) {
+        // the SPIR-V is compiled into the binary, and the registry creates the modules only once
         VkShaderModule vertShaderModule, fragShaderModule;
-        if (!createShaderModule(vertShaderModule, vertShaderCode) ||
-            !createShaderModule(fragShaderModule, fragShaderCode))
+        bool vertLoaded = instanced ? getShaderModule(shaders::instanced_vert, sizeof(shaders::instanced_vert), vertShaderModule)
+                                    : getShaderModule(shaders::simple_vert, sizeof(shaders::simple_vert), vertShaderModule);
+        if (!vertLoaded ||
+            !getShaderModule(shaders::simple_frag, sizeof(shaders::simple_frag), fragShaderModule))
             return false;
 
         // assign shaders to a specific pipeline stage
@@ -862,12 +1224,19 @@ namespace graphics {
         // attributes: type of them, which binding to load them from, and at which offset
         VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
         vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-        auto bindingDescription = Vertex::getBindingDescription();
-        auto attributeDescriptions = Vertex::getAttributeDescriptions();
+        std::vector<VkVertexInputBindingDescription> bindingDescriptions = { layout.getBindingDescription() };
+        auto attributeDescriptions = layout.getAttributeDescriptions();
+        if (instanced) {
+            // instanced pipelines add a second binding, advancing once per instance, with a
+            // model matrix in locations 3 to 6 (a column each)
+            bindingDescriptions.push_back({ 1, sizeof(glm::mat4), VK_VERTEX_INPUT_RATE_INSTANCE });
+            for (uint32_t column = 0; column < 4; ++column)
+                attributeDescriptions.push_back({ 3 + column, 1, VK_FORMAT_R32G32B32A32_SFLOAT, column * (uint32_t) sizeof(glm::vec4) });
+        }
 
-        vertexInputInfo.vertexBindingDescriptionCount = 1;
+        vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescriptions.size());
         vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-        vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+        vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
         vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
 
         // specify topology and if primitive restart is on
@@ -876,25 +1245,15 @@ namespace graphics {
         inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
         inputAssembly.primitiveRestartEnable = VK_FALSE;
 
-        // specify viewport and scissor, then combine into a ViewportState
-        VkViewport viewport = {};
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = (float)swapChainExtent.width;
-        viewport.height = (float)swapChainExtent.height;
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
-
-        VkRect2D scissor = {};
-        scissor.offset = { 0, 0 };
-        scissor.extent = swapChainExtent;
-
+        // viewport and scissor are dynamic state (set in the command buffers), so that the
+        // pipeline doesn't need to be rebuilt every time the window gets resized. Only the count
+        // needs to be specified here
         VkPipelineViewportStateCreateInfo viewportState = {};
         viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
         viewportState.viewportCount = 1;
-        viewportState.pViewports = &viewport;
+        viewportState.pViewports = nullptr;
         viewportState.scissorCount = 1;
-        viewportState.pScissors = &scissor;
+        viewportState.pScissors = nullptr;
 
         // rasterizer does rasterization, depth testing, face culling, and scissor test 
         VkPipelineRasterizationStateCreateInfo rasterizer = {};
@@ -922,7 +1281,15 @@ namespace graphics {
         multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
         multisampling.alphaToOneEnable = VK_FALSE; // Optional
 
-        // no depth or stencil buffer currently
+        // less or equal, so the main pass can draw again what the depth prepass already did.
+        // No stencil currently
+        VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+        depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+        depthStencil.depthTestEnable = VK_TRUE;
+        depthStencil.depthWriteEnable = VK_TRUE;
+        depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+        depthStencil.depthBoundsTestEnable = VK_FALSE;
+        depthStencil.stencilTestEnable = VK_FALSE;
 
         // blending for single attachment
         VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
@@ -934,46 +1301,41 @@ namespace graphics {
         colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
         colorBlending.logicOpEnable = VK_FALSE;
         colorBlending.logicOp = VK_LOGIC_OP_COPY;
-        colorBlending.attachmentCount = 1;
+        colorBlending.attachmentCount = depthOnly ? 0 : 1;
         colorBlending.pAttachments = &colorBlendAttachment;
         colorBlending.blendConstants[0] = 0.0f;
         colorBlending.blendConstants[1] = 0.0f;
         colorBlending.blendConstants[2] = 0.0f;
         colorBlending.blendConstants[3] = 0.0f;
 
-        // no dynamic state currently
-
-        // pipeline layout where you specify uniforms (none currently)
-        VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-        pipelineLayoutInfo.setLayoutCount = 1;
-        pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
-
-        if (vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
-            return false;
+        VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+        VkPipelineDynamicStateCreateInfo dynamicState = {};
+        dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+        dynamicState.dynamicStateCount = 2;
+        dynamicState.pDynamicStates = dynamicStates;
 
         VkGraphicsPipelineCreateInfo pipelineInfo = {};
         pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-        pipelineInfo.stageCount = 2;
+        // depth only pipelines have no fragment shader, and no color to blend
+        pipelineInfo.stageCount = depthOnly ? 1 : 2;
         pipelineInfo.pStages = shaderStages;
         pipelineInfo.pVertexInputState = &vertexInputInfo;
         pipelineInfo.pInputAssemblyState = &inputAssembly;
         pipelineInfo.pViewportState = &viewportState;
         pipelineInfo.pRasterizationState = &rasterizer;
         pipelineInfo.pMultisampleState = &multisampling;
-        pipelineInfo.pDepthStencilState = nullptr;
+        pipelineInfo.pDepthStencilState = &depthStencil;
         pipelineInfo.pColorBlendState = &colorBlending;
-        pipelineInfo.pDynamicState = nullptr;
+        pipelineInfo.pDynamicState = &dynamicState;
         pipelineInfo.layout = pipelineLayout;
-        pipelineInfo.renderPass = renderPass;
+        pipelineInfo.renderPass = depthOnly ? depthPrepassRenderPass : renderPass;
         pipelineInfo.subpass = 0;
         pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
-        if (vkCreateGraphicsPipelines(logicalDevice, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS)
+        auto createStart = std::chrono::high_resolution_clock::now();
+        if (vkCreateGraphicsPipelines(logicalDevice, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
             return false;
-
-        vkDestroyShaderModule(logicalDevice, fragShaderModule, nullptr);
-        vkDestroyShaderModule(logicalDevice, vertShaderModule, nullptr);
+        recordPipelineCreation(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - createStart).count());
 
         return true;
     }
@@ -981,113 +1343,182 @@ namespace graphics {
     /** \brief Create a framebuffer for each of the swap chain images.
      *
      * To actually bind the swap chain images, they need to be wrapped into a VkFramebuffer.
-     * A framebuffer references all of the views for each attachment. Currently only one (color)
+     * A framebuffer references all of the views for each attachment: the swap image for color,
+     * and the shared depth buffer. The depth prepass gets one of its own, with just the depth.
      */
     bool createFramebuffers() {
         swapChainFramebuffers.resize(swapChainImageViews.size());
 
+        VkFramebufferCreateInfo framebufferInfo = {};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.width = swapChainExtent.width;
+        framebufferInfo.height = swapChainExtent.height;
+        framebufferInfo.layers = 1;
+
         for (size_t i = 0; i < swapChainImageViews.size(); ++i) {
             VkImageView attachments[] = {
-                swapChainImageViews[i]
+                swapChainImageViews[i],
+                depthImageView
             };
 
-            VkFramebufferCreateInfo framebufferInfo = {};
-            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
             framebufferInfo.renderPass = renderPass;
-            framebufferInfo.attachmentCount = 1;
+            framebufferInfo.attachmentCount = 2;
             framebufferInfo.pAttachments = attachments;
-            framebufferInfo.width = swapChainExtent.width;
-            framebufferInfo.height = swapChainExtent.height;
-            framebufferInfo.layers = 1;
 
             if (vkCreateFramebuffer(logicalDevice, &framebufferInfo, nullptr, &swapChainFramebuffers[i]) != VK_SUCCESS)
                 return false;
         }
 
-        return true;
+        framebufferInfo.renderPass = depthPrepassRenderPass;
+        framebufferInfo.attachmentCount = 1;
+        framebufferInfo.pAttachments = &depthImageView;
+        return vkCreateFramebuffer(logicalDevice, &framebufferInfo, nullptr, &depthPrepassFramebuffer) == VK_SUCCESS;
     }
 
-    /** \brief Create the command pool for the command buffers.
+    /** \brief Create a command pool for each frame in flight, plus one per recording thread.
      *
-     * The command pool manages the memory for the command buffers, and the buffers are allocated
-     * from it. Each pool can only allocate buffers that are submitted on a single type of queue.
+     * Everything allocated from a frame's pool is re-recorded every time that frame comes
+     * around, so the pools are TRANSIENT and get reset as a whole with vkResetCommandPool,
+     * which is cheaper than resetting the command buffers one by one. Command pools can't be
+     * used from two threads at once, so every slice recorded in parallel gets its own too.
      */
     bool createCommandPool() {
         VkCommandPoolCreateInfo poolInfo = {};
         poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
         poolInfo.queueFamilyIndex = physicalDeviceInfo.indices.graphicsFamily;
-        poolInfo.flags = 0; // optimization hints when doing rerecording of command buffers 
-
-        return vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &commandPool) == VK_SUCCESS;
-    }
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
 
-    // Note: In a real work application, you're not supposed to call vkAllocateMemory for each
-    // individual buffer. Fine for now, but should use a custom allocator.
-    bool createVertexBuffer() {
-        VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
+        frameCommandPools.resize(framesInFlight);
+        for (auto& pool : frameCommandPools) {
+            if (vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &pool) != VK_SUCCESS)
+                return false;
+        }
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        if (!createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory))
+        if (recordingThreads != 1 && !createWorkerThreads(recordingThreads ? recordingThreads - 1 : 0))
             return false;
+        workerCommandPools.resize(framesInFlight);
+        for (auto& pools : workerCommandPools) {
+            pools.resize(workerThreadCount());
+            for (auto& pool : pools) {
+                if (vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &pool) != VK_SUCCESS)
+                    return false;
+            }
+        }
+        return true;
+    }
 
-        // actually fill the buffer with data. Note that coherent host/gpu memory is a little
-        // slower, than flushing when needed, but doesnt really matter
-        void* data;
-        vkMapMemory(logicalDevice, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, vertices.data(), (size_t) bufferSize);
-        vkUnmapMemory(logicalDevice, stagingBufferMemory);
+    // Note: buffers are sub-allocated out of large blocks by the allocator (see
+    // memory_allocator.hpp), instead of calling vkAllocateMemory for each individual buffer.
+    bool createVertexBuffer(const void* vertices, uint32_t vertexCount, uint32_t stride, Mesh& mesh) {
+        VkDeviceSize bufferSize = VkDeviceSize(vertexCount) * stride;
 
         if (!createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory))
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.vertexBuffer, mesh.vertexAllocation))
             return false;
+        mesh.vertexCount = vertexCount;
 
-        copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-        vkDestroyBuffer(logicalDevice, stagingBuffer, nullptr);
-        vkFreeMemory(logicalDevice, stagingBufferMemory, nullptr);
-
-        return true;
+        // the data goes through the staging ring, and gets copied over with the next batch
+        return uploadToBuffer(mesh.vertexBuffer, 0, vertices, bufferSize);
     }
 
-    bool createIndexBuffer() {
-        VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+    bool createIndexBuffer(const void* indices, uint32_t indexCount, VkIndexType indexType, Mesh& mesh) {
+        VkDeviceSize indexSize = indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+        VkDeviceSize bufferSize = indexSize * indexCount;
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        if (!createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory))
+        if (!createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.indexBuffer, mesh.indexAllocation))
             return false;
 
-        // actually fill the buffer with data. Note that coherent host/gpu memory is a little
-        // slower, than flushing when needed, but doesnt really matter
-        void* data;
-        vkMapMemory(logicalDevice, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, indices.data(), (size_t) bufferSize);
-        vkUnmapMemory(logicalDevice, stagingBufferMemory);
+        mesh.indexCount = indexCount;
+        mesh.indexType = indexType;
 
-        if (!createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory))
+        // the data goes through the staging ring, and gets copied over with the next batch
+        return uploadToBuffer(mesh.indexBuffer, 0, indices, bufferSize);
+    }
+
+    bool createMesh(const MeshData& data, Mesh& mesh, const VertexLayout& layout) {
+        if (data.vertices.empty() || data.indices.empty())
             return false;
+        if (!getVertexLayoutPipeline(layout, mesh.pipelineIndex))
+            return false;
+        mesh.quantized = layout.hasQuantizedPosition();
+        mesh.dequantize = layout.dequantizeTransform(data.boundsMin, data.boundsMax);
+        mesh.boundsMin = data.boundsMin;
+        mesh.boundsMax = data.boundsMax;
+        std::vector<uint8_t> vertices(data.vertices.size() * size_t(layout.stride()));
+        layout.encode(data.vertices.data(), data.vertices.size(), data.boundsMin, data.boundsMax, vertices.data());
+
+        // the levels of detail go after the full mesh, in the same index buffer
+        std::vector<uint32_t> allIndices = data.indices;
+        mesh.lods.clear();
+        for (const MeshLod& lod : data.lods) {
+            mesh.lods.push_back({ (uint32_t) allIndices.size(), (uint32_t) lod.indices.size(), lod.error });
+            allIndices.insert(allIndices.end(), lod.indices.begin(), lod.indices.end());
+        }
 
-        copyBuffer(stagingBuffer, indexBuffer, bufferSize);
-        vkDestroyBuffer(logicalDevice, stagingBuffer, nullptr);
-        vkFreeMemory(logicalDevice, stagingBufferMemory, nullptr);
+        // 16 bit indices halve the index fetch bandwidth, so use them whenever every vertex fits
+        bool narrow = data.vertices.size() <= 0x10000;
+        std::vector<uint16_t> narrowIndices;
+        if (narrow)
+            narrowIndices.assign(allIndices.begin(), allIndices.end());
+        const void* indices = narrow ? (const void*) narrowIndices.data() : (const void*) allIndices.data();
+
+        if (createVertexBuffer(vertices.data(), (uint32_t) data.vertices.size(), layout.stride(), mesh) &&
+                createIndexBuffer(indices, (uint32_t) allIndices.size(),
+                                  narrow ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32, mesh)) {
+            mesh.indexCount = (uint32_t) data.indices.size();
+            return true;
+        }
+        destroyMesh(mesh);
+        return false;
+    }
 
-        return true;
+    bool createMesh(const MeshCache& cache, Mesh& mesh) {
+        const MeshCacheHeader& header = cache.header();
+        VertexLayout layout;
+        if (!cache.getVertexLayout(layout)) {
+            std::cout << "Mesh file has a vertex layout the pipeline can't draw" << std::endl;
+            return false;
+        }
+        if (header.vertexCount == 0 || header.indexCount == 0)
+            return false;
+        if (!getVertexLayoutPipeline(layout, mesh.pipelineIndex))
+            return false;
+        mesh.quantized = layout.hasQuantizedPosition();
+        mesh.boundsMin = glm::make_vec3(header.boundsMin);
+        mesh.boundsMax = glm::make_vec3(header.boundsMax);
+        mesh.dequantize = layout.dequantizeTransform(mesh.boundsMin, mesh.boundsMax);
+
+        mesh.lods.clear();
+        for (uint32_t i = 1; i < header.lodCount; ++i)
+            mesh.lods.push_back({ header.lods[i].firstIndex, header.lods[i].indexCount, header.lods[i].error });
+
+        // straight from the mapping into the staging ring, nothing is parsed or converted
+        if (createVertexBuffer(cache.vertexData(), header.vertexCount, header.vertexStride, mesh) &&
+                createIndexBuffer(cache.indexData(), header.indexCount, (VkIndexType) header.indexType, mesh)) {
+            // the blob holds every level, the full mesh is the first
+            mesh.indexCount = header.lods[0].indexCount;
+            return true;
+        }
+        destroyMesh(mesh);
+        return false;
     }
 
-    bool createUniformBuffers() {
-        VkDeviceSize bufferSize = sizeof(UBO);
-        uniformBuffers.resize(swapChainImages.size());
-        uniformBuffersMemory.resize(swapChainImages.size());
+    void destroyMesh(Mesh& mesh) {
+        if (mesh.vertexBuffer != VK_NULL_HANDLE)
+            destroyBuffer(mesh.vertexBuffer, mesh.vertexAllocation);
+        if (mesh.indexBuffer != VK_NULL_HANDLE)
+            destroyBuffer(mesh.indexBuffer, mesh.indexAllocation);
+        mesh = Mesh();
+    }
 
-        for (int i = 0; i < swapChainImages.size(); ++i) {
-            if (!createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i], uniformBuffersMemory[i]))
-                return false;
-        }
-        return true;
+    bool createQuadMesh() {
+        MeshData quad;
+        quad.vertices = vertices;
+        quad.indices = indices;
+        quad.boundsMin = glm::vec3(-0.5f, -0.5f, 0.0f);
+        quad.boundsMax = glm::vec3(0.5f, 0.5f, 0.0f);
+        return createMesh(quad, quadMesh);
     }
 
     /** Descriptors cant be created directly. Like command buffers, they must be allocated from
@@ -1095,130 +1526,324 @@ namespace graphics {
      */
     bool createDescriptorPool() {
         VkDescriptorPoolSize poolSize = {};
-        poolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        poolSize.descriptorCount = swapChainImages.size(); // one descriptor per frame
+        poolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        poolSize.descriptorCount = 1; // the uniform ring, shared by all frames
 
         VkDescriptorPoolCreateInfo poolInfo = {};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
         poolInfo.poolSizeCount = 1;
         poolInfo.pPoolSizes = &poolSize;
-        poolInfo.maxSets = swapChainImages.size();
+        poolInfo.maxSets = 1;
 
         return vkCreateDescriptorPool(logicalDevice, &poolInfo, nullptr, &descriptorPool) == VK_SUCCESS;
     }
 
     bool createDescriptorSets() {
         // specify the pool to allocate from, number of sets, and the layout of them
-        std::vector<VkDescriptorSetLayout> layouts(swapChainImages.size(), descriptorSetLayout);
         VkDescriptorSetAllocateInfo allocInfo = {};
         allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
         allocInfo.descriptorPool = descriptorPool;
-        allocInfo.descriptorSetCount = swapChainImages.size();
-        allocInfo.pSetLayouts = layouts.data();
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &descriptorSetLayout;
 
-        descriptorSets.resize(swapChainImages.size());
-        if (vkAllocateDescriptorSets(logicalDevice, &allocInfo, descriptorSets.data()) != VK_SUCCESS)
+        if (vkAllocateDescriptorSets(logicalDevice, &allocInfo, &descriptorSet) != VK_SUCCESS)
             return false;
 
-        // allocate now, but need to configure and populate them
-        for (size_t i = 0; i < swapChainImages.size(); ++i) {
-            VkDescriptorBufferInfo bufferInfo = {};
-            bufferInfo.buffer = uniformBuffers[i];
-            bufferInfo.offset = 0;
-            bufferInfo.range = sizeof(UBO);
+        // allocate now, but need to configure and populate it. The offset stays 0, and which
+        // UBO in the ring gets read is picked by the dynamic offset when binding
+        VkDescriptorBufferInfo bufferInfo = {};
+        bufferInfo.buffer = getUniformRingBuffer();
+        bufferInfo.offset = 0;
+        bufferInfo.range = sizeof(UBO);
 
-            VkWriteDescriptorSet descriptorWrite = {};
-            descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptorWrite.dstSet = descriptorSets[i]; // set to update
-            descriptorWrite.dstBinding = 0; // binding of set
-            descriptorWrite.dstArrayElement = 0; // index into array (0, since we have no array)
-            descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-            descriptorWrite.descriptorCount = 1;
-            descriptorWrite.pBufferInfo = &bufferInfo;
+        VkWriteDescriptorSet descriptorWrite = {};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = descriptorSet; // set to update
+        descriptorWrite.dstBinding = 0; // binding of set
+        descriptorWrite.dstArrayElement = 0; // index into array (0, since we have no array)
+        descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        descriptorWrite.descriptorCount = 1;
+        descriptorWrite.pBufferInfo = &bufferInfo;
 
-            vkUpdateDescriptorSets(logicalDevice, 1, &descriptorWrite, 0, nullptr);
-        }
+        vkUpdateDescriptorSets(logicalDevice, 1, &descriptorWrite, 0, nullptr);
 
         return true;
     }
 
-    /** \brief Create a command buffer for each framebuffer.
-     *
-     * Need a buffer for each framebuffer. This also currently records the draw operations too.
+    /** Allocate a primary command buffer out of each frame's command pool, and a secondary
+     * one out of each of the frame's worker pools.
      */
     bool createCommandBuffers() {
-        commandBuffers.resize(swapChainFramebuffers.size());
+        commandBuffers.resize(framesInFlight);
+        workerCommandBuffers.resize(framesInFlight);
 
         VkCommandBufferAllocateInfo allocInfo = {};
         allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.commandPool = commandPool;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandBufferCount = (uint32_t) commandBuffers.size();
+        allocInfo.commandBufferCount = 1;
 
-        if (vkAllocateCommandBuffers(logicalDevice, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
-            return false;
+        for (uint32_t i = 0; i < framesInFlight; ++i) {
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandPool = frameCommandPools[i];
+            if (vkAllocateCommandBuffers(logicalDevice, &allocInfo, &commandBuffers[i]) != VK_SUCCESS)
+                return false;
 
-        for (size_t i = 0; i < commandBuffers.size(); i++) {
-            // being recording
-            VkCommandBufferBeginInfo beginInfo = {};
-            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-            beginInfo.pInheritanceInfo = nullptr; // Optional
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            workerCommandBuffers[i].resize(workerCommandPools[i].size());
+            for (size_t t = 0; t < workerCommandPools[i].size(); ++t) {
+                allocInfo.commandPool = workerCommandPools[i][t];
+                if (vkAllocateCommandBuffers(logicalDevice, &allocInfo, &workerCommandBuffers[i][t]) != VK_SUCCESS)
+                    return false;
+            }
+        }
+        return true;
+    }
 
-            if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) != VK_SUCCESS)
-                return false;
+    void submitDraw(const Mesh& mesh, const glm::mat4& model) {
+        drawList.push_back({ &mesh, model, 0 });
+    }
+
+    void submitCulledDraw(const Mesh& mesh, const glm::mat4& model, uint32_t lod) {
+        culledDrawList.push_back({ &mesh, model, lod });
+    }
+
+    void submitInstances(const Mesh& mesh, const glm::mat4* models, uint32_t count) {
+        if (count == 0)
+            return;
+        instancedDrawList.push_back({ &mesh, static_cast<uint32_t>(instanceTransforms.size()), count });
+        instanceTransforms.insert(instanceTransforms.end(), models, models + count);
+    }
 
-            // specify which render pass, which framebuffer, where shader loads start, and size
-            VkRenderPassBeginInfo renderPassInfo = {};
-            renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-            renderPassInfo.renderPass = renderPass;
-            renderPassInfo.framebuffer = swapChainFramebuffers[i];
-            renderPassInfo.renderArea.offset = {0, 0};
-            renderPassInfo.renderArea.extent = swapChainExtent;
-
-            VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
-            renderPassInfo.clearValueCount = 1;
-            renderPassInfo.pClearValues = &clearColor;
-
-            // submit commands: start pass, bind pipeline, draw, end pass
-            vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-                vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-                VkBuffer vertexBuffers[] = {vertexBuffer};
-                VkDeviceSize offsets[] = {0};
-                vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
-                vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
-                        pipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
-                vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0, VK_INDEX_TYPE_UINT16);
-                // vkCmdDraw(commandBuffers[i], vertices.size(), 1, 0, 0);
-                vkCmdDrawIndexed(commandBuffers[i], indices.size(), 1, 0, 0, 0);
-            vkCmdEndRenderPass(commandBuffers[i]);
-            if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS)
+    void submitGpuScene(GpuScene& scene) {
+        gpuSceneList.push_back(&scene);
+    }
+
+    void getCameraMatrices(glm::mat4& view, glm::mat4& proj) {
+        view = glm::lookAt(glm::vec3(2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+        proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float) swapChainExtent.height, 0.1f, 10.0f);
+        proj[1][1] *= -1; // Vulkan's y points down
+    }
+
+    float lodPixelScale(const glm::mat4& proj) {
+        // proj[1][1] is 1 / tan(fovy / 2), the half height of the screen at distance one
+        return std::abs(proj[1][1]) * 0.5f * swapChainExtent.height;
+    }
+
+    uint32_t selectLod(const Mesh& mesh, const glm::mat4& model, const glm::vec3& camera, float pixelScale, uint32_t current) {
+        if (mesh.lods.empty())
+            return 0;
+        glm::vec3 center, halfExtent;
+        transformBox(model, mesh.boundsMin, mesh.boundsMax, center, halfExtent);
+        float distance = glm::length(center - camera) - glm::length(halfExtent);
+        if (distance <= 0.0f)
+            return 0;
+        // the errors are in the mesh's units, which the model matrix stretches by up to its longest axis
+        float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+        float pixelsPerUnit = scale * pixelScale / distance;
+
+        uint32_t lod = 0;
+        for (uint32_t level = 1; level <= mesh.lods.size(); ++level) {
+            float limit = level > current ? lodPixelError * (1.0f - LOD_HYSTERESIS) : lodPixelError;
+            if (mesh.lods[level - 1].error * pixelsPerUnit > limit)
+                break;
+            lod = level;
+        }
+        return lod;
+    }
+
+    FrameStats getFrameStats() {
+        return frameStats;
+    }
+
+    /** \brief Record the current frame's draw list, targeting the given swap image.
+     *
+     * Draws outside the view frustum are culled first. Each remaining draw gets its own UBO
+     * out of the uniform ring, and the vertex / index buffers are only rebound when the mesh
+     * changes. Large draw lists are split into slices that the worker threads record into
+     * secondary command buffers in parallel, which the primary command buffer then executes.
+     * The frame's pools must already have been reset.
+     */
+    bool recordCommandBuffer(VkCommandBuffer cmd, uint32_t imageIndex) {
+        glm::mat4 view, proj;
+        getCameraMatrices(view, proj);
+
+        if (frustumCulling && !drawList.empty())
+            cullDrawList(proj * view);
+        if (levelOfDetail && !drawList.empty())
+            selectDrawListLods(view, proj);
+
+        // GpuScenes bring their buffers up to date here, or get culled on the CPU if the GPU
+        // can't do it, in which case their draws join the already culled ones
+        bool occlusion = false;
+        if (!gpuSceneList.empty()) {
+            Frustum frustum = extractFrustum(proj * view);
+            bool onGpu = gpuDrivenRendering && gpuDrivenSupported();
+            occlusion = onGpu && occlusionCulling && occlusionCullingSupported();
+            size_t prepared = 0;
+            for (GpuScene* scene : gpuSceneList) {
+                if (!onGpu) {
+                    scene->submitVisible(frustum);
+                } else if (scene->prepareFrame(static_cast<uint32_t>(currentFrame), frustum, proj * view, occlusion)) {
+                    gpuSceneList[prepared++] = scene;
+                    frameStats.gpuObjects += scene->size();
+                }
+            }
+            gpuSceneList.resize(prepared);
+        }
+        bool drawGpuScenes = !gpuSceneList.empty();
+        occlusion = occlusion && drawGpuScenes;
+        drawList.insert(drawList.end(), culledDrawList.begin(), culledDrawList.end());
+
+        // the instance transforms go into the ring up front, so any thread can record the draws
+        uint32_t instanceOffset = 0;
+        bool drawInstances = !instancedDrawList.empty() && uploadInstances(instanceOffset);
+
+        uint32_t slices = static_cast<uint32_t>(std::min<size_t>(workerThreadCount(), drawList.size() / MIN_DRAWS_PER_THREAD));
+        bool useSecondaries = slices > 1;
+
+        // the slices get recorded first, since the primary just has to execute them
+        std::vector<VkCommandBuffer>& secondaries = workerCommandBuffers[currentFrame];
+        if (useSecondaries) {
+            // secondaries don't inherit any state, so each one sets up the pipeline on its own
+            VkCommandBufferInheritanceInfo inheritanceInfo = {};
+            inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+            inheritanceInfo.renderPass = renderPass;
+            inheritanceInfo.subpass = 0;
+            inheritanceInfo.framebuffer = swapChainFramebuffers[imageIndex];
+
+            std::vector<char> sliceRecorded(slices, 0);
+            size_t sliceSize = (drawList.size() + slices - 1) / slices;
+            runOnWorkers(slices, [&](uint32_t slice, uint32_t) {
+                // every slice has its own pool, so no two threads ever record into the same one
+                VkCommandBuffer secondary = secondaries[slice];
+                VkCommandBufferBeginInfo secondaryBeginInfo = {};
+                secondaryBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                secondaryBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                    VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+                secondaryBeginInfo.pInheritanceInfo = &inheritanceInfo;
+                if (vkBeginCommandBuffer(secondary, &secondaryBeginInfo) != VK_SUCCESS)
+                    return;
+
+                size_t begin = slice * sliceSize;
+                recordDraws(secondary, begin, std::min(begin + sliceSize, drawList.size()), view, proj);
+                // the instanced draws are only a handful of commands, they ride along with the last slice
+                if (drawInstances && slice == slices - 1)
+                    recordInstancedDraws(secondary, instanceOffset, view, proj);
+                if (drawGpuScenes && slice == slices - 1)
+                    recordGpuSceneDraws(secondary, view, proj, false);
+                sliceRecorded[slice] = vkEndCommandBuffer(secondary) == VK_SUCCESS;
+            });
+            if (std::find(sliceRecorded.begin(), sliceRecorded.end(), 0) != sliceRecorded.end())
                 return false;
         }
 
-        return true;
+        // being recording
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        beginInfo.pInheritanceInfo = nullptr; // Optional
+
+        if (vkBeginCommandBuffer(cmd, &beginInfo) != VK_SUCCESS)
+            return false;
+        beginGpuFrame(cmd, currentFrame);
+        uint32_t frameScope = beginGpuScope(cmd, "frame");
+
+        // compute can't run inside a render pass, so the culling goes first
+        if (drawGpuScenes) {
+            GpuScope cullScope(cmd, "gpu culling");
+            for (GpuScene* scene : gpuSceneList)
+                scene->recordCulling(cmd, static_cast<uint32_t>(currentFrame), occlusion ? CullPhase::Prepass : CullPhase::Frustum);
+        }
+
+        // with occlusion culling, what was visible last frame is drawn into the depth buffer,
+        // which the Hi-Z pyramid is built from, and everything is then culled again against it
+        VkClearValue clearValues[2] = {};
+        clearValues[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}};
+        clearValues[1].depthStencil = {1.0f, 0};
+        if (occlusion) {
+            {
+                GpuScope prepassScope(cmd, "depth prepass");
+                VkRenderPassBeginInfo prepassInfo = {};
+                prepassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+                prepassInfo.renderPass = depthPrepassRenderPass;
+                prepassInfo.framebuffer = depthPrepassFramebuffer;
+                prepassInfo.renderArea.offset = {0, 0};
+                prepassInfo.renderArea.extent = swapChainExtent;
+                prepassInfo.clearValueCount = 1;
+                prepassInfo.pClearValues = &clearValues[1];
+                vkCmdBeginRenderPass(cmd, &prepassInfo, VK_SUBPASS_CONTENTS_INLINE);
+                recordGpuSceneDraws(cmd, view, proj, true);
+                vkCmdEndRenderPass(cmd);
+            }
+            {
+                GpuScope hizScope(cmd, "hi-z build");
+                recordHiZBuild(cmd);
+            }
+            GpuScope cullScope(cmd, "occlusion culling");
+            for (GpuScene* scene : gpuSceneList)
+                scene->recordCulling(cmd, static_cast<uint32_t>(currentFrame), CullPhase::Occlusion);
+        }
+
+        // specify which render pass, which framebuffer, where shader loads start, and size.
+        // The secondaries were recorded against renderPass, which depthLoadRenderPass is
+        // compatible with
+        VkRenderPassBeginInfo renderPassInfo = {};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = occlusion ? depthLoadRenderPass : renderPass;
+        renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+        renderPassInfo.renderArea.offset = {0, 0};
+        renderPassInfo.renderArea.extent = swapChainExtent;
+        renderPassInfo.clearValueCount = 2;
+        renderPassInfo.pClearValues = clearValues;
+
+        // submit commands: start pass, draw everything in the list, end pass. The timestamps
+        // go outside the pass, since a pass with secondary contents can only execute commands
+        {
+            GpuScope passScope(cmd, "main pass");
+            if (useSecondaries) {
+                vkCmdBeginRenderPass(cmd, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+                vkCmdExecuteCommands(cmd, slices, secondaries.data());
+            } else {
+                vkCmdBeginRenderPass(cmd, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+                recordDraws(cmd, 0, drawList.size(), view, proj);
+                if (drawInstances)
+                    recordInstancedDraws(cmd, instanceOffset, view, proj);
+                if (drawGpuScenes)
+                    recordGpuSceneDraws(cmd, view, proj, false);
+            }
+            vkCmdEndRenderPass(cmd);
+        }
+
+        if (headless) {
+            GpuScope readbackScope(cmd, "readback");
+            recordReadback(cmd, imageIndex, currentFrame);
+        }
+
+        endGpuScope(cmd, frameScope);
+        return vkEndCommandBuffer(cmd) == VK_SUCCESS;
     }
 
     /** Need to create synchronization objects to stop finish rendering a frame before going to the
      * next. Create semaphores for each frame, so that the GPU can work on more than 1 frame, but
-     * also while bounding the amount of work to MAX_FRAMES_IN_FLIGHT
+     * also while bounding the amount of work to framesInFlight
      */
     bool createSyncObjects() {
-        imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+        imageAvailableSemaphores.resize(framesInFlight);
+        renderFinishedSemaphores.resize(framesInFlight);
+        inFlightFences.resize(framesInFlight);
+        // which frame's fence is using each swap image (VK_NULL_HANDLE if none)
+        imagesInFlight.assign(swapChainImages.size(), VK_NULL_HANDLE);
 
         VkSemaphoreCreateInfo semaphoreInfo = {};
         semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-        // need a fence to actually block the CPU from submitting more than MAX_FRAMES_IN_FLIGHT
+        // need a fence to actually block the CPU from submitting more than framesInFlight
         // to the GPU
         VkFenceCreateInfo fenceInfo = {};
         fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
         fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
 
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        for (size_t i = 0; i < framesInFlight; i++) {
             if (vkCreateSemaphore(logicalDevice, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
                 vkCreateSemaphore(logicalDevice, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
                 vkCreateFence(logicalDevice, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS)
@@ -1234,29 +1859,51 @@ namespace graphics {
     void cleanupSwapChain() {
         for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
             vkDestroyFramebuffer(logicalDevice, swapChainFramebuffers[i], nullptr);
-            vkDestroyBuffer(logicalDevice, uniformBuffers[i], nullptr);
-            vkFreeMemory(logicalDevice, uniformBuffersMemory[i], nullptr);
         }
-        vkDestroyDescriptorPool(logicalDevice, descriptorPool, nullptr);
-
-        vkFreeCommandBuffers(logicalDevice, commandPool, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
-
-        vkDestroyPipeline(logicalDevice, graphicsPipeline, nullptr);
-        vkDestroyPipelineLayout(logicalDevice, pipelineLayout, nullptr);
-        vkDestroyRenderPass(logicalDevice, renderPass, nullptr);
+        vkDestroyFramebuffer(logicalDevice, depthPrepassFramebuffer, nullptr);
 
         for (size_t i = 0; i < swapChainImageViews.size(); i++) {
             vkDestroyImageView(logicalDevice, swapChainImageViews[i], nullptr);
         }
 
-        vkDestroySwapchainKHR(logicalDevice, swapChain, nullptr);
+        // the depth buffer and its pyramid have the size of the swap images
+        destroyHiZPyramid();
+        vkDestroyImageView(logicalDevice, depthImageView, nullptr);
+        vkDestroyImage(logicalDevice, depthImage, nullptr);
+        freeMemory(depthAllocation);
+
+        // the swap chain itself is kept alive, so it can be handed off to the next one
+    }
+
+    /** Destroy the render pass and the pipelines that were created for it. */
+    void cleanupRenderPass() {
+        for (VkPipeline pipeline : graphicsPipelines)
+            vkDestroyPipeline(logicalDevice, pipeline, nullptr);
+        for (VkPipeline pipeline : instancedPipelines)
+            vkDestroyPipeline(logicalDevice, pipeline, nullptr);
+        for (VkPipeline pipeline : depthPipelines)
+            vkDestroyPipeline(logicalDevice, pipeline, nullptr);
+        graphicsPipelines.clear();
+        instancedPipelines.clear();
+        depthPipelines.clear();
+        vkDestroyPipelineLayout(logicalDevice, pipelineLayout, nullptr);
+        vkDestroyRenderPass(logicalDevice, renderPass, nullptr);
+        vkDestroyRenderPass(logicalDevice, depthLoadRenderPass, nullptr);
+        vkDestroyRenderPass(logicalDevice, depthPrepassRenderPass, nullptr);
     }
 
     /** \brief Recreate the swap chain when it becomes invalid.
      *
-     * The swap chain can become invalid from operations such as window resizing.
+     * The swap chain can become invalid from operations such as window resizing. Only the
+     * objects that depend on the swap chain images are rebuilt. The viewport and scissor are
+     * dynamic state, so the pipeline survives a resize, and the render pass (plus the
+     * pipelines built against it) only gets rebuilt if the image format actually changed.
+     * The uniform ring, descriptors and command buffers are per frame in flight, not per swap
+     * image, so they are left alone. Returns false if anything fails to be recreated, in which
+     * case no frame can be drawn any more.
      */
-    void recreateSwapChain() {
+    bool recreateSwapChain() {
+        PROFILE_SCOPE("recreateSwapChain");
         SW = 0; SH = 0;
         while (SW == 0 || SH == 0) {
             glfwGetFramebufferSize(window, &SW, &SH);
@@ -1266,53 +1913,134 @@ namespace graphics {
 
         vkDeviceWaitIdle(logicalDevice);
 
+        VkFormat oldFormat = swapChainImageFormat;
         cleanupSwapChain();
 
-        createSwapChain();
-        createImageViews(); // because of new images and image sizes
-        createRenderPass(); // because this relies on the image formats (rare that it changes)
-        createGraphicsPipeline(); // viewport and scissor size change (could handle w/dynamic state)
-        createUniformBuffers(); // because the number of swap chain images could change someday
-        createDescriptorPool(); // relies on number of swap images
-        createDescriptorSets(); // relies on number of swap images
-        createFramebuffers(); // directly relies on swap images
-        createCommandBuffers(); // directly relies on swap images
+        // the old swap chain is passed along to the new one, so the presentation engine can
+        // reuse its resources, and then it can be destroyed
+        VkSwapchainKHR oldSwapChain = swapChain;
+        bool created = createSwapChain();
+        vkDestroySwapchainKHR(logicalDevice, oldSwapChain, nullptr);
+        // because of new images and image sizes
+        if (!created || !createImageViews() || !createDepthResources())
+            return false;
+        imagesInFlight.assign(swapChainImages.size(), VK_NULL_HANDLE);
+
+        if (swapChainImageFormat != oldFormat) {
+            cleanupRenderPass();
+            if (!createRenderPass() || !createGraphicsPipeline())
+                return false;
+        }
+
+        return createFramebuffers() && createHiZPyramid(); // directly rely on swap images
     }
 
-    void updateUniformBuffer(uint32_t currentImage) {
-        static auto startTime = std::chrono::high_resolution_clock::now();
-        auto currentTime = std::chrono::high_resolution_clock::now();
-        float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
-
-        UBO ubo = {};
-        ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-        ubo.view = glm::lookAt(glm::vec3(2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-        ubo.proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float) swapChainExtent.height, 0.1f, 10.0f);
-        ubo.proj[1][1] *= -1;
-
-        void* data;
-        vkMapMemory(logicalDevice, uniformBuffersMemory[currentImage], 0, sizeof(ubo), 0, &data);
-        memcpy(data, &ubo, sizeof(ubo));
-        vkUnmapMemory(logicalDevice, uniformBuffersMemory[currentImage]);
+    /** Reset the current frame's pools and record its draw list, timing how long it takes.
+     * Everything indexed by currentFrame is free to touch, since its fence has signaled.
+     */
+    bool recordFrame(uint32_t imageIndex) {
+        PROFILE_SCOPE("record");
+        auto recordStart = std::chrono::high_resolution_clock::now();
+        vkResetCommandPool(logicalDevice, frameCommandPools[currentFrame], 0);
+        for (auto pool : workerCommandPools[currentFrame])
+            vkResetCommandPool(logicalDevice, pool, 0);
+        beginUniformFrame(currentFrame);
+        bool recorded = recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+        auto recordEnd = std::chrono::high_resolution_clock::now();
+
+        frameStats.frames++;
+        frameStats.draws += drawList.size() + instancedDrawList.size();
+        for (const DrawCommand& draw : drawList) {
+            frameStats.triangles += lodRange(*draw.mesh, draw.lod).indexCount / 3;
+            frameStats.coarseDraws += draw.lod != 0;
+        }
+        for (GpuScene* scene : gpuSceneList)
+            frameStats.draws += scene->stats().drawCalls;
+        frameStats.instances += instanceTransforms.size();
+        frameStats.lastRecordMilliseconds = std::chrono::duration<double, std::milli>(recordEnd - recordStart).count();
+        frameStats.recordMilliseconds += frameStats.lastRecordMilliseconds;
+        drawList.clear();
+        culledDrawList.clear();
+        instancedDrawList.clear();
+        instanceTransforms.clear();
+        gpuSceneList.clear();
+        return recorded;
+    }
+
+    /** \brief drawFrame for headless mode, called once the frame's fence has signaled.
+     *
+     * Each frame in flight renders into its own offscreen target, so there is nothing to
+     * acquire or present, and no semaphores to wait on. The only thing bounding throughput is
+     * the frame fences, and the readback of a frame is picked up framesInFlight frames later.
+     */
+    bool drawHeadlessFrame() {
+        {
+            PROFILE_SCOPE("readback");
+            deliverReadback(currentFrame);
+        }
+
+        uint32_t imageIndex = static_cast<uint32_t>(currentFrame);
+        if (!recordFrame(imageIndex))
+            return false;
+
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+
+        PROFILE_SCOPE("submit");
+        vkResetFences(logicalDevice, 1, &inFlightFences[currentFrame]);
+        if (!flushUploads() || vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS)
+            return false;
+
+        currentFrame = (currentFrame + 1) % framesInFlight;
+        return true;
     }
 
     bool drawFrame() {
-        vkWaitForFences(logicalDevice, 1, &inFlightFences[currentFrame], VK_TRUE, std::numeric_limits<uint64_t>::max());
+        PROFILE_SCOPE("drawFrame");
+        {
+            // time spent here means the CPU got ahead of the GPU
+            PROFILE_SCOPE("fence wait");
+            vkWaitForFences(logicalDevice, 1, &inFlightFences[currentFrame], VK_TRUE, std::numeric_limits<uint64_t>::max());
+        }
+
+        // the frame this slot rendered last time is done, so its pixels can be handed over
+        if (headless)
+            return drawHeadlessFrame();
 
         // get the next image in the swap chain
         uint32_t imageIndex;
-        VkResult result = vkAcquireNextImageKHR(logicalDevice, swapChain, std::numeric_limits<uint64_t>::max(),
-                              imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
-        
+        VkResult result;
+        {
+            PROFILE_SCOPE("acquire");
+            result = vkAcquireNextImageKHR(logicalDevice, swapChain, std::numeric_limits<uint64_t>::max(),
+                         imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+        }
+
         if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-            recreateSwapChain();
-            return true;
+            // the frame is skipped, the next one submits its own draws
+            drawList.clear();
+            culledDrawList.clear();
+            instancedDrawList.clear();
+            instanceTransforms.clear();
+            gpuSceneList.clear();
+            return recreateSwapChain();
         } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
             return false;
         }
 
-        updateUniformBuffer(imageIndex);
-        
+        // a previous frame might still be rendering to this image (if there are more frames in
+        // flight than swap images, or images are acquired out of order)
+        if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
+            PROFILE_SCOPE("image fence wait");
+            vkWaitForFences(logicalDevice, 1, &imagesInFlight[imageIndex], VK_TRUE, std::numeric_limits<uint64_t>::max());
+        }
+        imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+
+        if (!recordFrame(imageIndex))
+            return false;
+
         // queue submission and synchronization done with VkSubmitInfo
         VkSubmitInfo submitInfo = {};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -1323,7 +2051,7 @@ namespace graphics {
         submitInfo.pWaitSemaphores = waitSemaphores;
         submitInfo.pWaitDstStageMask = waitStages;
         submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+        submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
         // which semaphore to signal once the command buffer(s) are complete
         VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
         submitInfo.signalSemaphoreCount = 1;
@@ -1331,8 +2059,15 @@ namespace graphics {
 
         vkResetFences(logicalDevice, 1, &inFlightFences[currentFrame]);
 
-        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS)
-            return false;
+        {
+            PROFILE_SCOPE("submit");
+            // submit any pending uploads first, so they land before this frame reads the buffers
+            if (!flushUploads())
+                return false;
+
+            if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS)
+                return false;
+        }
 
         // specify what swap chain to present the result to, and what to wait on before presenting
         VkPresentInfoKHR presentInfo = {};
@@ -1345,18 +2080,19 @@ namespace graphics {
         presentInfo.pSwapchains = swapChains;
         presentInfo.pImageIndices = &imageIndex;
 
-        result = vkQueuePresentKHR(presentQueue, &presentInfo);
+        {
+            PROFILE_SCOPE("present");
+            result = vkQueuePresentKHR(presentQueue, &presentInfo);
+        }
         if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
             framebufferResized = false;
-            recreateSwapChain();
+            if (!recreateSwapChain())
+                return false;
         } else if (result != VK_SUCCESS) {
             return false;
         }
 
-        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
-
-        // only needed if validation layers are on
-        vkDeviceWaitIdle(logicalDevice);
+        currentFrame = (currentFrame + 1) % framesInFlight;
 
         return true;
     }
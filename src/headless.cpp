@@ -0,0 +1,141 @@
+#include "headless.hpp"
+#include "graphics_api.hpp"
+
+#include <algorithm>
+
+namespace graphics {
+
+    bool headless = false;
+    ReadbackCallback readbackCallback;
+
+    namespace {
+
+        // the render pass leaves the targets in TRANSFER_SRC_OPTIMAL, ready to copy out of
+        const VkFormat OFFSCREEN_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
+        const uint64_t NO_READBACK = ~0ull;
+
+        std::vector<Allocation> targetAllocations;
+        std::vector<VkBuffer> readbackBuffers;
+        std::vector<Allocation> readbackAllocations;
+        std::vector<uint64_t> pendingReadbacks; // frame number waiting in each buffer
+        uint64_t frameNumber = 0;
+
+    } // namespace anonymous
+
+    bool createOffscreenTargets() {
+        swapChainImageFormat = OFFSCREEN_FORMAT;
+        swapChainExtent = { static_cast<uint32_t>(SW), static_cast<uint32_t>(SH) };
+        swapChainImages.resize(framesInFlight);
+        targetAllocations.resize(framesInFlight);
+
+        VkImageCreateInfo imageInfo = {};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.format = OFFSCREEN_FORMAT;
+        imageInfo.extent = { swapChainExtent.width, swapChainExtent.height, 1 };
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        for (uint32_t i = 0; i < framesInFlight; ++i) {
+            if (vkCreateImage(logicalDevice, &imageInfo, nullptr, &swapChainImages[i]) != VK_SUCCESS)
+                return false;
+
+            VkMemoryRequirements memRequirements;
+            vkGetImageMemoryRequirements(logicalDevice, swapChainImages[i], &memRequirements);
+            if (!allocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, targetAllocations[i]) ||
+                vkBindImageMemory(logicalDevice, swapChainImages[i], targetAllocations[i].memory,
+                                  targetAllocations[i].offset) != VK_SUCCESS)
+                return false;
+        }
+
+        // cached memory makes reading the pixels back on the CPU a lot faster, but isn't
+        // available everywhere
+        VkDeviceSize readbackSize = VkDeviceSize(swapChainExtent.width) * swapChainExtent.height * 4;
+        readbackBuffers.resize(framesInFlight);
+        readbackAllocations.resize(framesInFlight);
+        pendingReadbacks.assign(framesInFlight, NO_READBACK);
+        for (uint32_t i = 0; i < framesInFlight; ++i) {
+            VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+            if (!createBuffer(readbackSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, properties | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                              readbackBuffers[i], readbackAllocations[i]) &&
+                !createBuffer(readbackSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, properties, readbackBuffers[i], readbackAllocations[i]))
+                return false;
+        }
+
+        frameNumber = 0;
+        return true;
+    }
+
+    void destroyOffscreenTargets() {
+        for (size_t i = 0; i < swapChainImages.size(); ++i) {
+            vkDestroyImage(logicalDevice, swapChainImages[i], nullptr);
+            freeMemory(targetAllocations[i]);
+        }
+        swapChainImages.clear();
+        targetAllocations.clear();
+
+        for (size_t i = 0; i < readbackBuffers.size(); ++i)
+            destroyBuffer(readbackBuffers[i], readbackAllocations[i]);
+        readbackBuffers.clear();
+        readbackAllocations.clear();
+    }
+
+    void recordReadback(VkCommandBuffer cmd, uint32_t imageIndex, uint32_t frameIndex) {
+        uint64_t frame = frameNumber++;
+        if (!readbackCallback)
+            return;
+
+        // the render pass already moved the image to TRANSFER_SRC_OPTIMAL, but its writes
+        // still need to be made visible to the copy
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = swapChainImages[imageIndex];
+        barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        VkBufferImageCopy region = {};
+        region.bufferOffset = 0;
+        region.bufferRowLength = 0; // tightly packed
+        region.bufferImageHeight = 0;
+        region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        region.imageOffset = { 0, 0, 0 };
+        region.imageExtent = { swapChainExtent.width, swapChainExtent.height, 1 };
+        vkCmdCopyImageToBuffer(cmd, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            readbackBuffers[frameIndex], 1, &region);
+
+        // and the copy has to be made visible to the host before the frame's fence signals
+        VkMemoryBarrier hostBarrier = {};
+        hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+            0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+
+        pendingReadbacks[frameIndex] = frame;
+    }
+
+    void deliverReadback(uint32_t frameIndex) {
+        if (frameIndex >= pendingReadbacks.size() || pendingReadbacks[frameIndex] == NO_READBACK)
+            return;
+
+        uint64_t frame = pendingReadbacks[frameIndex];
+        pendingReadbacks[frameIndex] = NO_READBACK;
+        if (readbackCallback) {
+            readbackCallback(static_cast<const uint8_t*>(readbackAllocations[frameIndex].mappedData),
+                             swapChainExtent.width, swapChainExtent.height, frame);
+        }
+    }
+
+} // namespace graphics
@@ -0,0 +1,282 @@
+#include "hiz_pyramid.hpp"
+#include "graphics_api.hpp"
+#include "shaders/hiz_comp.hpp"
+
+#include <chrono>
+
+namespace graphics {
+
+    namespace {
+
+        const VkFormat HIZ_FORMAT = VK_FORMAT_R32_SFLOAT;
+
+        /** Push constants of hiz.comp. */
+        struct HiZConstants {
+            glm::ivec2 sourceSize;
+            glm::ivec2 destinationSize;
+        };
+
+        bool supported = false;
+        VkDescriptorSetLayout hizSetLayout = VK_NULL_HANDLE;
+        VkPipelineLayout hizPipelineLayout = VK_NULL_HANDLE;
+        VkPipeline hizPipeline = VK_NULL_HANDLE;
+
+        HiZPyramid pyramid;
+        VkImage hizImage = VK_NULL_HANDLE;
+        Allocation hizAllocation;
+        std::vector<VkImageView> levelViews;
+        VkDescriptorPool hizDescriptorPool = VK_NULL_HANDLE;
+        std::vector<VkDescriptorSet> levelSets; // level i reads level i - 1, or the depth buffer
+
+        bool formatHas(VkFormat format, VkFormatFeatureFlags features) {
+            VkFormatProperties properties;
+            vkGetPhysicalDeviceFormatProperties(physicalDeviceInfo.device, format, &properties);
+            return (properties.optimalTilingFeatures & features) == features;
+        }
+
+        bool createView(uint32_t baseLevel, uint32_t levelCount, VkImageView& view) {
+            VkImageViewCreateInfo viewInfo = {};
+            viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            viewInfo.image = hizImage;
+            viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            viewInfo.format = HIZ_FORMAT;
+            viewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, baseLevel, levelCount, 0, 1 };
+            return vkCreateImageView(logicalDevice, &viewInfo, nullptr, &view) == VK_SUCCESS;
+        }
+
+        /** \brief Size of level 0 of the image, so that every level of the pyramid fits its mip.
+         *
+         * Mips halve rounding down while the pyramid's levels round up, so the image is padded
+         * to a multiple of the last level's texel size. The padding is never read or written.
+         */
+        uint32_t paddedSize(uint32_t size, uint32_t levels) {
+            return hizLevelSize(size, levels - 1) << (levels - 1);
+        }
+
+    } // namespace anonymous
+
+    bool createHiZPipeline() {
+        supported = formatHas(depthFormat, VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) &&
+                    formatHas(HIZ_FORMAT, VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT);
+        if (!supported)
+            return true; // not an error, GpuScenes just skip occlusion culling
+
+        // binding 0 is the level below (or the depth buffer), binding 1 the level being built
+        VkDescriptorSetLayoutBinding bindings[2] = {};
+        bindings[0].binding = 0;
+        bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        bindings[0].descriptorCount = 1;
+        bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        bindings[1].binding = 1;
+        bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        bindings[1].descriptorCount = 1;
+        bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = 2;
+        layoutInfo.pBindings = bindings;
+        if (vkCreateDescriptorSetLayout(logicalDevice, &layoutInfo, nullptr, &hizSetLayout) != VK_SUCCESS)
+            return false;
+
+        VkPushConstantRange pushConstants = { VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(HiZConstants) };
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &hizSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstants;
+        if (vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &hizPipelineLayout) != VK_SUCCESS)
+            return false;
+
+        VkShaderModule module;
+        if (!getShaderModule(shaders::hiz_comp, sizeof(shaders::hiz_comp), module))
+            return false;
+
+        VkComputePipelineCreateInfo pipelineInfo = {};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = module;
+        pipelineInfo.stage.pName = "main";
+        pipelineInfo.layout = hizPipelineLayout;
+
+        auto createStart = std::chrono::high_resolution_clock::now();
+        if (vkCreateComputePipelines(logicalDevice, pipelineCache, 1, &pipelineInfo, nullptr, &hizPipeline) != VK_SUCCESS)
+            return false;
+        recordPipelineCreation(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - createStart).count());
+
+        // texelFetch ignores the filter and addressing, but a combined image sampler needs one
+        VkSamplerCreateInfo samplerInfo = {};
+        samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        samplerInfo.magFilter = VK_FILTER_NEAREST;
+        samplerInfo.minFilter = VK_FILTER_NEAREST;
+        samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+        return vkCreateSampler(logicalDevice, &samplerInfo, nullptr, &pyramid.sampler) == VK_SUCCESS;
+    }
+
+    void destroyHiZPipeline() {
+        vkDestroySampler(logicalDevice, pyramid.sampler, nullptr);
+        vkDestroyPipeline(logicalDevice, hizPipeline, nullptr);
+        vkDestroyPipelineLayout(logicalDevice, hizPipelineLayout, nullptr);
+        vkDestroyDescriptorSetLayout(logicalDevice, hizSetLayout, nullptr);
+        pyramid.sampler = VK_NULL_HANDLE;
+        hizPipeline = VK_NULL_HANDLE;
+        hizPipelineLayout = VK_NULL_HANDLE;
+        hizSetLayout = VK_NULL_HANDLE;
+        supported = false;
+    }
+
+    bool hizSupported() {
+        return supported;
+    }
+
+    bool createHiZPyramid() {
+        if (!supported)
+            return true;
+
+        pyramid.width = swapChainExtent.width;
+        pyramid.height = swapChainExtent.height;
+        pyramid.levels = hizLevelCount(pyramid.width, pyramid.height);
+
+        VkImageCreateInfo imageInfo = {};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.format = HIZ_FORMAT;
+        imageInfo.extent = { paddedSize(pyramid.width, pyramid.levels), paddedSize(pyramid.height, pyramid.levels), 1 };
+        imageInfo.mipLevels = pyramid.levels;
+        imageInfo.arrayLayers = 1;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        if (vkCreateImage(logicalDevice, &imageInfo, nullptr, &hizImage) != VK_SUCCESS)
+            return false;
+
+        VkMemoryRequirements memRequirements;
+        vkGetImageMemoryRequirements(logicalDevice, hizImage, &memRequirements);
+        if (!allocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, hizAllocation) ||
+            vkBindImageMemory(logicalDevice, hizImage, hizAllocation.memory, hizAllocation.offset) != VK_SUCCESS)
+            return false;
+
+        if (!createView(0, pyramid.levels, pyramid.view))
+            return false;
+        levelViews.assign(pyramid.levels, VK_NULL_HANDLE);
+        for (uint32_t level = 0; level < pyramid.levels; ++level) {
+            if (!createView(level, 1, levelViews[level]))
+                return false;
+        }
+
+        VkDescriptorPoolSize poolSizes[2] = {
+            { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, pyramid.levels },
+            { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, pyramid.levels },
+        };
+        VkDescriptorPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = 2;
+        poolInfo.pPoolSizes = poolSizes;
+        poolInfo.maxSets = pyramid.levels;
+        if (vkCreateDescriptorPool(logicalDevice, &poolInfo, nullptr, &hizDescriptorPool) != VK_SUCCESS)
+            return false;
+
+        std::vector<VkDescriptorSetLayout> layouts(pyramid.levels, hizSetLayout);
+        levelSets.resize(pyramid.levels);
+        VkDescriptorSetAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = hizDescriptorPool;
+        allocInfo.descriptorSetCount = pyramid.levels;
+        allocInfo.pSetLayouts = layouts.data();
+        if (vkAllocateDescriptorSets(logicalDevice, &allocInfo, levelSets.data()) != VK_SUCCESS)
+            return false;
+
+        for (uint32_t level = 0; level < pyramid.levels; ++level) {
+            VkDescriptorImageInfo source = {};
+            source.sampler = pyramid.sampler;
+            source.imageView = level == 0 ? depthImageView : levelViews[level - 1];
+            source.imageLayout = level == 0 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+            VkDescriptorImageInfo destination = {};
+            destination.imageView = levelViews[level];
+            destination.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+            VkWriteDescriptorSet writes[2] = {};
+            for (uint32_t i = 0; i < 2; ++i) {
+                writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                writes[i].dstSet = levelSets[level];
+                writes[i].dstBinding = i;
+                writes[i].descriptorCount = 1;
+            }
+            writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            writes[0].pImageInfo = &source;
+            writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            writes[1].pImageInfo = &destination;
+            vkUpdateDescriptorSets(logicalDevice, 2, writes, 0, nullptr);
+        }
+
+        pyramid.generation++;
+        return true;
+    }
+
+    void destroyHiZPyramid() {
+        if (hizDescriptorPool != VK_NULL_HANDLE)
+            vkDestroyDescriptorPool(logicalDevice, hizDescriptorPool, nullptr);
+        for (VkImageView view : levelViews)
+            vkDestroyImageView(logicalDevice, view, nullptr);
+        if (pyramid.view != VK_NULL_HANDLE)
+            vkDestroyImageView(logicalDevice, pyramid.view, nullptr);
+        if (hizImage != VK_NULL_HANDLE) {
+            vkDestroyImage(logicalDevice, hizImage, nullptr);
+            freeMemory(hizAllocation);
+        }
+        hizDescriptorPool = VK_NULL_HANDLE;
+        levelViews.clear();
+        levelSets.clear();
+        pyramid.view = VK_NULL_HANDLE;
+        hizImage = VK_NULL_HANDLE;
+    }
+
+    void recordHiZBuild(VkCommandBuffer cmd) {
+        // the whole pyramid is rewritten, so its old contents can go. The last frame's culling
+        // may still be reading them though
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = hizImage;
+        barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, pyramid.levels, 0, 1 };
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, hizPipeline);
+        HiZConstants constants;
+        constants.sourceSize = glm::ivec2(pyramid.width, pyramid.height);
+        for (uint32_t level = 0; level < pyramid.levels; ++level) {
+            constants.destinationSize = glm::ivec2(hizLevelSize(pyramid.width, level), hizLevelSize(pyramid.height, level));
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, hizPipelineLayout, 0, 1, &levelSets[level], 0, nullptr);
+            vkCmdPushConstants(cmd, hizPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(HiZConstants), &constants);
+            vkCmdDispatch(cmd, (constants.destinationSize.x + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE,
+                          (constants.destinationSize.y + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+
+            // the next level reads this one, and once they're all done the culling reads them all
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1 };
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                0, 0, nullptr, 0, nullptr, 1, &barrier);
+            constants.sourceSize = constants.destinationSize;
+        }
+    }
+
+    const HiZPyramid& getHiZPyramid() {
+        return pyramid;
+    }
+
+} // namespace graphics
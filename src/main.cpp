@@ -5,20 +5,162 @@
 
 #include "graphics_api.hpp"
 
-int main() {
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+/** Write an RGBA8 image out as a binary PPM, dropping the alpha. */
+static void writePPM(const std::string& path, const uint8_t* pixels, uint32_t width, uint32_t height) {
+    std::ofstream file(path, std::ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    for (size_t i = 0; i < size_t(width) * height; ++i)
+        file.write(reinterpret_cast<const char*>(pixels + 4 * i), 3);
+}
+
+int main(int argc, char** argv) {
+    uint64_t maxFrames = 0; // 0 = until the window is closed
+    std::string outputPath;
+    std::string tracePath;
+    std::string meshPath;
+    bool quantize = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--frames-in-flight") && i + 1 < argc)
+            graphics::framesInFlight = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--recording-threads") && i + 1 < argc)
+            graphics::recordingThreads = std::max(0, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--headless"))
+            graphics::headless = true;
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+            maxFrames = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+            outputPath = argv[++i];
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (!strcmp(argv[i], "--mesh") && i + 1 < argc)
+            meshPath = argv[++i];
+        else if (!strcmp(argv[i], "--quantize"))
+            quantize = true;
+        else if (!strcmp(argv[i], "--no-validation"))
+            enableValidationLayers = false;
+        else if (!strcmp(argv[i], "--no-culling"))
+            graphics::frustumCulling = false;
+    }
+
+    // headless runs have no window to close, so they need a frame count
+    if (graphics::headless && !maxFrames)
+        maxFrames = 600;
+    // the last frame read back is the one that gets written out
+    if (!outputPath.empty()) {
+        graphics::readbackCallback = [&](const uint8_t* pixels, uint32_t width, uint32_t height, uint64_t frame) {
+            if (frame + 1 == maxFrames)
+                writePPM(outputPath, pixels, width, height);
+        };
+    }
+
+    // load before creating the window, so a bad file doesn't flash one up. .mesh files (see
+    // tools/mesh_convert.cpp) are just mapped, anything else is parsed as OBJ
+    bool meshIsCache = meshPath.size() > 5 && meshPath.compare(meshPath.size() - 5, 5, ".mesh") == 0;
+    graphics::MeshData meshData;
+    graphics::MeshCache meshCache;
+    if (meshIsCache) {
+        if (!meshCache.open(meshPath))
+            return EXIT_FAILURE;
+    } else if (!meshPath.empty()) {
+        graphics::MeshLoadStats loadStats;
+        if (!graphics::loadObj(meshPath, meshData, &loadStats))
+            return EXIT_FAILURE;
+        std::cout << "loaded " << meshPath << ": " << meshData.vertices.size() << " vertices, "
+                  << meshData.indices.size() / 3 << " triangles in " << loadStats.milliseconds << " ms"
+                  << std::endl;
+
+        // .mesh files are optimized and get their levels of detail when they're converted, OBJ
+        // files have to be done here
+        graphics::MeshOptimizeStats optimizeStats;
+        graphics::optimizeMesh(meshData, &optimizeStats);
+        std::cout << "optimized in " << optimizeStats.milliseconds << " ms, ACMR "
+                  << optimizeStats.before.acmr << " -> " << optimizeStats.after.acmr << ", ATVR "
+                  << optimizeStats.before.atvr << " -> " << optimizeStats.after.atvr << std::endl;
+        graphics::generateLods(meshData);
+        std::cout << meshData.lods.size() << " levels of detail, down to "
+                  << (meshData.lods.empty() ? meshData.indices.size() : meshData.lods.back().indices.size()) / 3
+                  << " triangles" << std::endl;
+    }
 
     if (!graphics::initVulkan(800, 600))
         return EXIT_FAILURE;
 
-    while(!glfwWindowShouldClose(graphics::window)) {
-        glfwPollEvents();
-        if (glfwGetKey(graphics::window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-            glfwSetWindowShouldClose(graphics::window, true);
+    // the loaded mesh replaces the quad, centered and scaled to about the same size
+    graphics::Mesh loadedMesh;
+    const graphics::Mesh* mesh = &graphics::quadMesh;
+    glm::mat4 meshTransform(1.0f);
+    glm::vec3 boundsMin = meshData.boundsMin, boundsMax = meshData.boundsMax;
+    bool created = true;
+    if (meshIsCache) {
+        const graphics::MeshCacheHeader& header = meshCache.header();
+        boundsMin = glm::make_vec3(header.boundsMin);
+        boundsMax = glm::make_vec3(header.boundsMax);
+        created = graphics::createMesh(meshCache, loadedMesh);
+        meshCache.close(); // the upload copied everything into the staging ring
+    } else if (!meshData.vertices.empty()) {
+        created = graphics::createMesh(meshData, loadedMesh, quantize ? graphics::VertexLayout::quantized()
+                                                                       : graphics::VertexLayout::standard());
+        meshData = graphics::MeshData(); // the GPU has its own copy now
+    }
+    if (!created) {
+        graphics::cleanup();
+        return EXIT_FAILURE;
+    }
+    if (loadedMesh.indexCount) {
+        mesh = &loadedMesh;
+        glm::vec3 extent = boundsMax - boundsMin;
+        float scale = 1.0f / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-6f));
+        meshTransform = glm::scale(glm::mat4(1.0f), glm::vec3(scale)) *
+                        glm::translate(glm::mat4(1.0f), -0.5f * (boundsMin + boundsMax));
+    }
+
+    PROFILE_THREAD("main");
+    uint64_t frames = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    while (graphics::headless || !glfwWindowShouldClose(graphics::window)) {
+        if (maxFrames && frames == maxFrames)
+            break;
+        PROFILE_SCOPE("frame");
+        if (!graphics::headless) {
+            PROFILE_SCOPE("poll events");
+            glfwPollEvents();
+            if (glfwGetKey(graphics::window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+                glfwSetWindowShouldClose(graphics::window, true);
+        }
+
+        // the scene is resubmitted every frame
+        float time = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+        glm::mat4 model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+        graphics::submitDraw(*mesh, model * meshTransform);
 
         graphics::drawFrame();
+        ++frames;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    if (frames) {
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        std::cout << frames << " frames with " << graphics::framesInFlight << " in flight, "
+                  << ms / frames << " ms/frame" << std::endl;
+        auto frameStats = graphics::getFrameStats();
+        if (frameStats.frames)
+            std::cout << "recording: " << frameStats.recordMilliseconds / frameStats.frames << " ms/frame, "
+                      << frameStats.draws / frameStats.frames << " draws/frame" << std::endl;
+        graphics::printGpuProfilerStats();
     }
 
+    vkDeviceWaitIdle(graphics::logicalDevice);
+    graphics::destroyMesh(loadedMesh);
     graphics::cleanup();
+    if (!tracePath.empty() && !graphics::exportChromeTrace(tracePath))
+        std::cout << "Failed to write the trace to " << tracePath << std::endl;
 
 
     return 0;
@@ -0,0 +1,68 @@
+#include "mapped_file.hpp"
+
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace graphics {
+
+    bool MappedFile::open(const std::string& path, size_t mmapThreshold) {
+        close();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size_t fileSize = static_cast<size_t>(info.st_size);
+        if (fileSize >= mmapThreshold && fileSize > 0) {
+            void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (mapping == MAP_FAILED)
+                return false;
+            // the whole file is read front to back by every user so far
+            madvise(mapping, fileSize, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(mapping);
+            size_ = fileSize;
+            mapped_ = true;
+            return true;
+        }
+        ::close(fd);
+#endif
+        std::ifstream file(path, std::ios::ate | std::ios::binary);
+        if (!file)
+            return false;
+        size_t readSize = (size_t) file.tellg();
+        buffer_.resize((readSize + 3) / 4);
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(buffer_.data()), readSize);
+        if (!file) {
+            buffer_.clear();
+            return false;
+        }
+        data_ = reinterpret_cast<const char*>(buffer_.data());
+        size_ = readSize;
+        return true;
+    }
+
+    void MappedFile::close() {
+#ifndef _WIN32
+        if (mapped_)
+            munmap(const_cast<char*>(data_), size_);
+#endif
+        buffer_.clear();
+        buffer_.shrink_to_fit();
+        data_ = nullptr;
+        size_ = 0;
+        mapped_ = false;
+    }
+
+} // namespace graphics
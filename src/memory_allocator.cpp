@@ -0,0 +1,356 @@
+#include "memory_allocator.hpp"
+#include "graphics_api.hpp"
+#include "staging_buffer.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+
+namespace graphics {
+
+    namespace {
+
+        // smallest range handed out. Every range is MIN_ALLOCATION_SIZE << order bytes
+        const VkDeviceSize MIN_ALLOCATION_SIZE = 256;
+        const VkDeviceSize DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+
+        struct MemoryBlock {
+            uint32_t id;
+            VkDeviceMemory memory = VK_NULL_HANDLE;
+            VkDeviceSize size = 0;
+            uint8_t* mapped = nullptr;
+            uint32_t maxOrder = 0;
+            // free ranges of each order, sorted by offset so the lowest address gets reused first
+            std::vector<std::set<VkDeviceSize>> freeLists;
+            VkDeviceSize bytesAllocated = 0;
+            VkDeviceSize bytesInUse = 0;
+            uint32_t allocationCount = 0;
+        };
+
+        struct MemoryPool {
+            uint32_t memoryTypeIndex;
+            std::vector<std::unique_ptr<MemoryBlock>> blocks;
+        };
+
+        VkPhysicalDeviceMemoryProperties memProperties;
+        VkDeviceSize bufferImageGranularity = 1;
+        uint32_t maxMemoryAllocationCount = 4096;
+        bool separateLinearPools = false;
+        // one pool per memory type, or two (linear, optimal) if separateLinearPools
+        std::vector<MemoryPool> pools;
+        uint32_t nextBlockId = 0;
+        AllocatorStats stats;
+        std::mutex allocatorMutex;
+
+        uint32_t log2Ceil(VkDeviceSize x) {
+            uint32_t bits = 0;
+            while ((VkDeviceSize(1) << bits) < x)
+                ++bits;
+            return bits;
+        }
+
+        VkDeviceSize orderSize(uint32_t order) {
+            return MIN_ALLOCATION_SIZE << order;
+        }
+
+        /** Pick the block size for a memory type. Small heaps (like the 256MB host visible
+         * device local heap on some GPUs) get smaller blocks so one block can't eat most of it.
+         */
+        VkDeviceSize blockSizeForType(uint32_t memoryTypeIndex) {
+            VkDeviceSize heapSize = memProperties.memoryHeaps[memProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+            VkDeviceSize size = DEFAULT_BLOCK_SIZE;
+            while (size > MIN_ALLOCATION_SIZE && size > heapSize / 8)
+                size >>= 1;
+            return size;
+        }
+
+        bool allocateDeviceMemory(VkDeviceSize size, uint32_t memoryTypeIndex, VkDeviceMemory& memory, uint8_t*& mapped) {
+            if (stats.deviceMemoryCount >= maxMemoryAllocationCount) {
+                std::cout << "Hit maxMemoryAllocationCount (" << maxMemoryAllocationCount << ")" << std::endl;
+                return false;
+            }
+
+            VkMemoryAllocateInfo allocInfo = {};
+            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            allocInfo.allocationSize = size;
+            allocInfo.memoryTypeIndex = memoryTypeIndex;
+            if (vkAllocateMemory(logicalDevice, &allocInfo, nullptr, &memory) != VK_SUCCESS)
+                return false;
+
+            // map host visible memory once for its whole lifetime
+            mapped = nullptr;
+            if (memProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+                void* data;
+                if (vkMapMemory(logicalDevice, memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS) {
+                    vkFreeMemory(logicalDevice, memory, nullptr);
+                    return false;
+                }
+                mapped = static_cast<uint8_t*>(data);
+            }
+
+            stats.bytesReserved += size;
+            stats.deviceMemoryCount++;
+            stats.totalDeviceMemoryAllocations++;
+            return true;
+        }
+
+        void freeDeviceMemory(VkDeviceMemory memory, VkDeviceSize size) {
+            // freeing mapped memory implicitly unmaps it
+            vkFreeMemory(logicalDevice, memory, nullptr);
+            stats.bytesReserved -= size;
+            stats.deviceMemoryCount--;
+        }
+
+        MemoryBlock* createBlock(MemoryPool& pool) {
+            auto block = std::make_unique<MemoryBlock>();
+            block->id = nextBlockId++;
+            block->size = blockSizeForType(pool.memoryTypeIndex);
+            block->maxOrder = log2Ceil(block->size / MIN_ALLOCATION_SIZE);
+            if (!allocateDeviceMemory(block->size, pool.memoryTypeIndex, block->memory, block->mapped))
+                return nullptr;
+
+            block->freeLists.resize(block->maxOrder + 1);
+            block->freeLists[block->maxOrder].insert(0);
+            pool.blocks.push_back(std::move(block));
+            return pool.blocks.back().get();
+        }
+
+        /** Buddy allocation: take the smallest free range that fits, and split it in half until
+         * it is the requested order. The unused halves go back on the free lists.
+         */
+        bool allocateFromBlock(MemoryBlock& block, uint32_t order, VkDeviceSize& offset) {
+            uint32_t k = order;
+            while (k <= block.maxOrder && block.freeLists[k].empty())
+                ++k;
+            if (k > block.maxOrder)
+                return false;
+
+            offset = *block.freeLists[k].begin();
+            block.freeLists[k].erase(block.freeLists[k].begin());
+            while (k > order) {
+                --k;
+                block.freeLists[k].insert(offset + orderSize(k));
+            }
+            return true;
+        }
+
+        /** Return a range to the free lists, merging it with its buddy as long as the buddy is free. */
+        void freeToBlock(MemoryBlock& block, uint32_t order, VkDeviceSize offset) {
+            while (order < block.maxOrder) {
+                VkDeviceSize buddy = offset ^ orderSize(order);
+                auto it = block.freeLists[order].find(buddy);
+                if (it == block.freeLists[order].end())
+                    break;
+                block.freeLists[order].erase(it);
+                offset = std::min(offset, buddy);
+                ++order;
+            }
+            block.freeLists[order].insert(offset);
+        }
+
+        VkDeviceSize largestFreeRange(const MemoryBlock& block) {
+            for (int k = block.maxOrder; k >= 0; --k) {
+                if (!block.freeLists[k].empty())
+                    return orderSize(k);
+            }
+            return 0;
+        }
+
+    } // namespace anonymous
+
+    bool createAllocator() {
+        vkGetPhysicalDeviceMemoryProperties(physicalDeviceInfo.device, &memProperties);
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDeviceInfo.device, &deviceProperties);
+        bufferImageGranularity = deviceProperties.limits.bufferImageGranularity;
+        maxMemoryAllocationCount = deviceProperties.limits.maxMemoryAllocationCount;
+
+        // buddy ranges start and end on multiples of their size, so if even the smallest range
+        // covers a whole granularity page, linear and optimal resources can share blocks
+        separateLinearPools = bufferImageGranularity > MIN_ALLOCATION_SIZE;
+
+        uint32_t poolsPerType = separateLinearPools ? 2 : 1;
+        pools.resize(memProperties.memoryTypeCount * poolsPerType);
+        for (uint32_t i = 0; i < pools.size(); ++i)
+            pools[i].memoryTypeIndex = i / poolsPerType;
+
+        stats = {};
+        return true;
+    }
+
+    void destroyAllocator() {
+        if (stats.allocationCount)
+            std::cout << "Allocator destroyed with " << stats.allocationCount << " live allocations" << std::endl;
+
+        for (auto& pool : pools) {
+            for (auto& block : pool.blocks)
+                freeDeviceMemory(block->memory, block->size);
+        }
+        pools.clear();
+    }
+
+    bool findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties, uint32_t& index) {
+        // return the first suitable memory type found
+        for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i) {
+            if (typeFilter & (1 << i) && (memProperties.memoryTypes[i].propertyFlags & properties)
+                    == properties)
+            {
+                index = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool allocateMemory(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties,
+                        bool linear, Allocation& allocation)
+    {
+        uint32_t memoryTypeIndex;
+        if (!findMemoryType(requirements.memoryTypeBits, properties, memoryTypeIndex))
+            return false;
+
+        std::lock_guard<std::mutex> lock(allocatorMutex);
+        allocation = {};
+        allocation.size = requirements.size;
+        allocation.memoryTypeIndex = memoryTypeIndex;
+
+        VkDeviceSize rangeSize = std::max({ requirements.size, requirements.alignment, MIN_ALLOCATION_SIZE });
+        uint32_t order = log2Ceil((rangeSize + MIN_ALLOCATION_SIZE - 1) / MIN_ALLOCATION_SIZE);
+
+        // anything bigger than half a block gets its own VkDeviceMemory
+        if (orderSize(order) > blockSizeForType(memoryTypeIndex) / 2) {
+            uint8_t* mapped;
+            if (!allocateDeviceMemory(requirements.size, memoryTypeIndex, allocation.memory, mapped))
+                return false;
+            allocation.mappedData = mapped;
+            allocation.dedicated = true;
+        } else {
+            uint32_t poolIndex = separateLinearPools ? 2 * memoryTypeIndex + (linear ? 0 : 1) : memoryTypeIndex;
+            MemoryPool& pool = pools[poolIndex];
+
+            MemoryBlock* block = nullptr;
+            VkDeviceSize offset;
+            for (auto& b : pool.blocks) {
+                if (allocateFromBlock(*b, order, offset)) {
+                    block = b.get();
+                    break;
+                }
+            }
+            if (!block) {
+                block = createBlock(pool);
+                if (!block || !allocateFromBlock(*block, order, offset))
+                    return false;
+            }
+
+            block->bytesAllocated += orderSize(order);
+            block->bytesInUse += requirements.size;
+            block->allocationCount++;
+
+            allocation.memory = block->memory;
+            allocation.offset = offset;
+            allocation.mappedData = block->mapped ? block->mapped + offset : nullptr;
+            allocation.poolIndex = poolIndex;
+            allocation.blockId = block->id;
+            allocation.order = order;
+        }
+
+        stats.bytesAllocated += allocation.dedicated ? requirements.size : orderSize(order);
+        stats.bytesInUse += requirements.size;
+        stats.allocationCount++;
+        stats.totalAllocations++;
+        return true;
+    }
+
+    void freeMemory(Allocation& allocation) {
+        if (allocation.memory == VK_NULL_HANDLE)
+            return;
+
+        std::lock_guard<std::mutex> lock(allocatorMutex);
+        if (allocation.dedicated) {
+            freeDeviceMemory(allocation.memory, allocation.size);
+            stats.bytesAllocated -= allocation.size;
+        } else {
+            MemoryPool& pool = pools[allocation.poolIndex];
+            auto it = std::find_if(pool.blocks.begin(), pool.blocks.end(),
+                                   [&](const auto& b) { return b->id == allocation.blockId; });
+            MemoryBlock& block = **it;
+            freeToBlock(block, allocation.order, allocation.offset);
+            block.bytesAllocated -= orderSize(allocation.order);
+            block.bytesInUse -= allocation.size;
+            block.allocationCount--;
+            stats.bytesAllocated -= orderSize(allocation.order);
+
+            // give empty blocks back to the driver, but keep one around so that a pool which
+            // frequently goes empty doesn't keep reallocating its block
+            if (block.allocationCount == 0 && pool.blocks.size() > 1) {
+                freeDeviceMemory(block.memory, block.size);
+                pool.blocks.erase(it);
+            }
+        }
+
+        stats.bytesInUse -= allocation.size;
+        stats.allocationCount--;
+        allocation = {};
+    }
+
+    AllocatorStats getAllocatorStats() {
+        std::lock_guard<std::mutex> lock(allocatorMutex);
+        AllocatorStats s = stats;
+        s.largestFreeRange = 0;
+        for (const auto& pool : pools) {
+            for (const auto& block : pool.blocks)
+                s.largestFreeRange = std::max(s.largestFreeRange, largestFreeRange(*block));
+        }
+        return s;
+    }
+
+    void printAllocatorStats() {
+        AllocatorStats s = getAllocatorStats();
+        const float MB = 1024.0f * 1024.0f;
+        std::cout << "GPU memory: " << s.bytesInUse / MB << "MB in use, " << s.bytesAllocated / MB
+                  << "MB allocated, " << s.bytesReserved / MB << "MB reserved" << std::endl;
+        std::cout << "\t" << s.allocationCount << " allocations in " << s.deviceMemoryCount
+                  << " device memory objects (max " << maxMemoryAllocationCount << ")" << std::endl;
+        std::cout << "\tfragmentation: internal = " << 100 * s.internalFragmentation()
+                  << "%, external = " << 100 * s.externalFragmentation() << "%" << std::endl;
+    }
+
+    bool createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
+                      VkBuffer& buffer, Allocation& allocation)
+    {
+        VkBufferCreateInfo bufferInfo = {};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = size;
+        bufferInfo.usage = usage;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        bufferInfo.flags = 0; // for sparse buffer memory, not relevent right now
+
+        if (vkCreateBuffer(logicalDevice, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
+            return false;
+
+        VkMemoryRequirements memRequirements;
+        vkGetBufferMemoryRequirements(logicalDevice, buffer, &memRequirements);
+
+        if (!allocateMemory(memRequirements, properties, true, allocation)) {
+            vkDestroyBuffer(logicalDevice, buffer, nullptr);
+            buffer = VK_NULL_HANDLE;
+            return false;
+        }
+
+        if (vkBindBufferMemory(logicalDevice, buffer, allocation.memory, allocation.offset) != VK_SUCCESS) {
+            destroyBuffer(buffer, allocation);
+            return false;
+        }
+        return true;
+    }
+
+    void destroyBuffer(VkBuffer& buffer, Allocation& allocation) {
+        forgetUploadedBuffer(buffer);
+        vkDestroyBuffer(logicalDevice, buffer, nullptr);
+        freeMemory(allocation);
+        buffer = VK_NULL_HANDLE;
+    }
+
+} // namespace graphics
@@ -0,0 +1,237 @@
+#include "mesh_cache.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace graphics {
+
+    namespace {
+
+        const uint64_t HASH_PRIME = 0x9E3779B97F4A7C15ull;
+
+        /** \brief 64 bit hash of a blob, for catching truncated or corrupted files.
+         *
+         * Four independent multiply-xor lanes over 8 byte words keep several multiplies in
+         * flight, so this runs at a good fraction of memory bandwidth. It's not meant to be
+         * cryptographic, just to notice bit rot and partial writes.
+         */
+        uint64_t hashBlob(const void* data, size_t size, uint64_t seed) {
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            uint64_t lanes[4] = { seed, seed ^ HASH_PRIME, seed + HASH_PRIME, ~seed };
+            size_t i = 0;
+            for (; i + 32 <= size; i += 32) {
+                for (int lane = 0; lane < 4; ++lane) {
+                    uint64_t word;
+                    memcpy(&word, bytes + i + 8 * lane, 8);
+                    lanes[lane] = (lanes[lane] ^ word) * HASH_PRIME;
+                    lanes[lane] ^= lanes[lane] >> 29;
+                }
+            }
+            for (; i < size; ++i)
+                lanes[0] = (lanes[0] ^ bytes[i]) * HASH_PRIME;
+
+            uint64_t hash = size;
+            for (uint64_t lane : lanes) {
+                hash = (hash ^ lane) * HASH_PRIME;
+                hash ^= hash >> 32;
+            }
+            return hash;
+        }
+
+        uint64_t checksum(const void* vertices, size_t vertexBytes, const void* indices, size_t indexBytes) {
+            return hashBlob(indices, indexBytes, hashBlob(vertices, vertexBytes, MESH_CACHE_VERSION));
+        }
+
+        uint64_t alignUp(uint64_t value) {
+            return (value + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+        }
+
+        bool fitsInFile(uint64_t offset, uint64_t bytes, uint64_t fileSize) {
+            return offset % MESH_CACHE_ALIGNMENT == 0 && offset <= fileSize && bytes <= fileSize - offset;
+        }
+
+    } // namespace anonymous
+
+    bool writeMeshCache(const std::string& path, const MeshData& mesh, const VertexLayout& layout) {
+        MeshCacheHeader header = {};
+        header.magic = MESH_CACHE_MAGIC;
+        header.version = MESH_CACHE_VERSION;
+        header.headerSize = sizeof(MeshCacheHeader);
+        header.vertexCount = static_cast<uint32_t>(mesh.vertices.size());
+        header.vertexStride = layout.stride();
+        if (mesh.lods.size() + 1 > MESH_CACHE_MAX_LODS)
+            return false;
+        // the full mesh and its levels of detail, in one blob
+        std::vector<uint32_t> indices = mesh.indices;
+        header.lodCount = static_cast<uint32_t>(mesh.lods.size() + 1);
+        header.lods[0] = { 0, static_cast<uint32_t>(mesh.indices.size()), 0.0f };
+        for (size_t i = 0; i < mesh.lods.size(); ++i) {
+            header.lods[i + 1] = { static_cast<uint32_t>(indices.size()), static_cast<uint32_t>(mesh.lods[i].indices.size()), mesh.lods[i].error };
+            indices.insert(indices.end(), mesh.lods[i].indices.begin(), mesh.lods[i].indices.end());
+        }
+        header.indexCount = static_cast<uint32_t>(indices.size());
+
+        auto attributes = layout.getAttributeDescriptions();
+        if (attributes.size() > MESH_CACHE_MAX_ATTRIBUTES)
+            return false;
+        header.attributeCount = static_cast<uint32_t>(attributes.size());
+        for (size_t i = 0; i < attributes.size(); ++i)
+            header.attributes[i] = { attributes[i].location, (uint32_t) attributes[i].format, attributes[i].offset };
+        std::vector<uint8_t> vertexData(header.vertexCount * size_t(header.vertexStride));
+        layout.encode(mesh.vertices.data(), mesh.vertices.size(), mesh.boundsMin, mesh.boundsMax, vertexData.data());
+
+        // the same choice createMesh makes, so the blob can be uploaded as it is
+        bool narrow = mesh.vertices.size() <= 0x10000;
+        std::vector<uint16_t> narrowIndices;
+        if (narrow)
+            narrowIndices.assign(indices.begin(), indices.end());
+        const void* indexData = narrow ? (const void*) narrowIndices.data() : (const void*) indices.data();
+        header.indexType = narrow ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+
+        glm::vec3 center = 0.5f * (mesh.boundsMin + mesh.boundsMax);
+        float radiusSquared = 0.0f;
+        for (const Vertex& vertex : mesh.vertices) {
+            glm::vec3 offset = vertex.pos - center;
+            radiusSquared = std::max(radiusSquared, glm::dot(offset, offset));
+        }
+        for (int i = 0; i < 3; ++i) {
+            header.boundsMin[i] = mesh.boundsMin[i];
+            header.boundsMax[i] = mesh.boundsMax[i];
+            header.sphereCenter[i] = center[i];
+        }
+        header.sphereRadius = std::sqrt(radiusSquared);
+
+        header.vertexBytes = uint64_t(header.vertexCount) * header.vertexStride;
+        header.indexBytes = uint64_t(header.indexCount) * (narrow ? 2 : 4);
+        header.vertexOffset = alignUp(sizeof(MeshCacheHeader));
+        header.indexOffset = alignUp(header.vertexOffset + header.vertexBytes);
+        header.checksum = checksum(vertexData.data(), header.vertexBytes, indexData, header.indexBytes);
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cout << "Failed to create '" << path << "'" << std::endl;
+            return false;
+        }
+        const char padding[MESH_CACHE_ALIGNMENT] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(padding, header.vertexOffset - sizeof(header));
+        file.write(reinterpret_cast<const char*>(vertexData.data()), header.vertexBytes);
+        file.write(padding, header.indexOffset - header.vertexOffset - header.vertexBytes);
+        file.write(static_cast<const char*>(indexData), header.indexBytes);
+        if (!file) {
+            std::cout << "Failed to write '" << path << "'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool MeshCache::open(const std::string& path, bool verify) {
+        close();
+        if (!file.open(path)) {
+            std::cout << "Failed to open mesh '" << path << "'" << std::endl;
+            return false;
+        }
+
+        auto fail = [&](const char* reason) {
+            std::cout << "Invalid mesh file '" << path << "': " << reason << std::endl;
+            close();
+            return false;
+        };
+
+        if (file.size() < sizeof(MeshCacheHeader))
+            return fail("too small for the header");
+        const MeshCacheHeader* h = reinterpret_cast<const MeshCacheHeader*>(file.data());
+        if (h->magic != MESH_CACHE_MAGIC)
+            return fail("not a mesh file");
+        if (h->version != MESH_CACHE_VERSION || h->headerSize != sizeof(MeshCacheHeader))
+            return fail("written by a different version, convert it again");
+        if (h->attributeCount > MESH_CACHE_MAX_ATTRIBUTES)
+            return fail("too many attributes");
+        for (uint32_t i = 0; i < h->attributeCount; ++i) {
+            if (h->attributes[i].offset >= h->vertexStride)
+                return fail("attribute outside of the vertex");
+        }
+        if (h->indexType != VK_INDEX_TYPE_UINT16 && h->indexType != VK_INDEX_TYPE_UINT32)
+            return fail("unknown index type");
+        if (h->indexCount % 3 != 0)
+            return fail("index count is not a whole number of triangles");
+        if (h->lodCount == 0 || h->lodCount > MESH_CACHE_MAX_LODS)
+            return fail("bad level of detail count");
+        if (h->lods[0].firstIndex != 0)
+            return fail("the full mesh doesn't start the indices");
+        for (uint32_t i = 0; i < h->lodCount; ++i) {
+            const MeshCacheLod& lod = h->lods[i];
+            if (lod.indexCount == 0 || lod.indexCount % 3 != 0 || lod.firstIndex > h->indexCount ||
+                    lod.indexCount > h->indexCount - lod.firstIndex)
+                return fail("level of detail outside of the indices");
+        }
+        uint64_t indexSize = h->indexType == VK_INDEX_TYPE_UINT16 ? 2 : 4;
+        if (h->vertexBytes != uint64_t(h->vertexCount) * h->vertexStride || h->indexBytes != h->indexCount * indexSize)
+            return fail("blob sizes don't match the counts");
+        if (!fitsInFile(h->vertexOffset, h->vertexBytes, file.size()) ||
+                !fitsInFile(h->indexOffset, h->indexBytes, file.size()))
+            return fail("truncated");
+        header_ = h;
+
+        if (verify) {
+            if (checksum(vertexData(), h->vertexBytes, indexData(), h->indexBytes) != h->checksum)
+                return fail("checksum mismatch");
+            for (uint32_t i = 0; i < h->indexCount; ++i) {
+                uint32_t index = indexSize == 2 ? static_cast<const uint16_t*>(indexData())[i]
+                                                : static_cast<const uint32_t*>(indexData())[i];
+                if (index >= h->vertexCount)
+                    return fail("index out of range");
+            }
+        }
+        return true;
+    }
+
+    void MeshCache::close() {
+        file.close();
+        header_ = nullptr;
+    }
+
+    bool MeshCache::getVertexLayout(VertexLayout& layout) const {
+        layout = VertexLayout();
+        for (uint32_t i = 0; i < header_->attributeCount; ++i) {
+            const MeshCacheAttribute& attribute = header_->attributes[i];
+            VertexEncoding encoding;
+            if (attribute.location > (uint32_t) VertexSemantic::Normal ||
+                    !vertexEncodingFromFormat((VkFormat) attribute.format, encoding))
+                return false;
+            layout.add((VertexSemantic) attribute.location, encoding);
+            if (layout.attributes().back().offset != attribute.offset)
+                return false;
+        }
+        return layout.stride() == header_->vertexStride;
+    }
+
+    bool MeshCache::toMeshData(MeshData& mesh) const {
+        VertexLayout layout;
+        if (!header_ || !getVertexLayout(layout))
+            return false;
+        mesh.boundsMin = glm::vec3(header_->boundsMin[0], header_->boundsMin[1], header_->boundsMin[2]);
+        mesh.boundsMax = glm::vec3(header_->boundsMax[0], header_->boundsMax[1], header_->boundsMax[2]);
+        mesh.vertices.resize(header_->vertexCount);
+        layout.decode(vertexData(), header_->vertexCount, mesh.boundsMin, mesh.boundsMax, mesh.vertices.data());
+        auto readIndices = [&](const MeshCacheLod& lod, std::vector<uint32_t>& indices) {
+            indices.resize(lod.indexCount);
+            for (uint32_t i = 0; i < lod.indexCount; ++i) {
+                uint32_t index = lod.firstIndex + i;
+                indices[i] = header_->indexType == VK_INDEX_TYPE_UINT16 ? static_cast<const uint16_t*>(indexData())[index]
+                                                                       : static_cast<const uint32_t*>(indexData())[index];
+            }
+        };
+        readIndices(header_->lods[0], mesh.indices);
+        mesh.lods.resize(header_->lodCount - 1);
+        for (uint32_t i = 1; i < header_->lodCount; ++i) {
+            readIndices(header_->lods[i], mesh.lods[i - 1].indices);
+            mesh.lods[i - 1].error = header_->lods[i].error;
+        }
+        return true;
+    }
+
+} // namespace graphics
@@ -0,0 +1,339 @@
+#include "mesh_loader.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+namespace graphics {
+
+    namespace {
+
+        const double POWERS_OF_10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        inline bool isDigit(char c) {
+            return c >= '0' && c <= '9';
+        }
+
+        // newlines end a statement, so they're not skipped
+        inline const char* skipSpace(const char* p, const char* end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                ++p;
+            return p;
+        }
+
+        inline const char* skipLine(const char* p, const char* end) {
+            while (p < end && *p != '\n')
+                ++p;
+            return p < end ? p + 1 : p;
+        }
+
+        inline bool atStatementEnd(const char* p, const char* end) {
+            return p == end || *p == '\n' || *p == '#';
+        }
+
+        /** \brief Parse a decimal float, returning the first character after it or nullptr.
+         *
+         * strtod is locale dependent and has to handle hex floats, infinities and exact
+         * rounding, which makes it several times slower than this. The mantissa is accumulated
+         * as an integer and scaled once, which is exact for anything with up to 15 significant
+         * digits and well within float precision for the rest.
+         */
+        const char* parseFloat(const char* p, const char* end, float& value) {
+            p = skipSpace(p, end);
+            bool negative = false;
+            if (p < end && (*p == '-' || *p == '+'))
+                negative = *p++ == '-';
+
+            uint64_t mantissa = 0;
+            int exponent = 0;
+            int digits = 0;
+            bool any = false;
+            for (; p < end && isDigit(*p); ++p, any = true) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    digits += mantissa != 0;
+                } else {
+                    exponent++;
+                }
+            }
+            if (p < end && *p == '.') {
+                for (++p; p < end && isDigit(*p); ++p, any = true) {
+                    if (digits < 19) {
+                        mantissa = mantissa * 10 + (*p - '0');
+                        digits += mantissa != 0;
+                        exponent--;
+                    }
+                }
+            }
+            if (!any)
+                return nullptr;
+            if (p < end && (*p == 'e' || *p == 'E')) {
+                ++p;
+                bool negativeExponent = false;
+                if (p < end && (*p == '-' || *p == '+'))
+                    negativeExponent = *p++ == '-';
+                int e = 0;
+                for (; p < end && isDigit(*p); ++p)
+                    e = std::min(e * 10 + (*p - '0'), 1000);
+                exponent += negativeExponent ? -e : e;
+            }
+
+            double result = static_cast<double>(mantissa);
+            if (exponent < 0)
+                result /= -exponent <= 22 ? POWERS_OF_10[-exponent] : std::pow(10.0, -exponent);
+            else if (exponent > 0)
+                result *= exponent <= 22 ? POWERS_OF_10[exponent] : std::pow(10.0, exponent);
+            value = static_cast<float>(negative ? -result : result);
+            return p;
+        }
+
+        const char* parseInt(const char* p, const char* end, int64_t& value) {
+            p = skipSpace(p, end);
+            bool negative = false;
+            if (p < end && (*p == '-' || *p == '+'))
+                negative = *p++ == '-';
+            if (p == end || !isDigit(*p))
+                return nullptr;
+            int64_t result = 0;
+            for (; p < end && isDigit(*p); ++p)
+                result = result * 10 + (*p - '0');
+            value = negative ? -result : result;
+            return p;
+        }
+
+        /** \brief Open addressing map from a (position, normal) pair to an output vertex.
+         *
+         * One lookup per face corner makes this the hot loop of the loader. Linear probing over
+         * a flat array of 64 bit keys beats std::unordered_map by a wide margin, since a lookup
+         * is a multiply, a shift and (usually) one cache miss instead of a node allocation.
+         */
+        class CornerMap {
+        public:
+            explicit CornerMap(size_t expected) {
+                size_t capacity = 1024;
+                while (capacity < expected * 2)
+                    capacity *= 2;
+                resize(capacity);
+            }
+
+            /** Returns the vertex for key, or inserts next and returns it if key is new. */
+            uint32_t findOrInsert(uint64_t key, uint32_t next) {
+                if ((count + 1) * 2 > keys.size())
+                    resize(keys.size() * 2);
+                size_t i = slot(key);
+                while (keys[i] != EMPTY) {
+                    if (keys[i] == key)
+                        return values[i];
+                    i = (i + 1) & mask;
+                }
+                keys[i] = key;
+                values[i] = next;
+                count++;
+                return next;
+            }
+
+        private:
+            static constexpr uint64_t EMPTY = ~0ull;
+
+            std::vector<uint64_t> keys;
+            std::vector<uint32_t> values;
+            size_t count = 0;
+            size_t mask = 0;
+            int shift = 0;
+
+            size_t slot(uint64_t key) const {
+                return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> shift);
+            }
+
+            void resize(size_t capacity) {
+                std::vector<uint64_t> oldKeys(capacity, EMPTY);
+                std::vector<uint32_t> oldValues(capacity);
+                oldKeys.swap(keys);
+                oldValues.swap(values);
+                mask = capacity - 1;
+                shift = 64;
+                for (size_t c = capacity; c > 1; c >>= 1)
+                    shift--;
+                for (size_t j = 0; j < oldKeys.size(); ++j) {
+                    if (oldKeys[j] == EMPTY)
+                        continue;
+                    size_t i = slot(oldKeys[j]);
+                    while (keys[i] != EMPTY)
+                        i = (i + 1) & mask;
+                    keys[i] = oldKeys[j];
+                    values[i] = oldValues[j];
+                }
+            }
+        };
+
+        /** Turns a 1 based (or negative, relative) OBJ index into a 0 based one, or -1. */
+        inline int64_t resolveIndex(int64_t index, size_t count) {
+            if (index > 0)
+                return index <= (int64_t) count ? index - 1 : -1;
+            if (index < 0)
+                return -index <= (int64_t) count ? (int64_t) count + index : -1;
+            return -1;
+        }
+
+    } // namespace anonymous
+
+    bool loadObj(const std::string& path, MeshData& mesh, MeshLoadStats* stats) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        MappedFile file;
+        if (!file.open(path)) {
+            std::cout << "Failed to open mesh '" << path << "'" << std::endl;
+            return false;
+        }
+
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> colors;
+        std::vector<glm::vec3> normals;
+        std::vector<uint64_t> corners; // (position, normal + 1) of every output vertex
+        bool hasColors = false;
+        uint32_t faces = 0;
+        uint32_t deduplicated = 0;
+
+        // rough sizes for a typical exported file, to skip most of the regrowing
+        size_t expectedVertices = file.size() / 48;
+        positions.reserve(expectedVertices);
+        corners.reserve(expectedVertices);
+        mesh.indices.clear();
+        mesh.indices.reserve(expectedVertices * 6);
+        CornerMap cornerMap(expectedVertices);
+
+        const char* p = file.data();
+        const char* end = p + file.size();
+        while (p < end) {
+            p = skipSpace(p, end);
+            if (p == end)
+                break;
+            const char* statement = p;
+
+            if (p[0] == 'v' && p + 1 < end && (p[1] == ' ' || p[1] == '\t')) {
+                glm::vec3 position, color(1.0f);
+                p = parseFloat(p + 1, end, position.x);
+                p = p ? parseFloat(p, end, position.y) : nullptr;
+                p = p ? parseFloat(p, end, position.z) : nullptr;
+                if (p) {
+                    // either "x y z", "x y z w" or "x y z r g b"
+                    float extra[3];
+                    int extraCount = 0;
+                    while (extraCount < 3) {
+                        p = skipSpace(p, end);
+                        const char* next = atStatementEnd(p, end) ? nullptr : parseFloat(p, end, extra[extraCount]);
+                        if (!next)
+                            break;
+                        p = next;
+                        extraCount++;
+                    }
+                    if (extraCount == 3) {
+                        color = glm::vec3(extra[0], extra[1], extra[2]);
+                        hasColors = true;
+                    }
+                    positions.push_back(position);
+                    colors.push_back(color);
+                }
+            } else if (p[0] == 'v' && p + 2 < end && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+                glm::vec3 normal;
+                p = parseFloat(p + 2, end, normal.x);
+                p = p ? parseFloat(p, end, normal.y) : nullptr;
+                p = p ? parseFloat(p, end, normal.z) : nullptr;
+                if (p)
+                    normals.push_back(normal);
+            } else if (p[0] == 'f' && p + 1 < end && (p[1] == ' ' || p[1] == '\t')) {
+                faces++;
+                p = skipSpace(p + 1, end);
+                uint32_t first = 0, previous = 0, cornerCount = 0;
+                while (p && !atStatementEnd(p, end)) {
+                    int64_t v, vt, vn = 0; // texture coordinates are parsed but unused
+                    p = parseInt(p, end, v);
+                    if (p && p < end && *p == '/') {
+                        ++p;
+                        if (p < end && *p != '/')
+                            p = parseInt(p, end, vt);
+                        if (p && p < end && *p == '/')
+                            p = parseInt(p + 1, end, vn);
+                    }
+                    if (!p)
+                        break;
+                    int64_t position = resolveIndex(v, positions.size());
+                    int64_t normal = vn ? resolveIndex(vn, normals.size()) : -1;
+                    if (position < 0 || (vn && normal < 0)) {
+                        p = nullptr;
+                        break;
+                    }
+
+                    uint64_t key = (uint64_t(position) << 32) | uint64_t(normal + 1);
+                    uint32_t next = static_cast<uint32_t>(corners.size());
+                    uint32_t index = cornerMap.findOrInsert(key, next);
+                    if (index == next)
+                        corners.push_back(key);
+                    else
+                        deduplicated++;
+
+                    // polygons become a fan around their first corner
+                    if (cornerCount == 0) {
+                        first = index;
+                    } else if (cornerCount >= 2) {
+                        mesh.indices.push_back(first);
+                        mesh.indices.push_back(previous);
+                        mesh.indices.push_back(index);
+                    }
+                    previous = index;
+                    cornerCount++;
+                    p = skipSpace(p, end);
+                }
+            }
+
+            if (!p) {
+                std::cout << "Malformed statement in '" << path << "' at byte "
+                          << statement - file.data() << std::endl;
+                return false;
+            }
+            p = skipLine(p, end);
+        }
+
+        mesh.vertices.resize(corners.size());
+        mesh.boundsMin = glm::vec3(INFINITY);
+        mesh.boundsMax = glm::vec3(-INFINITY);
+        for (size_t i = 0; i < corners.size(); ++i) {
+            const glm::vec3& position = positions[corners[i] >> 32];
+            mesh.vertices[i].pos = position;
+            mesh.boundsMin = glm::min(mesh.boundsMin, position);
+            mesh.boundsMax = glm::max(mesh.boundsMax, position);
+        }
+        if (corners.empty())
+            mesh.boundsMin = mesh.boundsMax = glm::vec3(0.0f);
+
+        glm::vec3 extent = glm::max(mesh.boundsMax - mesh.boundsMin, glm::vec3(1e-20f));
+        for (size_t i = 0; i < corners.size(); ++i) {
+            uint32_t normal = static_cast<uint32_t>(corners[i]);
+            Vertex& vertex = mesh.vertices[i];
+            vertex.normal = normal ? glm::normalize(normals[normal - 1]) : glm::vec3(0.0f);
+            if (normal)
+                vertex.color = vertex.normal * 0.5f + 0.5f;
+            else if (hasColors)
+                vertex.color = colors[corners[i] >> 32];
+            else
+                vertex.color = (vertex.pos - mesh.boundsMin) / extent;
+        }
+
+        if (stats) {
+            stats->bytesRead = file.size();
+            stats->positions = static_cast<uint32_t>(positions.size());
+            stats->normals = static_cast<uint32_t>(normals.size());
+            stats->faces = faces;
+            stats->cornersDeduplicated = deduplicated;
+            stats->milliseconds = std::chrono::duration<double, std::milli>(
+                    std::chrono::high_resolution_clock::now() - start).count();
+        }
+        return true;
+    }
+
+} // namespace graphics
@@ -0,0 +1,595 @@
+#include "mesh_optimizer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace graphics {
+
+    namespace {
+
+        /** \brief FIFO cache model shared by the analysis and the overdraw pass.
+         *
+         * A vertex is in the cache if fewer than size vertices were added after it. Advancing
+         * time by more than size empties the whole cache without touching every entry.
+         */
+        struct FifoCache {
+            std::vector<uint32_t> stamps;
+            uint32_t size;
+            uint32_t time;
+
+            FifoCache(uint32_t vertexCount, uint32_t size) : stamps(vertexCount, 0), size(size), time(size + 1) {}
+
+            bool contains(uint32_t vertex) const {
+                return time - stamps[vertex] <= size;
+            }
+
+            /** Returns the number of misses (0 or 1). */
+            uint32_t access(uint32_t vertex) {
+                if (contains(vertex))
+                    return 0;
+                stamps[vertex] = time++;
+                return 1;
+            }
+
+            void flush() {
+                time += size + 1;
+            }
+        };
+
+        // border planes count this many times more than the triangles they stand in for
+        const double BORDER_WEIGHT = 10.0;
+        // generateLods gives up on levels that don't get this much smaller than the last
+        const float MIN_LOD_REDUCTION = 0.8f;
+        const uint32_t MIN_LOD_TRIANGLES = 8;
+
+        /** \brief Weighted sum of the squared distances of a point to a set of planes.
+         *
+         * Stored as the 10 coefficients of the symmetric 4x4 matrix, in double since the
+         * sums over large meshes cancel badly in float.
+         */
+        struct Quadric {
+            double a2 = 0, b2 = 0, c2 = 0, ab = 0, ac = 0, bc = 0, ad = 0, bd = 0, cd = 0, d2 = 0;
+            double weight = 0;
+
+            /** The plane dot(normal, p) + d = 0, normal of unit length. */
+            void addPlane(const glm::dvec3& normal, double d, double w) {
+                a2 += w * normal.x * normal.x;
+                b2 += w * normal.y * normal.y;
+                c2 += w * normal.z * normal.z;
+                ab += w * normal.x * normal.y;
+                ac += w * normal.x * normal.z;
+                bc += w * normal.y * normal.z;
+                ad += w * normal.x * d;
+                bd += w * normal.y * d;
+                cd += w * normal.z * d;
+                d2 += w * d * d;
+                weight += w;
+            }
+
+            void add(const Quadric& q) {
+                a2 += q.a2; b2 += q.b2; c2 += q.c2;
+                ab += q.ab; ac += q.ac; bc += q.bc;
+                ad += q.ad; bd += q.bd; cd += q.cd;
+                d2 += q.d2;
+                weight += q.weight;
+            }
+
+            /** Weighted mean of the squared distances, so the error is in the mesh's units squared. */
+            double error(const glm::vec3& p) const {
+                double x = p.x, y = p.y, z = p.z;
+                double sum = a2 * x * x + b2 * y * y + c2 * z * z + 2.0 * (ab * x * y + ac * x * z + bc * y * z) +
+                             2.0 * (ad * x + bd * y + cd * z) + d2;
+                return weight > 0.0 ? std::max(sum, 0.0) / weight : 0.0;
+            }
+        };
+
+        /** \brief The state of a simplification, which can be carried on to lower targets.
+         *
+         * Vertices with the same position are welded into one position vertex, the first of
+         * them, which is what the edges, quadrics and collapses work on. The copies only come
+         * back in when the indices are rewritten.
+         */
+        class Simplifier {
+        public:
+            Simplifier(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices);
+
+            void simplify(uint32_t targetIndexCount) {
+                while (indices_.size() > targetIndexCount && collapsePass(targetIndexCount / 3)) {}
+            }
+            const std::vector<uint32_t>& indices() const { return indices_; }
+            float error() const { return static_cast<float>(std::sqrt(maxCost)); }
+
+        private:
+            struct Collapse {
+                uint32_t from, to;
+                double cost;
+            };
+
+            const glm::vec3& pos(uint32_t vertex) const { return vertices[vertex].pos; }
+            bool collapsePass(uint32_t targetTriangles);
+            /** The copy of position vertex to closest to vertex in normal and color. */
+            uint32_t closestCopy(uint32_t vertex, uint32_t to) const;
+
+            const std::vector<Vertex>& vertices;
+            std::vector<uint32_t> indices_;
+            std::vector<uint32_t> position;  // vertex -> its position vertex
+            std::vector<uint32_t> nextCopy;  // circular list of the vertices with the same position
+            std::vector<Quadric> quadrics;   // by position vertex
+            double maxCost = 0.0;
+        };
+
+        Simplifier::Simplifier(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
+                : vertices(vertices), indices_(indices) {
+            uint32_t vertexCount = static_cast<uint32_t>(vertices.size());
+            std::vector<uint32_t> order(vertexCount);
+            std::iota(order.begin(), order.end(), 0);
+            auto less = [&](uint32_t a, uint32_t b) {
+                const glm::vec3& pa = vertices[a].pos;
+                const glm::vec3& pb = vertices[b].pos;
+                if (pa.x != pb.x)
+                    return pa.x < pb.x;
+                if (pa.y != pb.y)
+                    return pa.y < pb.y;
+                if (pa.z != pb.z)
+                    return pa.z < pb.z;
+                return a < b;
+            };
+            std::sort(order.begin(), order.end(), less);
+            position.resize(vertexCount);
+            nextCopy.resize(vertexCount);
+            for (uint32_t first = 0; first < vertexCount;) {
+                uint32_t last = first + 1;
+                while (last < vertexCount && vertices[order[last]].pos == vertices[order[first]].pos)
+                    ++last;
+                for (uint32_t i = first; i < last; ++i) {
+                    position[order[i]] = order[first];
+                    nextCopy[order[i]] = order[i + 1 < last ? i + 1 : first];
+                }
+                first = last;
+            }
+
+            quadrics.resize(vertexCount);
+            std::vector<uint64_t> directedEdges;
+            directedEdges.reserve(indices_.size());
+            for (size_t i = 0; i + 2 < indices_.size(); i += 3) {
+                uint32_t corners[3] = { position[indices_[i]], position[indices_[i + 1]], position[indices_[i + 2]] };
+                glm::dvec3 p0 = pos(corners[0]), p1 = pos(corners[1]), p2 = pos(corners[2]);
+                glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+                double length = glm::length(normal);
+                if (length == 0.0)
+                    continue;
+                normal /= length;
+                for (uint32_t corner : corners)
+                    quadrics[corner].addPlane(normal, -glm::dot(normal, p0), 0.5 * length);
+                for (int k = 0; k < 3; ++k)
+                    directedEdges.push_back(uint64_t(corners[k]) << 32 | corners[(k + 1) % 3]);
+            }
+
+            // an edge that only one triangle walks is on the border, and gets a plane through it
+            // at right angles to the triangle, which keeps the border from moving inwards
+            std::sort(directedEdges.begin(), directedEdges.end());
+            for (size_t i = 0; i + 2 < indices_.size(); i += 3) {
+                uint32_t corners[3] = { position[indices_[i]], position[indices_[i + 1]], position[indices_[i + 2]] };
+                glm::dvec3 p0 = pos(corners[0]), p1 = pos(corners[1]), p2 = pos(corners[2]);
+                glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+                if (glm::length(normal) == 0.0)
+                    continue;
+                for (int k = 0; k < 3; ++k) {
+                    uint32_t a = corners[k], b = corners[(k + 1) % 3];
+                    if (std::binary_search(directedEdges.begin(), directedEdges.end(), uint64_t(b) << 32 | a))
+                        continue;
+                    glm::dvec3 edge = glm::dvec3(pos(b)) - glm::dvec3(pos(a));
+                    glm::dvec3 borderNormal = glm::cross(edge, normal);
+                    double length = glm::length(borderNormal);
+                    if (length == 0.0)
+                        continue;
+                    borderNormal /= length;
+                    double d = -glm::dot(borderNormal, glm::dvec3(pos(a)));
+                    double w = BORDER_WEIGHT * glm::dot(edge, edge);
+                    quadrics[a].addPlane(borderNormal, d, w);
+                    quadrics[b].addPlane(borderNormal, d, w);
+                }
+            }
+        }
+
+        uint32_t Simplifier::closestCopy(uint32_t vertex, uint32_t to) const {
+            uint32_t best = to;
+            float bestDistance = std::numeric_limits<float>::max();
+            uint32_t copy = to;
+            do {
+                glm::vec3 normal = vertices[copy].normal - vertices[vertex].normal;
+                glm::vec3 color = vertices[copy].color - vertices[vertex].color;
+                float distance = glm::dot(normal, normal) + glm::dot(color, color);
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    best = copy;
+                }
+                copy = nextCopy[copy];
+            } while (copy != to);
+            return best;
+        }
+
+        bool Simplifier::collapsePass(uint32_t targetTriangles) {
+            uint32_t vertexCount = static_cast<uint32_t>(vertices.size());
+            uint32_t triangleCount = static_cast<uint32_t>(indices_.size() / 3);
+
+            // every edge once, collapsed in whichever direction is cheaper
+            std::vector<uint64_t> edges;
+            edges.reserve(indices_.size());
+            for (size_t i = 0; i < indices_.size(); i += 3) {
+                for (int k = 0; k < 3; ++k) {
+                    uint32_t a = position[indices_[i + k]], b = position[indices_[i + (k + 1) % 3]];
+                    edges.push_back(uint64_t(std::min(a, b)) << 32 | std::max(a, b));
+                }
+            }
+            std::sort(edges.begin(), edges.end());
+            edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+            std::vector<Collapse> collapses(edges.size());
+            for (size_t i = 0; i < edges.size(); ++i) {
+                uint32_t a = static_cast<uint32_t>(edges[i] >> 32), b = static_cast<uint32_t>(edges[i]);
+                Quadric q = quadrics[a];
+                q.add(quadrics[b]);
+                double toB = q.error(pos(b)), toA = q.error(pos(a));
+                collapses[i] = toB <= toA ? Collapse{ a, b, toB } : Collapse{ b, a, toA };
+            }
+            std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+            // the triangles around each position vertex, for the flip test
+            std::vector<uint32_t> firstTriangle(vertexCount + 1, 0);
+            for (uint32_t index : indices_)
+                firstTriangle[position[index] + 1]++;
+            for (uint32_t v = 0; v < vertexCount; ++v)
+                firstTriangle[v + 1] += firstTriangle[v];
+            std::vector<uint32_t> triangles(indices_.size());
+            std::vector<uint32_t> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+            for (uint32_t i = 0; i < indices_.size(); ++i)
+                triangles[fill[position[indices_[i]]]++] = i / 3;
+
+            // a vertex takes part in at most one collapse per pass, so the triangles around
+            // the others only ever have corners that moved once
+            std::vector<uint32_t> target(vertexCount);
+            std::iota(target.begin(), target.end(), 0);
+            std::vector<bool> locked(vertexCount, false);
+            uint32_t remaining = triangleCount;
+            uint32_t collapsed = 0;
+            for (const Collapse& collapse : collapses) {
+                if (remaining <= targetTriangles)
+                    break;
+                if (locked[collapse.from] || locked[collapse.to])
+                    continue;
+
+                uint32_t removed = 0;
+                bool flips = false;
+                for (uint32_t t = firstTriangle[collapse.from]; t < firstTriangle[collapse.from + 1] && !flips; ++t) {
+                    uint32_t triangle = triangles[t];
+                    uint32_t corners[3];
+                    for (int k = 0; k < 3; ++k)
+                        corners[k] = target[position[indices_[triangle * 3 + k]]];
+                    if (corners[0] == collapse.to || corners[1] == collapse.to || corners[2] == collapse.to) {
+                        removed++;
+                        continue;
+                    }
+                    glm::vec3 before = glm::cross(pos(corners[1]) - pos(corners[0]), pos(corners[2]) - pos(corners[0]));
+                    for (uint32_t& corner : corners) {
+                        if (corner == collapse.from)
+                            corner = collapse.to;
+                    }
+                    glm::vec3 after = glm::cross(pos(corners[1]) - pos(corners[0]), pos(corners[2]) - pos(corners[0]));
+                    flips = glm::dot(before, after) <= 0.0f;
+                }
+                if (flips)
+                    continue;
+
+                target[collapse.from] = collapse.to;
+                quadrics[collapse.to].add(quadrics[collapse.from]);
+                locked[collapse.from] = true;
+                locked[collapse.to] = true;
+                maxCost = std::max(maxCost, collapse.cost);
+                remaining -= std::min(removed, remaining);
+                collapsed++;
+            }
+            if (collapsed == 0)
+                return false;
+
+            // move every copy of a collapsed position, and drop the triangles that collapsed
+            const uint32_t UNSET = ~0u;
+            std::vector<uint32_t> moved(vertexCount, UNSET);
+            size_t kept = 0;
+            for (size_t i = 0; i < indices_.size(); i += 3) {
+                uint32_t triangle[3];
+                for (int k = 0; k < 3; ++k) {
+                    uint32_t vertex = indices_[i + k];
+                    uint32_t to = target[position[vertex]];
+                    if (to != position[vertex]) {
+                        if (moved[vertex] == UNSET)
+                            moved[vertex] = closestCopy(vertex, to);
+                        vertex = moved[vertex];
+                    }
+                    triangle[k] = vertex;
+                }
+                if (position[triangle[0]] == position[triangle[1]] || position[triangle[1]] == position[triangle[2]] ||
+                        position[triangle[0]] == position[triangle[2]])
+                    continue;
+                for (int k = 0; k < 3; ++k)
+                    indices_[kept++] = triangle[k];
+            }
+            indices_.resize(kept);
+            return true;
+        }
+
+    } // namespace anonymous
+
+    VertexCacheStats analyzeVertexCache(const std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize) {
+        VertexCacheStats stats;
+        FifoCache cache(vertexCount, cacheSize);
+        std::vector<bool> used(vertexCount, false);
+        uint32_t usedCount = 0;
+        for (uint32_t index : indices) {
+            stats.verticesTransformed += cache.access(index);
+            if (!used[index]) {
+                used[index] = true;
+                usedCount++;
+            }
+        }
+        if (!indices.empty()) {
+            stats.acmr = stats.verticesTransformed / float(indices.size() / 3);
+            stats.atvr = stats.verticesTransformed / float(usedCount);
+        }
+        return stats;
+    }
+
+    void optimizeVertexCache(std::vector<uint32_t>& indices, uint32_t vertexCount, std::vector<uint32_t>* clusters,
+                             uint32_t cacheSize) {
+        size_t triangleCount = indices.size() / 3;
+        if (clusters)
+            clusters->clear();
+
+        // triangles around each vertex, and how many of those haven't been emitted yet
+        std::vector<uint32_t> live(vertexCount, 0);
+        for (uint32_t index : indices)
+            live[index]++;
+        std::vector<uint32_t> offsets(vertexCount + 1, 0);
+        for (uint32_t v = 0; v < vertexCount; ++v)
+            offsets[v + 1] = offsets[v] + live[v];
+        std::vector<uint32_t> adjacency(indices.size());
+        {
+            std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+            for (size_t i = 0; i < indices.size(); ++i)
+                adjacency[cursor[indices[i]]++] = static_cast<uint32_t>(i / 3);
+        }
+
+        FifoCache cache(vertexCount, cacheSize);
+        std::vector<bool> emitted(triangleCount, false);
+        std::vector<uint32_t> deadEnds; // recently used vertices, to restart from when a fan runs out
+        std::vector<uint32_t> candidates;
+        std::vector<uint32_t> output;
+        output.reserve(indices.size());
+        uint32_t nextVertex = 0;
+
+        // the most recent vertex that still has triangles, or failing that the first one
+        auto skipDeadEnd = [&]() -> int64_t {
+            while (!deadEnds.empty()) {
+                uint32_t vertex = deadEnds.back();
+                deadEnds.pop_back();
+                if (live[vertex] > 0)
+                    return vertex;
+            }
+            for (; nextVertex < vertexCount; ++nextVertex) {
+                if (live[nextVertex] > 0)
+                    return nextVertex;
+            }
+            return -1;
+        };
+
+        int64_t fanning = skipDeadEnd();
+        bool jumped = true;
+        while (fanning >= 0) {
+            if (jumped && clusters)
+                clusters->push_back(static_cast<uint32_t>(output.size() / 3));
+
+            candidates.clear();
+            for (uint32_t k = offsets[fanning]; k < offsets[fanning + 1]; ++k) {
+                uint32_t triangle = adjacency[k];
+                if (emitted[triangle])
+                    continue;
+                emitted[triangle] = true;
+                for (int corner = 0; corner < 3; ++corner) {
+                    uint32_t vertex = indices[3 * triangle + corner];
+                    output.push_back(vertex);
+                    deadEnds.push_back(vertex);
+                    candidates.push_back(vertex);
+                    live[vertex]--;
+                    cache.access(vertex);
+                }
+            }
+
+            // prefer the oldest vertex that will still be in the cache after its whole fan is
+            // emitted, since it's the one about to be evicted
+            int64_t best = -1;
+            int64_t bestPriority = -1;
+            for (uint32_t vertex : candidates) {
+                if (live[vertex] == 0)
+                    continue;
+                int64_t priority = 0;
+                uint32_t age = cache.time - cache.stamps[vertex];
+                if (age + 2 * live[vertex] <= cacheSize)
+                    priority = age;
+                if (priority > bestPriority) {
+                    best = vertex;
+                    bestPriority = priority;
+                }
+            }
+            jumped = best < 0;
+            fanning = jumped ? skipDeadEnd() : best;
+        }
+
+        indices.swap(output);
+    }
+
+    void optimizeOverdraw(std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices,
+                          const std::vector<uint32_t>& clusters, float threshold, uint32_t* clusterCount) {
+        uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+        if (triangleCount == 0)
+            return;
+
+        // split the hard clusters wherever a run has an ACMR within threshold of its cluster's
+        std::vector<uint32_t> boundaries;
+        FifoCache cache(static_cast<uint32_t>(vertices.size()), VERTEX_CACHE_SIZE);
+        auto triangleMisses = [&](uint32_t triangle) {
+            return cache.access(indices[3 * triangle]) + cache.access(indices[3 * triangle + 1]) +
+                   cache.access(indices[3 * triangle + 2]);
+        };
+        for (size_t c = 0; c < clusters.size(); ++c) {
+            uint32_t start = clusters[c];
+            uint32_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+
+            cache.flush();
+            uint32_t misses = 0;
+            for (uint32_t t = start; t < end; ++t)
+                misses += triangleMisses(t);
+            float clusterThreshold = threshold * misses / float(end - start);
+
+            cache.flush();
+            uint32_t runStart = start, runMisses = 0;
+            for (uint32_t t = start; t < end; ++t) {
+                runMisses += triangleMisses(t);
+                if (runMisses / float(t - runStart + 1) <= clusterThreshold) {
+                    boundaries.push_back(runStart);
+                    runStart = t + 1;
+                    runMisses = 0;
+                    cache.flush();
+                }
+            }
+            if (runStart < end)
+                boundaries.push_back(runStart);
+        }
+        if (boundaries.empty())
+            boundaries.push_back(0);
+
+        // area weighted centroid and normal of every cluster, and of the whole mesh
+        struct Cluster {
+            uint32_t start, end;
+            glm::vec3 centroid;
+            glm::vec3 normal;
+            float area;
+            float sortKey;
+        };
+        std::vector<Cluster> sorted(boundaries.size());
+        glm::vec3 meshCentroid(0.0f);
+        float meshArea = 0.0f;
+        for (size_t c = 0; c < boundaries.size(); ++c) {
+            Cluster& cluster = sorted[c];
+            cluster.start = boundaries[c];
+            cluster.end = c + 1 < boundaries.size() ? boundaries[c + 1] : triangleCount;
+            cluster.centroid = cluster.normal = glm::vec3(0.0f);
+            cluster.area = 0.0f;
+            for (uint32_t t = cluster.start; t < cluster.end; ++t) {
+                const glm::vec3& a = vertices[indices[3 * t]].pos;
+                const glm::vec3& b = vertices[indices[3 * t + 1]].pos;
+                const glm::vec3& d = vertices[indices[3 * t + 2]].pos;
+                glm::vec3 normal = glm::cross(b - a, d - a);
+                float area = glm::length(normal);
+                cluster.centroid += (a + b + d) * (area / 3.0f);
+                cluster.normal += normal;
+                cluster.area += area;
+            }
+            meshCentroid += cluster.centroid;
+            meshArea += cluster.area;
+            if (cluster.area > 0.0f)
+                cluster.centroid /= cluster.area;
+        }
+        if (meshArea > 0.0f)
+            meshCentroid /= meshArea;
+
+        for (Cluster& cluster : sorted) {
+            float length = glm::length(cluster.normal);
+            cluster.sortKey = length > 0.0f ? glm::dot(cluster.centroid - meshCentroid, cluster.normal / length) : 0.0f;
+        }
+        std::stable_sort(sorted.begin(), sorted.end(), [](const Cluster& a, const Cluster& b) {
+            return a.sortKey > b.sortKey;
+        });
+
+        std::vector<uint32_t> output;
+        output.reserve(indices.size());
+        for (const Cluster& cluster : sorted)
+            output.insert(output.end(), indices.begin() + 3 * cluster.start, indices.begin() + 3 * cluster.end);
+        indices.swap(output);
+        if (clusterCount)
+            *clusterCount = static_cast<uint32_t>(sorted.size());
+    }
+
+    void optimizeVertexFetch(MeshData& mesh) {
+        const uint32_t UNUSED = ~0u;
+        std::vector<uint32_t> remap(mesh.vertices.size(), UNUSED);
+        std::vector<Vertex> vertices;
+        vertices.reserve(mesh.vertices.size());
+        for (uint32_t& index : mesh.indices) {
+            if (remap[index] == UNUSED) {
+                remap[index] = static_cast<uint32_t>(vertices.size());
+                vertices.push_back(mesh.vertices[index]);
+            }
+            index = remap[index];
+        }
+        // the levels of detail only use vertices the full mesh uses too
+        for (MeshLod& lod : mesh.lods) {
+            for (uint32_t& index : lod.indices)
+                index = remap[index];
+        }
+        mesh.vertices.swap(vertices);
+    }
+
+    void optimizeMesh(MeshData& mesh, MeshOptimizeStats* stats) {
+        auto start = std::chrono::high_resolution_clock::now();
+        uint32_t vertexCount = static_cast<uint32_t>(mesh.vertices.size());
+        MeshOptimizeStats result;
+        result.before = analyzeVertexCache(mesh.indices, vertexCount);
+
+        // overdraw only shuffles whole clusters of the cache optimized order, and the fetch
+        // remap only renames vertices, so neither undoes the work of the passes before it
+        std::vector<uint32_t> clusters;
+        optimizeVertexCache(mesh.indices, vertexCount, &clusters);
+        optimizeOverdraw(mesh.indices, mesh.vertices, clusters, 1.05f, &result.clusters);
+        optimizeVertexFetch(mesh);
+
+        result.after = analyzeVertexCache(mesh.indices, static_cast<uint32_t>(mesh.vertices.size()));
+        result.milliseconds = std::chrono::duration<double, std::milli>(
+                std::chrono::high_resolution_clock::now() - start).count();
+        if (stats)
+            *stats = result;
+    }
+
+    float simplifyMesh(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, uint32_t targetIndexCount) {
+        Simplifier simplifier(vertices, indices);
+        simplifier.simplify(targetIndexCount);
+        indices = simplifier.indices();
+        return simplifier.error();
+    }
+
+    void generateLods(MeshData& mesh, uint32_t maxLevels, float ratio) {
+        mesh.lods.clear();
+        Simplifier simplifier(mesh.vertices, mesh.indices);
+        size_t previous = mesh.indices.size();
+        while (mesh.lods.size() + 1 < maxLevels) {
+            uint32_t targetTriangles = static_cast<uint32_t>(previous / 3 * ratio);
+            if (targetTriangles < MIN_LOD_TRIANGLES)
+                break;
+            simplifier.simplify(targetTriangles * 3);
+            // stuck, on a mesh that is mostly borders, or where every collapse would flip something
+            const std::vector<uint32_t>& indices = simplifier.indices();
+            if (indices.empty() || indices.size() > previous * MIN_LOD_REDUCTION)
+                break;
+
+            MeshLod lod;
+            lod.indices = indices;
+            lod.error = simplifier.error();
+            optimizeVertexCache(lod.indices, static_cast<uint32_t>(mesh.vertices.size()));
+            mesh.lods.push_back(std::move(lod));
+            previous = indices.size();
+        }
+    }
+
+} // namespace graphics
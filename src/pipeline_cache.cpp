@@ -0,0 +1,122 @@
+#include "pipeline_cache.hpp"
+#include "graphics_api.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace graphics {
+
+    std::string pipelineCachePath = "pipeline_cache.bin";
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+
+    namespace {
+
+        PipelineCacheStats stats;
+
+        std::vector<char> readCacheFile(const std::string& filename) {
+            std::ifstream file(filename, std::ios::ate | std::ios::binary);
+            if (!file)
+                return {};
+
+            size_t fileSize = (size_t) file.tellg();
+            std::vector<char> buffer(fileSize);
+            file.seekg(0);
+            file.read(buffer.data(), fileSize);
+            return buffer;
+        }
+
+        /** Check that the cache data was created by this exact device and driver. */
+        bool isCacheCompatible(const std::vector<char>& data) {
+            VkPipelineCacheHeaderVersionOne header;
+            if (data.size() < sizeof(header))
+                return false;
+            memcpy(&header, data.data(), sizeof(header));
+
+            VkPhysicalDeviceProperties deviceProperties;
+            vkGetPhysicalDeviceProperties(physicalDeviceInfo.device, &deviceProperties);
+
+            return header.headerSize >= sizeof(header) &&
+                   header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+                   header.vendorID == deviceProperties.vendorID &&
+                   header.deviceID == deviceProperties.deviceID &&
+                   memcmp(header.pipelineCacheUUID, deviceProperties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+        }
+
+    } // namespace anonymous
+
+    bool createPipelineCache() {
+        std::vector<char> data = readCacheFile(pipelineCachePath);
+        if (!data.empty() && !isCacheCompatible(data)) {
+            std::cout << "Ignoring pipeline cache '" << pipelineCachePath << "' from a different device or driver" << std::endl;
+            data.clear();
+        }
+
+        VkPipelineCacheCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        createInfo.initialDataSize = data.size();
+        createInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+        VkResult ret = vkCreatePipelineCache(logicalDevice, &createInfo, nullptr, &pipelineCache);
+        if (ret != VK_SUCCESS && !data.empty()) {
+            // the header matched but the driver still didn't like it, so start from scratch
+            createInfo.initialDataSize = 0;
+            createInfo.pInitialData = nullptr;
+            ret = vkCreatePipelineCache(logicalDevice, &createInfo, nullptr, &pipelineCache);
+        }
+
+        stats = {};
+        stats.loadedBytes = createInfo.initialDataSize;
+        return ret == VK_SUCCESS;
+    }
+
+    void destroyPipelineCache() {
+        if (pipelineCache == VK_NULL_HANDLE)
+            return;
+
+        size_t size = 0;
+        std::vector<char> data;
+        if (vkGetPipelineCacheData(logicalDevice, pipelineCache, &size, nullptr) == VK_SUCCESS && size) {
+            data.resize(size);
+            if (vkGetPipelineCacheData(logicalDevice, pipelineCache, &size, data.data()) != VK_SUCCESS)
+                data.clear();
+            data.resize(size);
+        }
+        vkDestroyPipelineCache(logicalDevice, pipelineCache, nullptr);
+        pipelineCache = VK_NULL_HANDLE;
+
+        if (data.empty())
+            return;
+
+        std::string tmpPath = pipelineCachePath + ".tmp";
+        {
+            std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+            file.write(data.data(), data.size());
+            if (!file) {
+                std::cout << "Failed to write pipeline cache to '" << tmpPath << "'" << std::endl;
+                return;
+            }
+        }
+
+        std::error_code ec;
+        fs::rename(tmpPath, pipelineCachePath, ec);
+        if (ec) {
+            std::cout << "Failed to save pipeline cache: " << ec.message() << std::endl;
+            fs::remove(tmpPath, ec);
+        }
+    }
+
+    void recordPipelineCreation(double milliseconds) {
+        stats.pipelinesCreated++;
+        stats.creationMilliseconds += milliseconds;
+    }
+
+    PipelineCacheStats getPipelineCacheStats() {
+        return stats;
+    }
+
+} // namespace graphics
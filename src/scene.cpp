@@ -0,0 +1,105 @@
+#include "scene.hpp"
+#include "graphics_api.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace graphics {
+
+    uint32_t Scene::add(const Mesh& mesh, const glm::mat4& model) {
+        uint32_t object;
+        if (!freeObjects.empty()) {
+            object = freeObjects.back();
+            freeObjects.pop_back();
+        } else {
+            object = static_cast<uint32_t>(objects.size());
+            objects.push_back({});
+            boundsMin.emplace_back();
+            boundsMax.emplace_back();
+        }
+        objects[object] = { &mesh, model, 0 };
+        updateBounds(object);
+        return object;
+    }
+
+    void Scene::remove(uint32_t object) {
+        objects[object].mesh = nullptr;
+        freeObjects.push_back(object);
+        updateBounds(object);
+    }
+
+    void Scene::setTransform(uint32_t object, const glm::mat4& model) {
+        objects[object].model = model;
+        updateBounds(object);
+    }
+
+    void Scene::updateBounds(uint32_t object) {
+        if (objects[object].mesh) {
+            const Mesh& mesh = *objects[object].mesh;
+            glm::vec3 center, halfExtent;
+            transformBox(objects[object].model, mesh.boundsMin, mesh.boundsMax, center, halfExtent);
+            boundsMin[object] = center - halfExtent;
+            boundsMax[object] = center + halfExtent;
+        } else {
+            // an empty box, which no query ever returns
+            boundsMin[object] = glm::vec3(std::numeric_limits<float>::max());
+            boundsMax[object] = glm::vec3(-std::numeric_limits<float>::max());
+        }
+        moved.push_back(object);
+    }
+
+    void Scene::updateBvh() {
+        // new objects don't have a place in the tree yet
+        if (bvh_.size() != objects.size()) {
+            bvh_.build(boundsMin.data(), boundsMax.data(), static_cast<uint32_t>(objects.size()));
+            builtCost = bvh_.stats().cost;
+            moved.clear();
+            return;
+        }
+        if (moved.empty())
+            return;
+
+        // refitting everything is a single pass over the nodes, cheaper than walking up from
+        // each of a large number of objects
+        if (moved.size() > objects.size() / 4) {
+            bvh_.refit(boundsMin.data(), boundsMax.data());
+        } else {
+            for (uint32_t object : moved)
+                bvh_.update(object, boundsMin[object], boundsMax[object]);
+        }
+        moved.clear();
+
+        if (bvh_.stats().cost > builtCost * SCENE_REBUILD_COST_RATIO) {
+            bvh_.build(boundsMin.data(), boundsMax.data(), static_cast<uint32_t>(objects.size()));
+            builtCost = bvh_.stats().cost;
+        }
+    }
+
+    uint32_t Scene::submitVisible(const glm::mat4& view, const glm::mat4& proj) {
+        PROFILE_SCOPE("scene culling");
+        updateBvh();
+        visible.clear();
+        bvh_.cullFrustum(extractFrustum(proj * view), visible);
+        // in the order the objects were added, which usually keeps the same meshes together
+        std::sort(visible.begin(), visible.end());
+        glm::vec3 camera = glm::vec3(glm::inverse(view)[3]);
+        float pixelScale = lodPixelScale(proj);
+        for (uint32_t object : visible) {
+            Object& o = objects[object];
+            o.lod = levelOfDetail ? selectLod(*o.mesh, o.model, camera, pixelScale, o.lod) : 0;
+            submitCulledDraw(*o.mesh, o.model, o.lod);
+        }
+        return static_cast<uint32_t>(visible.size());
+    }
+
+    bool Scene::pick(const glm::vec3& origin, const glm::vec3& direction, uint32_t& object, float& distance) {
+        updateBvh();
+        return bvh_.raycast(origin, direction, std::numeric_limits<float>::max(), object, distance);
+    }
+
+    void Scene::query(const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::vector<uint32_t>& result) {
+        updateBvh();
+        bvh_.queryBox(boundsMin, boundsMax, result);
+    }
+
+} // namespace graphics
@@ -0,0 +1,73 @@
+#include "shader_registry.hpp"
+#include "graphics_api.hpp"
+
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+namespace graphics {
+
+    namespace {
+
+        /** A module along with its code, to tell hash collisions apart. */
+        struct ModuleEntry {
+            std::vector<uint32_t> code;
+            VkShaderModule module;
+        };
+
+        std::unordered_multimap<uint64_t, ModuleEntry> modulesByHash;
+        ShaderRegistryStats stats;
+
+        /** 64 bit FNV-1a, over whole words since SPIR-V is always a multiple of 4 bytes. */
+        uint64_t hashSpirv(const uint32_t* code, size_t size) {
+            uint64_t hash = 14695981039346656037ull;
+            for (size_t i = 0; i < size / 4; ++i) {
+                hash ^= code[i];
+                hash *= 1099511628211ull;
+            }
+            return hash ^ size;
+        }
+
+    } // namespace anonymous
+
+    bool getShaderModule(const uint32_t* code, size_t size, VkShaderModule& module) {
+        stats.lookups++;
+        if (size == 0 || size % 4 != 0)
+            return false;
+
+        uint64_t hash = hashSpirv(code, size);
+        auto range = modulesByHash.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            const std::vector<uint32_t>& cached = it->second.code;
+            if (cached.size() * 4 == size && memcmp(cached.data(), code, size) == 0) {
+                module = it->second.module;
+                return true;
+            }
+        }
+
+        // Have to wrap the shader bytecode in a VkShaderModule. Compilation and linking does not
+        // happen until the graphics pipeline is created.
+        VkShaderModuleCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        createInfo.codeSize = size;
+        createInfo.pCode = code;
+        if (vkCreateShaderModule(logicalDevice, &createInfo, nullptr, &module) != VK_SUCCESS)
+            return false;
+
+        stats.modulesCreated++;
+        modulesByHash.insert({ hash, { std::vector<uint32_t>(code, code + size / 4), module } });
+        return true;
+    }
+
+    void destroyShaderRegistry() {
+        for (auto& entry : modulesByHash)
+            vkDestroyShaderModule(logicalDevice, entry.second.module, nullptr);
+        modulesByHash.clear();
+        stats = ShaderRegistryStats();
+    }
+
+    ShaderRegistryStats getShaderRegistryStats() {
+        return stats;
+    }
+
+} // namespace graphics
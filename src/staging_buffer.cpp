@@ -0,0 +1,423 @@
+#include "staging_buffer.hpp"
+#include "graphics_api.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <unordered_set>
+#include <vector>
+
+namespace graphics {
+
+    namespace {
+
+        const VkDeviceSize STAGING_RING_SIZE = 32 * 1024 * 1024;
+        // a single upload never takes more than this much of the ring at a time, so that big
+        // uploads get split up and can overlap with the GPU copying the earlier pieces
+        const VkDeviceSize MAX_CHUNK_SIZE = STAGING_RING_SIZE / 4;
+        const uint32_t NUM_UPLOAD_BATCHES = 8;
+
+        // stages that can read an uploaded buffer, and how they read it
+        const VkPipelineStageFlags CONSUMER_STAGES = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+            VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        const VkAccessFlags CONSUMER_ACCESS = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+            VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+
+        struct UploadBatch {
+            VkCommandBuffer commandBuffer;
+            VkFence fence;
+            uint64_t ringEnd; // ring position after the last byte this batch used
+
+            // only used with a dedicated transfer queue: the buffers that need their ownership
+            // moved to the graphics family, and the graphics side of that transfer
+            std::vector<VkBufferMemoryBarrier> ownershipBarriers;
+            std::unordered_set<VkBuffer> transferredBuffers;
+            VkCommandBuffer acquireCommandBuffer;
+            VkSemaphore transferDone;
+            // the buffers the graphics family has to release to the transfer family before the
+            // copies, and the command buffer doing that on the graphics queue
+            std::vector<VkBufferMemoryBarrier> releaseBarriers;
+            VkCommandBuffer releaseCommandBuffer;
+            VkSemaphore releaseDone;
+        };
+
+        VkBuffer ringBuffer;
+        Allocation ringAllocation;
+        uint8_t* ringData;
+        VkDeviceSize ringAlignment = 16;
+        // head and tail only ever increase, the actual offset into the ring is % ring size
+        uint64_t ringHead = 0;
+        uint64_t ringTail = 0;
+
+        bool dedicatedTransferQueue = false;
+        VkCommandPool uploadCommandPool;
+        VkCommandPool acquireCommandPool;
+        UploadBatch batches[NUM_UPLOAD_BATCHES];
+        uint32_t nextBatch = 0;
+        int recordingBatch = -1;
+        std::deque<uint32_t> inFlightBatches; // oldest first
+        // buffers handed over to the graphics family by an earlier batch
+        std::unordered_set<VkBuffer> graphicsOwnedBuffers;
+        UploadStats stats;
+
+        /** Reclaim the ring space of the oldest in-flight batch, waiting on it if needed. */
+        void retireOldestBatch(bool wait) {
+            UploadBatch& batch = batches[inFlightBatches.front()];
+            if (wait)
+                vkWaitForFences(logicalDevice, 1, &batch.fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+            ringTail = batch.ringEnd;
+            inFlightBatches.pop_front();
+        }
+
+        /** Same as retireOldestBatch(true), but counted as a stall since an upload had to wait. */
+        void stallOnOldestBatch() {
+            auto start = std::chrono::high_resolution_clock::now();
+            retireOldestBatch(true);
+            auto end = std::chrono::high_resolution_clock::now();
+            stats.stalls++;
+            stats.stallMilliseconds += std::chrono::duration<double, std::milli>(end - start).count();
+        }
+
+        /** Reclaim the space of every batch the GPU is already done with, without blocking. */
+        void retireFinishedBatches() {
+            while (!inFlightBatches.empty() &&
+                   vkGetFenceStatus(logicalDevice, batches[inFlightBatches.front()].fence) == VK_SUCCESS)
+            {
+                retireOldestBatch(false);
+            }
+        }
+
+        bool beginBatch() {
+            // the batch slot might still be in flight from NUM_UPLOAD_BATCHES flushes ago
+            while (std::find(inFlightBatches.begin(), inFlightBatches.end(), nextBatch) != inFlightBatches.end())
+                stallOnOldestBatch();
+
+            UploadBatch& batch = batches[nextBatch];
+            vkResetCommandBuffer(batch.commandBuffer, 0);
+            batch.ownershipBarriers.clear();
+            batch.transferredBuffers.clear();
+            batch.releaseBarriers.clear();
+
+            VkCommandBufferBeginInfo beginInfo = {};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            if (vkBeginCommandBuffer(batch.commandBuffer, &beginInfo) != VK_SUCCESS)
+                return false;
+
+            recordingBatch = nextBatch;
+            nextBatch = (nextBatch + 1) % NUM_UPLOAD_BATCHES;
+            return true;
+        }
+
+        /** \brief Queue up the release / acquire of a buffer the batch is about to copy into.
+         *
+         * Ownership moves a whole buffer at a time, so that the parts the copies don't touch keep
+         * their contents. If the graphics family owns the buffer from an earlier upload, the
+         * transfer family acquires it here, before the copy is recorded, and the matching release
+         * is recorded for the graphics queue when the batch is submitted.
+         */
+        void addOwnershipTransfer(UploadBatch& batch, VkBuffer buffer) {
+            if (!batch.transferredBuffers.insert(buffer).second)
+                return;
+
+            VkBufferMemoryBarrier barrier = {};
+            barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.srcQueueFamilyIndex = physicalDeviceInfo.indices.transferFamily;
+            barrier.dstQueueFamilyIndex = physicalDeviceInfo.indices.graphicsFamily;
+            barrier.buffer = buffer;
+            barrier.offset = 0;
+            barrier.size = VK_WHOLE_SIZE;
+            batch.ownershipBarriers.push_back(barrier);
+
+            if (graphicsOwnedBuffers.count(buffer) == 0)
+                return;
+            barrier.srcQueueFamilyIndex = physicalDeviceInfo.indices.graphicsFamily;
+            barrier.dstQueueFamilyIndex = physicalDeviceInfo.indices.transferFamily;
+            batch.releaseBarriers.push_back(barrier);
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            // the semaphore wait happens at the transfer stage, so start the barrier there too
+            vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                0, 0, nullptr, 1, &barrier, 0, nullptr);
+        }
+
+        /** Reserve size bytes of contiguous ring space. Returns the offset into the ring. */
+        bool allocateRingSpace(VkDeviceSize size, VkDeviceSize& offset) {
+            size = (size + ringAlignment - 1) & ~(ringAlignment - 1);
+
+            // don't let an allocation wrap around the end of the ring
+            VkDeviceSize pos = ringHead % STAGING_RING_SIZE;
+            VkDeviceSize padding = pos + size > STAGING_RING_SIZE ? STAGING_RING_SIZE - pos : 0;
+
+            retireFinishedBatches();
+            while (ringHead + padding + size - ringTail > STAGING_RING_SIZE) {
+                if (inFlightBatches.empty()) {
+                    // the batch being recorded is what's using up the ring, so send it off
+                    if (!flushUploads() || inFlightBatches.empty())
+                        return false;
+                }
+                stallOnOldestBatch();
+            }
+
+            ringHead += padding;
+            offset = ringHead % STAGING_RING_SIZE;
+            ringHead += size;
+            return true;
+        }
+
+        /** \brief Submit a batch on the dedicated transfer queue.
+         *
+         * Buffers are created with exclusive sharing, so the buffers written on the transfer
+         * queue have to be released by the transfer family and acquired by the graphics family
+         * before they can be read. The copies and the release go to the transfer queue, which
+         * signals a semaphore that the acquire on the graphics queue waits on. Frames submitted
+         * after this only wait for the copies at the stages that read the buffers, so the graphics
+         * queue keeps working on earlier frames while the copies run.
+         *
+         * Buffers the graphics family already owns are first released by it, once every frame
+         * submitted so far is done reading them, and the copies wait for that on the transfer queue.
+         */
+        bool submitWithOwnershipTransfer(UploadBatch& batch) {
+            VkCommandBufferBeginInfo beginInfo = {};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            bool release = !batch.releaseBarriers.empty();
+            if (release) {
+                vkResetCommandBuffer(batch.releaseCommandBuffer, 0);
+                if (vkBeginCommandBuffer(batch.releaseCommandBuffer, &beginInfo) != VK_SUCCESS)
+                    return false;
+                // earlier frames only read the buffers, so there is nothing to make available
+                vkCmdPipelineBarrier(batch.releaseCommandBuffer, CONSUMER_STAGES, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                    0, 0, nullptr, static_cast<uint32_t>(batch.releaseBarriers.size()), batch.releaseBarriers.data(), 0, nullptr);
+                if (vkEndCommandBuffer(batch.releaseCommandBuffer) != VK_SUCCESS)
+                    return false;
+
+                VkSubmitInfo releaseSubmit = {};
+                releaseSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                releaseSubmit.commandBufferCount = 1;
+                releaseSubmit.pCommandBuffers = &batch.releaseCommandBuffer;
+                releaseSubmit.signalSemaphoreCount = 1;
+                releaseSubmit.pSignalSemaphores = &batch.releaseDone;
+                if (vkQueueSubmit(graphicsQueue, 1, &releaseSubmit, VK_NULL_HANDLE) != VK_SUCCESS)
+                    return false;
+            }
+
+            for (auto& barrier : batch.ownershipBarriers) {
+                barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                barrier.dstAccessMask = 0; // ignored for the release
+            }
+            vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                0, 0, nullptr, static_cast<uint32_t>(batch.ownershipBarriers.size()), batch.ownershipBarriers.data(), 0, nullptr);
+            if (vkEndCommandBuffer(batch.commandBuffer) != VK_SUCCESS)
+                return false;
+
+            vkResetCommandBuffer(batch.acquireCommandBuffer, 0);
+            if (vkBeginCommandBuffer(batch.acquireCommandBuffer, &beginInfo) != VK_SUCCESS)
+                return false;
+            for (auto& barrier : batch.ownershipBarriers) {
+                barrier.srcAccessMask = 0; // ignored for the acquire
+                barrier.dstAccessMask = CONSUMER_ACCESS;
+            }
+            // the semaphore wait happens at CONSUMER_STAGES, so start the barrier there too
+            vkCmdPipelineBarrier(batch.acquireCommandBuffer, CONSUMER_STAGES, CONSUMER_STAGES,
+                0, 0, nullptr, static_cast<uint32_t>(batch.ownershipBarriers.size()), batch.ownershipBarriers.data(), 0, nullptr);
+            if (vkEndCommandBuffer(batch.acquireCommandBuffer) != VK_SUCCESS)
+                return false;
+
+            const VkPipelineStageFlags releaseWaitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+            VkSubmitInfo transferSubmit = {};
+            transferSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            if (release) {
+                transferSubmit.waitSemaphoreCount = 1;
+                transferSubmit.pWaitSemaphores = &batch.releaseDone;
+                transferSubmit.pWaitDstStageMask = &releaseWaitStage;
+            }
+            transferSubmit.commandBufferCount = 1;
+            transferSubmit.pCommandBuffers = &batch.commandBuffer;
+            transferSubmit.signalSemaphoreCount = 1;
+            transferSubmit.pSignalSemaphores = &batch.transferDone;
+            if (vkQueueSubmit(transferQueue, 1, &transferSubmit, VK_NULL_HANDLE) != VK_SUCCESS)
+                return false;
+
+            // the fence goes on the acquire, which can't finish before the copies do
+            VkSubmitInfo acquireSubmit = {};
+            acquireSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            acquireSubmit.waitSemaphoreCount = 1;
+            acquireSubmit.pWaitSemaphores = &batch.transferDone;
+            acquireSubmit.pWaitDstStageMask = &CONSUMER_STAGES;
+            acquireSubmit.commandBufferCount = 1;
+            acquireSubmit.pCommandBuffers = &batch.acquireCommandBuffer;
+            vkResetFences(logicalDevice, 1, &batch.fence);
+            if (vkQueueSubmit(graphicsQueue, 1, &acquireSubmit, batch.fence) != VK_SUCCESS)
+                return false;
+
+            graphicsOwnedBuffers.insert(batch.transferredBuffers.begin(), batch.transferredBuffers.end());
+            inFlightBatches.push_back(static_cast<uint32_t>(&batch - batches));
+            stats.batchesSubmitted++;
+            return true;
+        }
+
+    } // namespace anonymous
+
+    bool createStagingBuffer() {
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDeviceInfo.device, &deviceProperties);
+        ringAlignment = std::max<VkDeviceSize>(16, deviceProperties.limits.optimalBufferCopyOffsetAlignment);
+
+        if (!createBuffer(STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ringBuffer, ringAllocation))
+            return false;
+        ringData = static_cast<uint8_t*>(ringAllocation.mappedData);
+        ringHead = ringTail = 0;
+
+        const auto& indices = physicalDeviceInfo.indices;
+        dedicatedTransferQueue = indices.transferFamily != indices.graphicsFamily;
+
+        // the batches get reset individually, and each only lives for a frame or so. The copies
+        // are recorded on the transfer family, and the acquires (if needed) on the graphics one
+        VkCommandPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = indices.transferFamily;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        if (vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &uploadCommandPool) != VK_SUCCESS)
+            return false;
+        if (dedicatedTransferQueue) {
+            poolInfo.queueFamilyIndex = indices.graphicsFamily;
+            if (vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &acquireCommandPool) != VK_SUCCESS)
+                return false;
+        }
+
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+
+        VkFenceCreateInfo fenceInfo = {};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        VkSemaphoreCreateInfo semaphoreInfo = {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+        for (auto& batch : batches) {
+            allocInfo.commandPool = uploadCommandPool;
+            if (vkAllocateCommandBuffers(logicalDevice, &allocInfo, &batch.commandBuffer) != VK_SUCCESS ||
+                vkCreateFence(logicalDevice, &fenceInfo, nullptr, &batch.fence) != VK_SUCCESS)
+                return false;
+
+            if (dedicatedTransferQueue) {
+                allocInfo.commandPool = acquireCommandPool;
+                if (vkAllocateCommandBuffers(logicalDevice, &allocInfo, &batch.acquireCommandBuffer) != VK_SUCCESS ||
+                    vkAllocateCommandBuffers(logicalDevice, &allocInfo, &batch.releaseCommandBuffer) != VK_SUCCESS ||
+                    vkCreateSemaphore(logicalDevice, &semaphoreInfo, nullptr, &batch.transferDone) != VK_SUCCESS ||
+                    vkCreateSemaphore(logicalDevice, &semaphoreInfo, nullptr, &batch.releaseDone) != VK_SUCCESS)
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    void destroyStagingBuffer() {
+        // anything still being recorded was never needed by a frame, so just drop it
+        if (recordingBatch != -1) {
+            vkEndCommandBuffer(batches[recordingBatch].commandBuffer);
+            recordingBatch = -1;
+        }
+        waitForUploads();
+
+        for (auto& batch : batches) {
+            vkDestroyFence(logicalDevice, batch.fence, nullptr);
+            if (dedicatedTransferQueue) {
+                vkDestroySemaphore(logicalDevice, batch.transferDone, nullptr);
+                vkDestroySemaphore(logicalDevice, batch.releaseDone, nullptr);
+            }
+        }
+        graphicsOwnedBuffers.clear();
+        vkDestroyCommandPool(logicalDevice, uploadCommandPool, nullptr);
+        if (dedicatedTransferQueue)
+            vkDestroyCommandPool(logicalDevice, acquireCommandPool, nullptr);
+        destroyBuffer(ringBuffer, ringAllocation);
+    }
+
+    bool uploadToBuffer(VkBuffer dstBuffer, VkDeviceSize dstOffset, const void* data, VkDeviceSize size) {
+        const uint8_t* src = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            VkDeviceSize chunkSize = std::min(size, MAX_CHUNK_SIZE);
+            VkDeviceSize ringOffset;
+            if (!allocateRingSpace(chunkSize, ringOffset))
+                return false;
+            memcpy(ringData + ringOffset, src, (size_t) chunkSize);
+
+            if (recordingBatch == -1 && !beginBatch())
+                return false;
+
+            if (dedicatedTransferQueue)
+                addOwnershipTransfer(batches[recordingBatch], dstBuffer);
+            VkBufferCopy copyRegion = {};
+            copyRegion.srcOffset = ringOffset;
+            copyRegion.dstOffset = dstOffset;
+            copyRegion.size = chunkSize;
+            vkCmdCopyBuffer(batches[recordingBatch].commandBuffer, ringBuffer, dstBuffer, 1, &copyRegion);
+            batches[recordingBatch].ringEnd = ringHead;
+
+            stats.bytesUploaded += chunkSize;
+            stats.copiesRecorded++;
+            src += chunkSize;
+            dstOffset += chunkSize;
+            size -= chunkSize;
+        }
+
+        return true;
+    }
+
+    bool flushUploads() {
+        if (recordingBatch == -1)
+            return true;
+
+        UploadBatch& batch = batches[recordingBatch];
+        recordingBatch = -1;
+        if (dedicatedTransferQueue)
+            return submitWithOwnershipTransfer(batch);
+
+        // make the copies visible to anything that could read the buffers afterwards. Since the
+        // frames are submitted to the same queue after this, a barrier here is enough
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = CONSUMER_ACCESS;
+        vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, CONSUMER_STAGES,
+            0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        if (vkEndCommandBuffer(batch.commandBuffer) != VK_SUCCESS)
+            return false;
+
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &batch.commandBuffer;
+
+        vkResetFences(logicalDevice, 1, &batch.fence);
+        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, batch.fence) != VK_SUCCESS)
+            return false;
+
+        inFlightBatches.push_back(static_cast<uint32_t>(&batch - batches));
+        stats.batchesSubmitted++;
+        return true;
+    }
+
+    void forgetUploadedBuffer(VkBuffer buffer) {
+        graphicsOwnedBuffers.erase(buffer);
+    }
+
+    void waitForUploads() {
+        while (!inFlightBatches.empty())
+            retireOldestBatch(true);
+    }
+
+    UploadStats getUploadStats() {
+        return stats;
+    }
+
+} // namespace graphics
@@ -0,0 +1,81 @@
+#include "uniform_ring.hpp"
+#include "graphics_api.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+namespace graphics {
+
+    namespace {
+
+        VkBuffer ringBuffer;
+        Allocation ringAllocation;
+        uint8_t* ringData;
+        VkDeviceSize alignment = 256;
+        VkDeviceSize frameSize = 0; // size of each frame's region, a multiple of alignment
+
+        VkDeviceSize frameBegin = 0; // offset of the current frame's region
+        // bytes handed out of it so far. Atomic, so draws can be recorded from several threads
+        std::atomic<VkDeviceSize> frameUsed(0);
+        std::atomic<uint64_t> allocations(0);
+        std::atomic<uint64_t> failedAllocations(0);
+        UniformRingStats stats;
+
+    } // namespace anonymous
+
+    bool createUniformRing(VkDeviceSize bytesPerFrame) {
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDeviceInfo.device, &deviceProperties);
+        alignment = std::max<VkDeviceSize>(16, deviceProperties.limits.minUniformBufferOffsetAlignment);
+        frameSize = (bytesPerFrame + alignment - 1) & ~(alignment - 1);
+
+        // also a vertex buffer, for per instance data that changes every frame
+        if (!createBuffer(frameSize * framesInFlight, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ringBuffer, ringAllocation))
+            return false;
+        ringData = static_cast<uint8_t*>(ringAllocation.mappedData);
+
+        frameBegin = 0;
+        frameUsed = 0;
+        stats = {};
+        stats.bytesPerFrame = frameSize;
+        return true;
+    }
+
+    void destroyUniformRing() {
+        destroyBuffer(ringBuffer, ringAllocation);
+    }
+
+    void beginUniformFrame(uint32_t frameIndex) {
+        stats.peakBytesUsed = std::max(stats.peakBytesUsed, std::min<VkDeviceSize>(frameUsed, frameSize));
+        frameBegin = frameIndex * frameSize;
+        frameUsed = 0;
+    }
+
+    bool allocateUniforms(VkDeviceSize size, void*& data, uint32_t& dynamicOffset) {
+        size = (size + alignment - 1) & ~(alignment - 1);
+        // once the region is full frameUsed keeps growing past frameSize, but nothing more fits
+        VkDeviceSize offset = frameUsed.fetch_add(size, std::memory_order_relaxed);
+        if (offset + size > frameSize) {
+            failedAllocations++;
+            return false;
+        }
+
+        // dynamic offsets are relative to the descriptor's offset, which is the start of the buffer
+        dynamicOffset = static_cast<uint32_t>(frameBegin + offset);
+        data = ringData + dynamicOffset;
+        allocations++;
+        return true;
+    }
+
+    VkBuffer getUniformRingBuffer() {
+        return ringBuffer;
+    }
+
+    UniformRingStats getUniformRingStats() {
+        stats.allocations = allocations;
+        stats.failedAllocations = failedAllocations;
+        return stats;
+    }
+
+} // namespace graphics
@@ -0,0 +1,268 @@
+#include "vertex_layout.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+
+#include <cmath>
+#include <cstring>
+
+namespace graphics {
+
+    namespace {
+
+        /** Range that unorm encodings of an attribute map to [0, 1]. */
+        void semanticRange(VertexSemantic semantic, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+                           glm::vec3& rangeMin, glm::vec3& rangeMax) {
+            switch (semantic) {
+            case VertexSemantic::Position:
+                rangeMin = boundsMin;
+                rangeMax = boundsMax;
+                break;
+            case VertexSemantic::Normal:
+                rangeMin = glm::vec3(-1.0f);
+                rangeMax = glm::vec3(1.0f);
+                break;
+            case VertexSemantic::Color:
+            default:
+                rangeMin = glm::vec3(0.0f);
+                rangeMax = glm::vec3(1.0f);
+                break;
+            }
+        }
+
+        const glm::vec3& attributeOf(const Vertex& vertex, VertexSemantic semantic) {
+            switch (semantic) {
+            case VertexSemantic::Normal: return vertex.normal;
+            case VertexSemantic::Color: return vertex.color;
+            default: return vertex.pos;
+            }
+        }
+
+        glm::vec3& attributeOf(Vertex& vertex, VertexSemantic semantic) {
+            return const_cast<glm::vec3&>(attributeOf(const_cast<const Vertex&>(vertex), semantic));
+        }
+
+        float signNotZero(float value) {
+            return value >= 0.0f ? 1.0f : -1.0f;
+        }
+
+        /** Project a unit vector onto the octahedron |x| + |y| + |z| = 1 and unfold the lower
+         * half over the upper one, giving a point in [-1, 1]^2. Much more even precision for
+         * the bits than storing x and y and reconstructing z.
+         */
+        glm::vec2 octahedralEncode(const glm::vec3& n) {
+            float sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+            if (sum == 0.0f)
+                return glm::vec2(0.0f);
+            glm::vec2 p = glm::vec2(n.x, n.y) / sum;
+            if (n.z < 0.0f)
+                p = glm::vec2((1.0f - std::abs(p.y)) * signNotZero(p.x), (1.0f - std::abs(p.x)) * signNotZero(p.y));
+            return p;
+        }
+
+        glm::vec3 octahedralDecode(const glm::vec2& p) {
+            glm::vec3 n(p.x, p.y, 1.0f - std::abs(p.x) - std::abs(p.y));
+            if (n.z < 0.0f) {
+                float x = n.x;
+                n.x = (1.0f - std::abs(n.y)) * signNotZero(x);
+                n.y = (1.0f - std::abs(x)) * signNotZero(n.y);
+            }
+            return glm::normalize(n);
+        }
+
+        uint16_t toUnorm16(float value) {
+            return static_cast<uint16_t>(std::lround(glm::clamp(value, 0.0f, 1.0f) * 65535.0f));
+        }
+
+        uint8_t toUnorm8(float value) {
+            return static_cast<uint8_t>(std::lround(glm::clamp(value, 0.0f, 1.0f) * 255.0f));
+        }
+
+        int16_t toSnorm16(float value) {
+            return static_cast<int16_t>(std::lround(glm::clamp(value, -1.0f, 1.0f) * 32767.0f));
+        }
+
+    } // namespace anonymous
+
+    VkFormat vertexEncodingFormat(VertexEncoding encoding) {
+        switch (encoding) {
+        case VertexEncoding::Float3: return VK_FORMAT_R32G32B32_SFLOAT;
+        case VertexEncoding::Unorm16x4: return VK_FORMAT_R16G16B16A16_UNORM;
+        case VertexEncoding::Unorm8x4: return VK_FORMAT_R8G8B8A8_UNORM;
+        case VertexEncoding::Octahedral16: return VK_FORMAT_R16G16_SNORM;
+        }
+        return VK_FORMAT_UNDEFINED;
+    }
+
+    uint32_t vertexEncodingSize(VertexEncoding encoding) {
+        switch (encoding) {
+        case VertexEncoding::Float3: return 12;
+        case VertexEncoding::Unorm16x4: return 8;
+        case VertexEncoding::Unorm8x4: return 4;
+        case VertexEncoding::Octahedral16: return 4;
+        }
+        return 0;
+    }
+
+    bool vertexEncodingFromFormat(VkFormat format, VertexEncoding& encoding) {
+        for (VertexEncoding candidate : { VertexEncoding::Float3, VertexEncoding::Unorm16x4,
+                                          VertexEncoding::Unorm8x4, VertexEncoding::Octahedral16 }) {
+            if (vertexEncodingFormat(candidate) == format) {
+                encoding = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    VertexLayout& VertexLayout::add(VertexSemantic semantic, VertexEncoding encoding) {
+        attributes_.push_back({ semantic, encoding, stride_ });
+        stride_ += vertexEncodingSize(encoding); // every encoding is a multiple of 4 bytes
+        return *this;
+    }
+
+    VertexLayout VertexLayout::standard() {
+        VertexLayout layout;
+        layout.add(VertexSemantic::Position, VertexEncoding::Float3)
+              .add(VertexSemantic::Color, VertexEncoding::Float3);
+        return layout;
+    }
+
+    VertexLayout VertexLayout::quantized() {
+        VertexLayout layout;
+        layout.add(VertexSemantic::Position, VertexEncoding::Unorm16x4)
+              .add(VertexSemantic::Color, VertexEncoding::Unorm8x4);
+        return layout;
+    }
+
+    bool VertexLayout::hasQuantizedPosition() const {
+        for (const VertexAttribute& attribute : attributes_) {
+            if (attribute.semantic == VertexSemantic::Position && attribute.encoding != VertexEncoding::Float3)
+                return true;
+        }
+        return false;
+    }
+
+    VkVertexInputBindingDescription VertexLayout::getBindingDescription(uint32_t binding) const {
+        VkVertexInputBindingDescription bindingDescription = {};
+        bindingDescription.binding = binding;
+        bindingDescription.stride = stride_;
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+        return bindingDescription;
+    }
+
+    std::vector<VkVertexInputAttributeDescription> VertexLayout::getAttributeDescriptions(uint32_t binding) const {
+        std::vector<VkVertexInputAttributeDescription> attributeDescriptions(attributes_.size());
+        for (size_t i = 0; i < attributes_.size(); ++i) {
+            attributeDescriptions[i].binding = binding;
+            attributeDescriptions[i].location = static_cast<uint32_t>(attributes_[i].semantic);
+            attributeDescriptions[i].format = vertexEncodingFormat(attributes_[i].encoding);
+            attributeDescriptions[i].offset = attributes_[i].offset;
+        }
+
+        return attributeDescriptions;
+    }
+
+    void VertexLayout::encode(const Vertex* vertices, size_t count, const glm::vec3& boundsMin,
+                              const glm::vec3& boundsMax, void* out) const {
+        uint8_t* bytes = static_cast<uint8_t*>(out);
+        memset(bytes, 0, count * stride_);
+        for (const VertexAttribute& attribute : attributes_) {
+            glm::vec3 rangeMin, rangeMax;
+            semanticRange(attribute.semantic, boundsMin, boundsMax, rangeMin, rangeMax);
+            glm::vec3 extent = rangeMax - rangeMin;
+            glm::vec3 scale(extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                            extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+            uint8_t* dst = bytes + attribute.offset;
+            for (size_t i = 0; i < count; ++i, dst += stride_) {
+                const glm::vec3& value = attributeOf(vertices[i], attribute.semantic);
+                switch (attribute.encoding) {
+                case VertexEncoding::Float3:
+                    memcpy(dst, &value, 12);
+                    break;
+                case VertexEncoding::Unorm16x4: {
+                    glm::vec3 t = (value - rangeMin) * scale;
+                    uint16_t packed[4] = { toUnorm16(t.x), toUnorm16(t.y), toUnorm16(t.z), 0 };
+                    memcpy(dst, packed, 8);
+                    break;
+                }
+                case VertexEncoding::Unorm8x4: {
+                    glm::vec3 t = (value - rangeMin) * scale;
+                    uint8_t packed[4] = { toUnorm8(t.x), toUnorm8(t.y), toUnorm8(t.z), 255 };
+                    memcpy(dst, packed, 4);
+                    break;
+                }
+                case VertexEncoding::Octahedral16: {
+                    glm::vec2 p = octahedralEncode(value);
+                    int16_t packed[2] = { toSnorm16(p.x), toSnorm16(p.y) };
+                    memcpy(dst, packed, 4);
+                    break;
+                }
+                }
+            }
+        }
+    }
+
+    void VertexLayout::decode(const void* data, size_t count, const glm::vec3& boundsMin,
+                              const glm::vec3& boundsMax, Vertex* out) const {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < count; ++i) {
+            out[i].pos = glm::vec3(0.0f);
+            out[i].normal = glm::vec3(0.0f);
+            out[i].color = glm::vec3(1.0f);
+        }
+        for (const VertexAttribute& attribute : attributes_) {
+            glm::vec3 rangeMin, rangeMax;
+            semanticRange(attribute.semantic, boundsMin, boundsMax, rangeMin, rangeMax);
+            glm::vec3 extent = rangeMax - rangeMin;
+
+            const uint8_t* src = bytes + attribute.offset;
+            for (size_t i = 0; i < count; ++i, src += stride_) {
+                glm::vec3& value = attributeOf(out[i], attribute.semantic);
+                switch (attribute.encoding) {
+                case VertexEncoding::Float3:
+                    memcpy(&value, src, 12);
+                    break;
+                case VertexEncoding::Unorm16x4: {
+                    uint16_t packed[4];
+                    memcpy(packed, src, 8);
+                    value = rangeMin + glm::vec3(packed[0], packed[1], packed[2]) / 65535.0f * extent;
+                    break;
+                }
+                case VertexEncoding::Unorm8x4: {
+                    uint8_t packed[4];
+                    memcpy(packed, src, 4);
+                    value = rangeMin + glm::vec3(packed[0], packed[1], packed[2]) / 255.0f * extent;
+                    break;
+                }
+                case VertexEncoding::Octahedral16: {
+                    int16_t packed[2];
+                    memcpy(packed, src, 4);
+                    glm::vec2 p = glm::max(glm::vec2(packed[0], packed[1]) / 32767.0f, glm::vec2(-1.0f));
+                    value = octahedralDecode(p);
+                    break;
+                }
+                }
+            }
+        }
+    }
+
+    glm::mat4 VertexLayout::dequantizeTransform(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const {
+        if (!hasQuantizedPosition())
+            return glm::mat4(1.0f);
+        return glm::scale(glm::translate(glm::mat4(1.0f), boundsMin), boundsMax - boundsMin);
+    }
+
+    bool VertexLayout::operator==(const VertexLayout& other) const {
+        if (stride_ != other.stride_ || attributes_.size() != other.attributes_.size())
+            return false;
+        for (size_t i = 0; i < attributes_.size(); ++i) {
+            if (attributes_[i].semantic != other.attributes_[i].semantic ||
+                    attributes_[i].encoding != other.attributes_[i].encoding ||
+                    attributes_[i].offset != other.attributes_[i].offset)
+                return false;
+        }
+        return true;
+    }
+
+} // namespace graphics
@@ -0,0 +1,113 @@
+#include "worker_threads.hpp"
+#include "cpu_profiler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace graphics {
+
+    namespace {
+
+        std::vector<std::thread> workers;
+        std::mutex jobMutex;
+        std::condition_variable jobStarted;
+        std::condition_variable jobFinished;
+        bool shuttingDown = false;
+
+        // the job being run. jobId changes for every job, so the workers can tell a new job
+        // from the one they just finished
+        const std::function<void(uint32_t, uint32_t)>* job = nullptr;
+        uint64_t jobId = 0;
+        uint32_t jobTaskCount = 0;
+        std::atomic<uint32_t> nextTask(0);
+        uint32_t busyWorkers = 0;
+
+        /** Grab tasks off the current job until there are none left. */
+        void runTasks(const std::function<void(uint32_t, uint32_t)>& task, uint32_t taskCount, uint32_t thread) {
+            for (uint32_t i = nextTask++; i < taskCount; i = nextTask++)
+                task(i, thread);
+        }
+
+        void workerMain(uint32_t thread) {
+            PROFILE_THREAD("worker");
+            uint64_t lastJob = 0;
+            std::unique_lock<std::mutex> lock(jobMutex);
+            while (true) {
+                jobStarted.wait(lock, [&] { return shuttingDown || jobId != lastJob; });
+                if (shuttingDown)
+                    return;
+                lastJob = jobId;
+                // woke up after the job was already finished by everyone else
+                if (!job)
+                    continue;
+                auto* task = job;
+                uint32_t taskCount = jobTaskCount;
+                busyWorkers++;
+
+                lock.unlock();
+                runTasks(*task, taskCount, thread);
+                lock.lock();
+
+                if (--busyWorkers == 0)
+                    jobFinished.notify_one();
+            }
+        }
+
+    } // namespace anonymous
+
+    bool createWorkerThreads(uint32_t count) {
+        if (count == 0)
+            count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+
+        shuttingDown = false;
+        for (uint32_t i = 0; i < count; ++i)
+            workers.emplace_back(workerMain, i + 1); // thread 0 is the caller
+        return true;
+    }
+
+    void destroyWorkerThreads() {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            shuttingDown = true;
+        }
+        jobStarted.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+    uint32_t workerThreadCount() {
+        return static_cast<uint32_t>(workers.size()) + 1;
+    }
+
+    void runOnWorkers(uint32_t taskCount, const std::function<void(uint32_t task, uint32_t thread)>& task) {
+        // not worth waking anyone up for a single task
+        if (workers.empty() || taskCount <= 1) {
+            for (uint32_t i = 0; i < taskCount; ++i)
+                task(i, 0);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            job = &task;
+            jobTaskCount = taskCount;
+            nextTask = 0;
+            jobId++;
+        }
+        jobStarted.notify_all();
+
+        runTasks(task, taskCount, 0);
+
+        // every task has been picked up at this point, wait for the ones still running. A
+        // worker that wakes up late just finds no tasks left
+        std::unique_lock<std::mutex> lock(jobMutex);
+        jobFinished.wait(lock, [] { return busyWorkers == 0; });
+        job = nullptr;
+    }
+
+} // namespace graphics
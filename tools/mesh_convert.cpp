@@ -0,0 +1,104 @@
+#include "mesh_cache.hpp"
+#include "mesh_loader.hpp"
+#include "mesh_optimizer.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/** Converts OBJ files to the binary .mesh format (see mesh_cache.hpp), or checks .mesh files.
+ *
+ *     mesh_convert [--no-optimize] [--no-lods] [--quantize] input.obj output.mesh
+ *     mesh_convert --verify file.mesh [file.mesh ...]
+ */
+
+static double millisecondsSince(std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static bool verify(const std::string& path) {
+    auto start = std::chrono::high_resolution_clock::now();
+    graphics::MeshCache cache;
+    if (!cache.open(path, true))
+        return false;
+    const graphics::MeshCacheHeader& header = cache.header();
+    graphics::VertexLayout layout;
+    std::cout << path << ": " << header.vertexCount << " vertices (" << header.vertexStride << " bytes each), "
+              << header.lods[0].indexCount / 3 << " triangles, " << header.lodCount << " levels of detail, "
+              << (header.indexType == VK_INDEX_TYPE_UINT16 ? 16 : 32) << " bit indices, "
+              << (cache.getVertexLayout(layout) ? (layout.hasQuantizedPosition() ? "quantized, " : "") : "unknown vertex layout, ")
+              << "ok in " << millisecondsSince(start) << " ms" << std::endl;
+    return true;
+}
+
+static void printCacheStats(const char* label, const graphics::VertexCacheStats& stats) {
+    std::cout << "  " << label << ": ACMR " << stats.acmr << ", ATVR " << stats.atvr << ", "
+              << stats.verticesTransformed << " vertex shader invocations" << std::endl;
+}
+
+static bool convert(const std::string& input, const std::string& output, bool optimize, bool lods, bool quantize) {
+    graphics::MeshData mesh;
+    graphics::MeshLoadStats stats;
+    if (!graphics::loadObj(input, mesh, &stats))
+        return false;
+    std::cout << input << ": " << stats.bytesRead / (1024.0 * 1024.0) << " MB parsed in "
+              << stats.milliseconds << " ms" << std::endl;
+
+    if (optimize) {
+        graphics::MeshOptimizeStats optimizeStats;
+        graphics::optimizeMesh(mesh, &optimizeStats);
+        std::cout << "optimized in " << optimizeStats.milliseconds << " ms, "
+                  << optimizeStats.clusters << " overdraw clusters" << std::endl;
+        printCacheStats("before", optimizeStats.before);
+        printCacheStats("after", optimizeStats.after);
+    }
+
+    // after optimizing, since the levels share the optimized vertex order
+    if (lods) {
+        auto lodStart = std::chrono::high_resolution_clock::now();
+        graphics::generateLods(mesh);
+        std::cout << mesh.lods.size() << " levels of detail in " << millisecondsSince(lodStart) << " ms" << std::endl;
+        for (size_t i = 0; i < mesh.lods.size(); ++i)
+            std::cout << "  " << i + 1 << ": " << mesh.lods[i].indices.size() / 3 << " triangles, error "
+                      << mesh.lods[i].error << std::endl;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    auto layout = quantize ? graphics::VertexLayout::quantized() : graphics::VertexLayout::standard();
+    if (!graphics::writeMeshCache(output, mesh, layout))
+        return false;
+    std::cout << output << ": written in " << millisecondsSince(start) << " ms" << std::endl;
+
+    // read it back, so a broken file never goes unnoticed
+    return verify(output);
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 3 && !strcmp(argv[1], "--verify")) {
+        bool ok = true;
+        for (int i = 2; i < argc; ++i)
+            ok = verify(argv[i]) && ok;
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    bool optimize = true, lods = true, quantize = false;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--no-optimize"))
+            optimize = false;
+        else if (!strcmp(argv[i], "--no-lods"))
+            lods = false;
+        else if (!strcmp(argv[i], "--quantize"))
+            quantize = true;
+        else
+            paths.push_back(argv[i]);
+    }
+    if (paths.size() == 2)
+        return convert(paths[0], paths[1], optimize, lods, quantize) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    std::cout << "usage: " << argv[0] << " [--no-optimize] [--no-lods] [--quantize] input.obj output.mesh" << std::endl
+              << "       " << argv[0] << " --verify file.mesh [file.mesh ...]" << std::endl;
+    return EXIT_FAILURE;
+}